@@ -0,0 +1,190 @@
+// Counted aggregation, the same output as
+// "sort | uniq -c | tr [a-z] [A-Z] | nl -s '. '" in one pass.
+//
+// Mapped input is split into one range per thread and every thread counts
+// its lines in its own open addressing hash table (keys point into the
+// mapping, nothing is copied). Tables are merged at the end and only the
+// distinct keys are sorted, so duplicates never reach the sort.
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <thread>
+#include "inproc.h"
+#include "radix_sort.h"
+#include "stats.h"
+
+#define AGG_INITIAL_SLOTS 1024  // power of two
+#define AGG_COUNT_WIDTH 7       // uniq -c prints "%7lu "
+
+struct agg_entry {
+    const char *data;
+    size_t len;
+    uint64_t hash;
+    uint64_t count;             // 0 = empty slot
+};
+
+struct agg_table {
+    std::vector<agg_entry> slots;
+    size_t used;
+};
+
+inline uint64_t agg_hash(const char *data, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+    }
+    if (i < len) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, len - i);
+        h = (h ^ word) * 0xBF58476D1CE4E5B9ULL;
+    }
+    h ^= h >> 29;
+    h *= 0x94D049BB133111EBULL;
+    return h ^ (h >> 32);
+}
+
+inline void agg_init(agg_table &table) {
+    agg_entry empty = { NULL, 0, 0, 0 };
+    table.slots.assign(AGG_INITIAL_SLOTS, empty);
+    table.used = 0;
+}
+
+inline agg_entry &agg_slot(agg_table &table, const char *data, size_t len, uint64_t hash) {
+    size_t mask = table.slots.size() - 1;
+    size_t pos = hash & mask;
+    while (1) {
+        agg_entry &entry = table.slots[pos];
+        if (entry.count == 0) return entry;
+        if (entry.hash == hash && entry.len == len && memcmp(entry.data, data, len) == 0) return entry;
+        pos = (pos + 1) & mask;
+    }
+}
+
+inline void agg_add(agg_table &table, const char *data, size_t len, uint64_t hash, uint64_t count);
+
+// Table is kept at most half full
+inline void agg_grow(agg_table &table) {
+    std::vector<agg_entry> old;
+    old.swap(table.slots);
+    agg_entry empty = { NULL, 0, 0, 0 };
+    table.slots.assign(old.size() * 2, empty);
+    table.used = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+        if (old[i].count) agg_add(table, old[i].data, old[i].len, old[i].hash, old[i].count);
+    }
+}
+
+inline void agg_add(agg_table &table, const char *data, size_t len, uint64_t hash, uint64_t count) {
+    agg_entry &entry = agg_slot(table, data, len, hash);
+    if (entry.count == 0) {
+        entry.data = data;
+        entry.len = len;
+        entry.hash = hash;
+        entry.count = count;
+        if (++table.used * 2 > table.slots.size()) agg_grow(table);
+        return;
+    }
+    entry.count += count;
+}
+
+inline void agg_count_range(agg_table &table, const char *data, size_t len) {
+    agg_init(table);
+    const char *pos = data;
+    const char *end = data + len;
+    while (pos < end) {
+        const char *nl = (const char *)memchr(pos, '\n', end - pos);
+        if (!nl) nl = end;
+        agg_add(table, pos, nl - pos, agg_hash(pos, nl - pos), 1);
+        pos = nl + 1;
+    }
+}
+
+//***************************************************************************
+
+// Writes "N.     count KEY" lines for sorted distinct keys
+inline void agg_emit(agg_table &table, int fd_out) {
+    std::vector<line_view> keys;
+    keys.reserve(table.used);
+    for (size_t i = 0; i < table.slots.size(); i++) {
+        if (table.slots[i].count) {
+            line_view key = { table.slots[i].data, table.slots[i].len };
+            keys.push_back(key);
+        }
+    }
+
+    stats_phase("sort");
+    radix_sort_lines(keys);
+
+    stats_phase("number");
+    out_buffer out;
+    out_init(out, fd_out, true);
+    nl_state state;
+    nl_init(state);
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        uint64_t count = agg_slot(table, keys[i].data, keys[i].len, agg_hash(keys[i].data, keys[i].len)).count;
+
+        // uniq -c line is never empty nor nl delimiter, so it always gets a number
+        char *dst = out_reserve(out, keys[i].len + 64);
+        size_t len = nl_prefix(state, dst, 1);
+        len += sprintf(dst + len, "%*llu ", AGG_COUNT_WIDTH, (unsigned long long)count);
+        memcpy(dst + len, keys[i].data, keys[i].len);
+        len += keys[i].len;
+        dst[len++] = '\n';
+        out.used += len;
+    }
+    out_free(out);
+}
+
+inline int run_aggregate_pipeline(const char *filename, int fd_out, int threads) {
+    stats_phase("count");
+    mapped_file file;
+    if (map_file(filename, file) != 0) return -1;
+    if (file.size == 0) return 0;
+    if (threads < 1) threads = 1;
+
+    // Ranges end after '\n'
+    std::vector<const char *> cuts;
+    cuts.push_back(file.data);
+    for (int i = 1; i < threads; i++) {
+        const char *cut = file.data + file.size / threads * i;
+        if (cut < cuts.back()) cut = cuts.back();
+        const char *end = file.data + file.size;
+        const char *nl = (const char *)memchr(cut, '\n', end - cut);
+        cuts.push_back(nl ? nl + 1 : end);
+    }
+    cuts.push_back(file.data + file.size);
+
+    std::vector<agg_table> tables(threads);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(std::thread(agg_count_range, std::ref(tables[i]), cuts[i], cuts[i + 1] - cuts[i]));
+    }
+    agg_count_range(tables[0], cuts[0], cuts[1] - cuts[0]);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+    stats_phase("merge");
+    for (int i = 1; i < threads; i++) {
+        for (size_t s = 0; s < tables[i].slots.size(); s++) {
+            const agg_entry &entry = tables[i].slots[s];
+            if (entry.count) agg_add(tables[0], entry.data, entry.len, entry.hash, entry.count);
+        }
+        std::vector<agg_entry>().swap(tables[i].slots);
+    }
+
+    agg_emit(tables[0], fd_out);
+    unmap_file(file);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,421 @@
+// Throughput benchmark of the names pipeline on synthetic corpora.
+//
+// Corpora are generated into a directory and reused by later runs. Names
+// are random words "Xxxxx" with chosen length distribution. Line k of the
+// corpus is name number r(k) from a vocabulary of 'distinct' names, where
+// r(k) is uniform or Zipf distributed, so duplication can be controlled
+// without keeping the vocabulary in memory.
+//
+// Every mode runs ./main with output to /dev/null and --stats. Results are
+// printed as CSV, one "total" row per run and one row per pipeline stage.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+
+#define DEFAULT_MAIN "./main"
+#define DEFAULT_DIR  "/tmp"
+#define DEFAULT_MODES "exec,exec-simd,inproc,extsort,spec"
+
+enum len_dist { LEN_UNIFORM, LEN_NORMAL };
+enum dup_dist { DUP_UNIFORM, DUP_ZIPF };
+
+struct corpus_config {
+    unsigned long long lines;
+    unsigned long long distinct;    // 0 = same as lines
+    int len_min;
+    int len_max;
+    len_dist len;
+    dup_dist dup;
+    double zipf_s;
+    unsigned long long seed;
+};
+
+//***************************************************************************
+// random numbers
+
+inline unsigned long long splitmix64(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+inline double to_unit(unsigned long long x) {
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Name number 'rank' is always the same word for the same seed
+int make_name(const corpus_config &config, unsigned long long rank, char *dst) {
+    unsigned long long h = splitmix64(config.seed ^ (rank * 0x2545F4914F6CDD1DULL));
+    int span = config.len_max - config.len_min + 1;
+    int len;
+    if (config.len == LEN_NORMAL) {
+        // Sum of four uniforms is close enough to normal distribution
+        double sum = 0;
+        for (int i = 0; i < 4; i++) {
+            h = splitmix64(h);
+            sum += to_unit(h);
+        }
+        len = config.len_min + (int)(sum / 4 * span);
+    } else {
+        len = config.len_min + (int)(h % span);
+    }
+    if (len > config.len_max) len = config.len_max;
+
+    for (int i = 0; i < len; i++) {
+        h = splitmix64(h);
+        dst[i] = (i == 0 ? 'A' : 'a') + h % 26;
+    }
+    return len;
+}
+
+// Zipf by inversion of the continuous power law, good enough for sizing
+unsigned long long pick_rank(const corpus_config &config, unsigned long long line, unsigned long long distinct) {
+    double u = to_unit(splitmix64(config.seed + line * 0x9E3779B97F4A7C15ULL + 1));
+    if (config.dup == DUP_UNIFORM) return (unsigned long long)(u * distinct);
+
+    double s = config.zipf_s;
+    double n = (double)distinct;
+    double x;
+    if (fabs(s - 1.0) < 1e-9) {
+        x = exp(u * log(n + 1.0)) - 1.0;
+    } else {
+        double a = pow(n + 1.0, 1.0 - s) - 1.0;
+        x = pow(a * u + 1.0, 1.0 / (1.0 - s)) - 1.0;
+    }
+    unsigned long long rank = (unsigned long long)x;
+    return rank < distinct ? rank : distinct - 1;
+}
+
+std::string corpus_path(const char *dir, const corpus_config &config) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s/names-%llu-d%llu-l%d-%d%s-%s%.2f-s%llu.txt", dir,
+             config.lines, config.distinct, config.len_min, config.len_max,
+             config.len == LEN_NORMAL ? "n" : "u",
+             config.dup == DUP_ZIPF ? "z" : "u", config.zipf_s, config.seed);
+    return name;
+}
+
+// Writes corpus unless the file already exists
+int generate_corpus(const std::string &path, const corpus_config &config) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) return 0;
+
+    std::string tmp = path + ".part";
+    int fd = open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open corpus");
+        return -1;
+    }
+
+    unsigned long long distinct = config.distinct ? config.distinct : config.lines;
+    std::vector<char> buffer(1 << 20);
+    size_t used = 0;
+
+    for (unsigned long long line = 0; line < config.lines; line++) {
+        if (used + config.len_max + 1 > buffer.size()) {
+            if (write(fd, &buffer[0], used) != (ssize_t)used) {
+                perror("write corpus");
+                close(fd);
+                return -1;
+            }
+            used = 0;
+        }
+        used += make_name(config, pick_rank(config, line, distinct), &buffer[used]);
+        buffer[used++] = '\n';
+    }
+    if (write(fd, &buffer[0], used) != (ssize_t)used) {
+        perror("write corpus");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp.c_str(), path.c_str());
+}
+
+//***************************************************************************
+// running modes
+
+struct bench_mode {
+    const char *name;
+    std::vector<std::string> args;
+};
+
+bool find_mode(const std::string &name, const std::string &spec, bench_mode &mode) {
+    mode.args.clear();
+    if (name == "exec") {
+        mode.name = "exec";
+        mode.args.push_back("-m"); mode.args.push_back("exec");
+    } else if (name == "exec-simd") {
+        mode.name = "exec-simd";
+        mode.args.push_back("-m"); mode.args.push_back("exec");
+        mode.args.push_back("--upper"); mode.args.push_back("simd");
+    } else if (name == "inproc") {
+        mode.name = "inproc";
+        mode.args.push_back("-m"); mode.args.push_back("inproc");
+    } else if (name == "extsort") {
+        mode.name = "extsort";
+        mode.args.push_back("-m"); mode.args.push_back("extsort");
+    } else if (name == "count") {
+        mode.name = "count";
+        mode.args.push_back("-c");
+    } else if (name == "count-exec") {
+        mode.name = "count-exec";
+        mode.args.push_back("-c");
+        mode.args.push_back("-m"); mode.args.push_back("exec");
+    } else if (name == "spec") {
+        mode.name = "spec";
+        mode.args.push_back("-p"); mode.args.push_back(spec);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct run_result {
+    double wall;
+    struct rusage usage;    // main and all its reaped children
+    std::string stats;      // content of --stats file
+    bool ok;
+};
+
+run_result run_mode(const char *main_path, const bench_mode &mode, const std::vector<std::string> &extra,
+                    const std::string &corpus) {
+    run_result result;
+    result.ok = false;
+
+    char stats_path[] = "/tmp/bench-stats-XXXXXX";
+    int stats_fd = mkstemp(stats_path);
+    if (stats_fd == -1) {
+        perror("mkstemp");
+        return result;
+    }
+    close(stats_fd);
+
+    std::vector<std::string> args;
+    args.push_back(main_path);
+    args.insert(args.end(), mode.args.begin(), mode.args.end());
+    args.insert(args.end(), extra.begin(), extra.end());
+    args.push_back("--stats");
+    args.push_back(stats_path);
+    args.push_back(corpus);
+
+    double start = now_sec();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+
+        std::vector<char *> argv;
+        for (size_t i = 0; i < args.size(); i++) argv.push_back((char *)args[i].c_str());
+        argv.push_back(NULL);
+        execv(argv[0], &argv[0]);
+        perror("execv");
+        exit(127);
+    }
+
+    int status;
+    wait4(pid, &status, 0, &result.usage);
+    result.wall = now_sec() - start;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    FILE *file = fopen(stats_path, "r");
+    if (file) {
+        char line[512];
+        while (fgets(line, sizeof(line), file)) result.stats += line;
+        fclose(file);
+    }
+    unlink(stats_path);
+    return result;
+}
+
+inline double tv_sec(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void print_result(const corpus_config &config, long long bytes, const bench_mode &mode, int run,
+                  const run_result &result) {
+    printf("%llu,%lld,%s,%d,total,%.6f,%.6f,%.6f,%ld,%.0f,%s\n",
+           config.lines, bytes, mode.name, run, result.wall,
+           tv_sec(result.usage.ru_utime), tv_sec(result.usage.ru_stime), result.usage.ru_maxrss,
+           result.wall > 0 ? config.lines / result.wall : 0.0, result.ok ? "ok" : "failed");
+
+    // Stage lines from main are "stage,user,sys,maxrss"
+    size_t pos = 0;
+    while (pos < result.stats.size()) {
+        size_t end = result.stats.find('\n', pos);
+        if (end == std::string::npos) end = result.stats.size();
+        std::string line = result.stats.substr(pos, end - pos);
+        pos = end + 1;
+
+        char stage[128];
+        double user, sys;
+        long maxrss;
+        if (sscanf(line.c_str(), "%127[^,],%lf,%lf,%ld", stage, &user, &sys, &maxrss) != 4) continue;
+        printf("%llu,%lld,%s,%d,%s,,%.6f,%.6f,%ld,,\n",
+               config.lines, bytes, mode.name, run, stage, user, sys, maxrss);
+    }
+    fflush(stdout);
+}
+
+//***************************************************************************
+
+// Parses count with optional K, M or G suffix (decimal)
+unsigned long long parse_count(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': value *= 1e3; break;
+        case 'm': case 'M': value *= 1e6; break;
+        case 'g': case 'G': case 'b': case 'B': value *= 1e9; break;
+    }
+    return (unsigned long long)value;
+}
+
+std::vector<std::string> split_list(const char *text) {
+    std::vector<std::string> items;
+    std::string item;
+    for (const char *c = text; ; c++) {
+        if (*c == ',' || *c == '\0') {
+            if (!item.empty()) items.push_back(item);
+            item.clear();
+            if (*c == '\0') break;
+        } else {
+            item += *c;
+        }
+    }
+    return items;
+}
+
+void help(const char *program_name) {
+    printf("Usage: %s [options]\n", program_name);
+    printf("Options:\n");
+    printf("  --lines list      corpus sizes, e.g. 1M,10M,100M,1B (default 1M)\n");
+    printf("  --distinct n      distinct names, 0 = as many as lines (default 0)\n");
+    printf("  --ratio r         distinct names as fraction of lines, overrides --distinct\n");
+    printf("  --len min-max     name length range (default 3-12)\n");
+    printf("  --len-dist d      uniform|normal (default normal)\n");
+    printf("  --dup-dist d      uniform|zipf (default uniform)\n");
+    printf("  --zipf s          Zipf exponent (default 1.0)\n");
+    printf("  --seed n          generator seed (default 1)\n");
+    printf("  --dir path        corpus directory (default %s)\n", DEFAULT_DIR);
+    printf("  --modes list      %s,count,count-exec\n", DEFAULT_MODES);
+    printf("  --spec spec       pipeline for mode spec (default \"sort | @upper | @nl\")\n");
+    printf("  --main path       pipeline binary (default %s)\n", DEFAULT_MAIN);
+    printf("  --repeat n        runs per mode and corpus (default 1)\n");
+    printf("  --arg a           extra argument for main, may repeat (e.g. --arg --threads --arg 4)\n");
+    printf("  --generate-only   only write corpora\n");
+    printf("  -h                show help\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    corpus_config config;
+    config.distinct = 0;
+    config.len_min = 3;
+    config.len_max = 12;
+    config.len = LEN_NORMAL;
+    config.dup = DUP_UNIFORM;
+    config.zipf_s = 1.0;
+    config.seed = 1;
+
+    std::vector<std::string> sizes;
+    sizes.push_back("1M");
+    std::vector<std::string> modes = split_list(DEFAULT_MODES);
+    std::vector<std::string> extra;
+    const char *dir = DEFAULT_DIR;
+    const char *main_path = DEFAULT_MAIN;
+    std::string spec = "sort | @upper | @nl";
+    double ratio = -1;
+    int repeat = 1;
+    bool generate_only = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-h") == 0) help(argv[0]);
+        else if (strcmp(arg, "--lines") == 0 && has_value) sizes = split_list(argv[++i]);
+        else if (strcmp(arg, "--distinct") == 0 && has_value) config.distinct = parse_count(argv[++i]);
+        else if (strcmp(arg, "--ratio") == 0 && has_value) ratio = atof(argv[++i]);
+        else if (strcmp(arg, "--len") == 0 && has_value) {
+            if (sscanf(argv[++i], "%d-%d", &config.len_min, &config.len_max) != 2) help(argv[0]);
+        }
+        else if (strcmp(arg, "--len-dist") == 0 && has_value) {
+            config.len = strcmp(argv[++i], "uniform") == 0 ? LEN_UNIFORM : LEN_NORMAL;
+        }
+        else if (strcmp(arg, "--dup-dist") == 0 && has_value) {
+            config.dup = strcmp(argv[++i], "zipf") == 0 ? DUP_ZIPF : DUP_UNIFORM;
+        }
+        else if (strcmp(arg, "--zipf") == 0 && has_value) config.zipf_s = atof(argv[++i]);
+        else if (strcmp(arg, "--seed") == 0 && has_value) config.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(arg, "--dir") == 0 && has_value) dir = argv[++i];
+        else if (strcmp(arg, "--modes") == 0 && has_value) modes = split_list(argv[++i]);
+        else if (strcmp(arg, "--spec") == 0 && has_value) spec = argv[++i];
+        else if (strcmp(arg, "--main") == 0 && has_value) main_path = argv[++i];
+        else if (strcmp(arg, "--repeat") == 0 && has_value) repeat = atoi(argv[++i]);
+        else if (strcmp(arg, "--arg") == 0 && has_value) extra.push_back(argv[++i]);
+        else if (strcmp(arg, "--generate-only") == 0) generate_only = true;
+        else {
+            fprintf(stderr, "Unknown option '%s'.\n", arg);
+            help(argv[0]);
+        }
+    }
+
+    if (config.len_min < 1 || config.len_max < config.len_min || repeat < 1) help(argv[0]);
+
+    std::vector<bench_mode> mode_list;
+    for (size_t m = 0; m < modes.size(); m++) {
+        bench_mode mode;
+        if (!find_mode(modes[m], spec, mode)) {
+            fprintf(stderr, "Unknown mode '%s'.\n", modes[m].c_str());
+            exit(1);
+        }
+        mode_list.push_back(mode);
+    }
+
+    if (!generate_only) {
+        printf("lines,bytes,mode,run,stage,wall_s,user_s,sys_s,peak_rss_kb,lines_per_s,status\n");
+    }
+
+    for (size_t s = 0; s < sizes.size(); s++) {
+        config.lines = parse_count(sizes[s].c_str());
+        if (config.lines == 0) continue;
+        corpus_config corpus = config;
+        if (ratio > 0) corpus.distinct = (unsigned long long)(ratio * corpus.lines);
+        if (corpus.distinct > corpus.lines) corpus.distinct = 0;
+
+        std::string path = corpus_path(dir, corpus);
+        fprintf(stderr, "corpus %s\n", path.c_str());
+        if (generate_corpus(path, corpus) != 0) exit(1);
+        if (generate_only) continue;
+
+        struct stat st;
+        long long bytes = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+
+        for (size_t m = 0; m < mode_list.size(); m++) {
+            for (int r = 0; r < repeat; r++) {
+                run_result result = run_mode(main_path, mode_list[m], extra, path);
+                print_result(corpus, bytes, mode_list[m], r, result);
+            }
+        }
+    }
+    return 0;
+}
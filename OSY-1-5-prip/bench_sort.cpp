@@ -0,0 +1,173 @@
+// Benchmark of radix_sort.h against std::sort and "LC_ALL=C sort".
+//
+// Input file is repeated until it has the requested number of lines (the
+// copies make it closer to real dumps with duplicates). Radix sort result
+// is checked against std::sort before the times are printed.
+//
+// With -p the input is generated instead: lines "a", "aa", ... up to the
+// given length in reverse order. Every level of radix sort splits off a
+// single line, which used to overflow the stack at 4000 (8 MB of input).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "radix_sort.h"
+#include "inproc.h"
+
+#define DEFAULT_INPUT "names.txt"
+#define DEFAULT_ROUNDS 3
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double bench_std_sort(const std::vector<line_view> &source, std::vector<line_view> &work, int rounds) {
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        work = source;
+        double start = now_sec();
+        std::sort(work.begin(), work.end(), line_less);
+        double elapsed = now_sec() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+double bench_radix_sort(const std::vector<line_view> &source, std::vector<line_view> &work, int rounds) {
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        work = source;
+        double start = now_sec();
+        radix_sort_lines(work);
+        double elapsed = now_sec() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// sort(1) reads the file and writes to /dev/null, so I/O is included
+double bench_sort_command(const char *filename, int rounds) {
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        double start = now_sec();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+            setenv("LC_ALL", "C", 1);
+            execlp("sort", "sort", filename, (char *)NULL);
+            perror("execlp sort");
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        double elapsed = now_sec() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+void print_result(const char *name, size_t lines, double seconds) {
+    if (seconds < 0) {
+        printf("%-10s  failed\n", name);
+        return;
+    }
+    printf("%-10s %10.3f ms %8.2f Mlines/s\n", name, seconds * 1e3, lines / seconds / 1e6);
+}
+
+void help(const char *program_name) {
+    printf("Usage: %s [-h] [-n lines] [-r rounds] [-p length] [input_file]\n", program_name);
+    printf("Options:\n");
+    printf("  -n lines   number of lines, input is repeated (default lines of input)\n");
+    printf("  -r rounds  rounds per sort, best one is reported (default %d)\n", DEFAULT_ROUNDS);
+    printf("  -p length  nested prefixes up to length bytes instead of input_file\n");
+    printf("  -h         show help\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    const char *filename = DEFAULT_INPUT;
+    size_t wanted = 0;
+    int rounds = DEFAULT_ROUNDS;
+    size_t nested = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) wanted = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) nested = strtoul(argv[++i], NULL, 10);
+        else filename = argv[i];
+    }
+    if (rounds <= 0) help(argv[0]);
+
+    mapped_file file = mapped_file();
+    std::string generated;
+    std::vector<line_view> input;
+    if (nested > 0) {
+        for (size_t len = nested; len > 0; len--) generated.append(len, 'a').push_back('\n');
+        split_lines(generated.data(), generated.size(), input);
+    } else {
+        if (map_file(filename, file) != 0) exit(1);
+        split_lines(file.data, file.size, input);
+    }
+    if (input.empty()) {
+        fprintf(stderr, "Input file is empty.\n");
+        exit(1);
+    }
+
+    std::vector<line_view> source;
+    if (wanted == 0) wanted = input.size();
+    while (source.size() < wanted) {
+        size_t take = std::min(input.size(), wanted - source.size());
+        source.insert(source.end(), input.begin(), input.begin() + take);
+    }
+
+    // Data for sort(1) has to be the same as in memory
+    char path[] = "/tmp/bench-sort-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    out_buffer out;
+    out_init(out, fd);
+    for (size_t i = 0; i < source.size(); i++) {
+        char *dst = out_reserve(out, source[i].len + 1);
+        memcpy(dst, source[i].data, source[i].len);
+        dst[source[i].len] = '\n';
+        out.used += source[i].len + 1;
+    }
+    out_free(out);
+    close(fd);
+
+    printf("%zu lines, best of %d rounds\n", source.size(), rounds);
+
+    std::vector<line_view> expected, work;
+    double std_time = bench_std_sort(source, expected, rounds);
+    double radix_time = bench_radix_sort(source, work, rounds);
+
+    bool same = work.size() == expected.size();
+    for (size_t i = 0; same && i < work.size(); i++) {
+        same = work[i].len == expected[i].len && memcmp(work[i].data, expected[i].data, work[i].len) == 0;
+    }
+
+    print_result("std::sort", source.size(), std_time);
+    if (same) print_result("radix", source.size(), radix_time);
+    else printf("%-10s  wrong result\n", "radix");
+    print_result("sort", source.size(), bench_sort_command(path, rounds));
+
+    unlink(path);
+    if (nested == 0) unmap_file(file);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+// Micro-benchmark of uppercase kernels from upper.h against "tr [a-z] [A-Z]".
+//
+// Test data are names from the input file repeated up to requested size.
+// Every kernel result is compared with the scalar version before timing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "upper.h"
+
+#define DEFAULT_INPUT "names.txt"
+#define DEFAULT_SIZE_MB 64
+#define DEFAULT_ROUNDS 10
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills buffer with file content repeated, random letters if file is missing
+void fill_buffer(char *buffer, size_t size, const char *filename) {
+    size_t filled = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1) {
+        ssize_t n = read(fd, buffer, size);
+        if (n > 0) filled = n;
+        close(fd);
+    }
+
+    if (filled == 0) {
+        const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\n-";
+        for (size_t i = 0; i < size; i++) buffer[i] = chars[rand() % (sizeof(chars) - 1)];
+        return;
+    }
+
+    while (filled < size) {
+        size_t chunk = filled < size - filled ? filled : size - filled;
+        memcpy(buffer + filled, buffer, chunk);
+        filled += chunk;
+    }
+}
+
+// Best time of several rounds, the source is restored before each round
+double bench_kernel(upper_fn fn, char *work, const char *source, size_t size, int rounds) {
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        memcpy(work, source, size);
+        double start = now_sec();
+        fn(work, size);
+        double elapsed = now_sec() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// Runs tr over temporary file with output to /dev/null
+double bench_tr(const char *source, size_t size, int rounds) {
+    char path[] = "/tmp/bench-upper-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = write(fd, source + done, size - done);
+        if (n <= 0) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        lseek(fd, 0, SEEK_SET);
+        double start = now_sec();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            close(fd);
+            close(null_fd);
+            execlp("tr", "tr", "[a-z]", "[A-Z]", (char *)NULL);
+            perror("execlp tr");
+            exit(1);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        double elapsed = now_sec() - start;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (elapsed < best) best = elapsed;
+    }
+
+    close(fd);
+    return best;
+}
+
+void print_result(const char *name, size_t size, double seconds) {
+    if (seconds < 0) {
+        printf("%-8s  failed\n", name);
+        return;
+    }
+    printf("%-8s %10.3f ms %8.2f GB/s\n", name, seconds * 1e3, size / seconds / 1e9);
+}
+
+void help(const char *program_name) {
+    printf("Usage: %s [-h] [-s size_mb] [-r rounds] [input_file]\n", program_name);
+    printf("Options:\n");
+    printf("  -s size_mb  size of test buffer in MB (default %d)\n", DEFAULT_SIZE_MB);
+    printf("  -r rounds   rounds per kernel, best one is reported (default %d)\n", DEFAULT_ROUNDS);
+    printf("  -h          show help\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    size_t size = (size_t)DEFAULT_SIZE_MB << 20;
+    int rounds = DEFAULT_ROUNDS;
+    const char *filename = DEFAULT_INPUT;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) size = (size_t)atoi(argv[++i]) << 20;
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else filename = argv[i];
+    }
+    if (size == 0 || rounds <= 0) help(argv[0]);
+
+    char *source = (char *)malloc(size);
+    char *work = (char *)malloc(size);
+    char *expected = (char *)malloc(size);
+    if (!source || !work || !expected) {
+        perror("malloc");
+        exit(1);
+    }
+    fill_buffer(source, size, filename);
+    memcpy(expected, source, size);
+    upper_scalar(expected, size);
+
+    upper_fn kernels[3];
+    int kernel_count = 0;
+    kernels[kernel_count++] = upper_scalar;
+#ifdef UPPER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) kernels[kernel_count++] = upper_sse2;
+    if (__builtin_cpu_supports("avx2")) kernels[kernel_count++] = upper_avx2;
+#endif
+
+    printf("buffer %zu MB, best of %d rounds, selected kernel %s\n",
+           size >> 20, rounds, upper_name(upper_select()));
+
+    for (int k = 0; k < kernel_count; k++) {
+        double seconds = bench_kernel(kernels[k], work, source, size, rounds);
+        if (memcmp(work, expected, size) != 0) {
+            printf("%-8s  wrong result\n", upper_name(kernels[k]));
+            continue;
+        }
+        print_result(upper_name(kernels[k]), size, seconds);
+    }
+    print_result("tr", size, bench_tr(source, size, rounds));
+
+    free(source);
+    free(work);
+    free(expected);
+    return 0;
+}
@@ -0,0 +1,406 @@
+// External merge sort for inputs larger than memory.
+//
+// Input is read in memory-budgeted runs, every worker thread sorts its run
+// and spills it into an unlinked temporary file. Runs are then merged with
+// k-way merge straight into the uppercase/number stage from inproc.h.
+// If the whole input fits into a single run, nothing is spilled.
+//
+// The budget covers text, sort arrays of every line (EXTSORT_LINE_COST),
+// I/O buffers and merge read buffers. Very long lines can still go over it,
+// a line is never split.
+
+#ifndef EXTSORT_H
+#define EXTSORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include "inproc.h"
+
+#define EXTSORT_DEFAULT_MEM (512UL << 20)
+#define EXTSORT_MIN_MEM     (1UL << 20)
+#define EXTSORT_MAX_MERGE   128          // runs merged at once (open fds)
+#define EXTSORT_MIN_READ    (64UL << 10) // merge read buffer lower bound
+#define EXTSORT_IO_BUFFER   (256UL << 10) // run and output write buffer
+
+// Sort memory per line besides its text: line views (vector may double)
+// and radix keys with their tmp copy
+#define EXTSORT_LINE_COST (2 * sizeof(line_view) + 2 * sizeof(radix_key))
+
+struct extsort_config {
+    size_t mem_limit;   // bytes for sorting and merging together
+    int threads;        // number of sorting threads
+};
+
+inline void extsort_defaults(extsort_config &config) {
+    config.mem_limit = EXTSORT_DEFAULT_MEM;
+    config.threads = std::thread::hardware_concurrency();
+    if (config.threads <= 0) config.threads = 1;
+}
+
+// Parses size with optional K, M or G suffix, returns 0 on error
+inline size_t parse_size(const char *text) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno || end == text) return 0;
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0') return 0;
+    return value;
+}
+
+//***************************************************************************
+// helpers
+
+// Creates temporary file which disappears when it is closed
+inline int create_run_file() {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/names-run-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(path);
+    return fd;
+}
+
+//***************************************************************************
+// run reader for the merge phase
+
+struct run_reader {
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t start;       // current line begins here
+    size_t filled;
+    bool eof;
+    line_view line;     // current line
+};
+
+inline void reader_init(run_reader &reader, int fd, size_t capacity) {
+    reader.fd = fd;
+    reader.capacity = capacity;
+    reader.buffer = (char *)malloc(capacity);
+    if (!reader.buffer) {
+        perror("malloc");
+        exit(1);
+    }
+    reader.start = 0;
+    reader.filled = 0;
+    reader.eof = false;
+    lseek(fd, 0, SEEK_SET);
+}
+
+// Moves to next line, returns false at the end of run
+inline bool reader_next(run_reader &reader) {
+    while (1) {
+        char *pos = reader.buffer + reader.start;
+        size_t avail = reader.filled - reader.start;
+        char *nl = (char *)memchr(pos, '\n', avail);
+        if (nl) {
+            reader.line.data = pos;
+            reader.line.len = nl - pos;
+            reader.start += reader.line.len + 1;
+            return true;
+        }
+        if (reader.eof) {
+            // Runs always end with '\n', but input tail may not
+            if (avail == 0) return false;
+            reader.line.data = pos;
+            reader.line.len = avail;
+            reader.start = reader.filled;
+            return true;
+        }
+
+        // Keep partial line and read more
+        memmove(reader.buffer, pos, avail);
+        reader.start = 0;
+        reader.filled = avail;
+        if (reader.filled == reader.capacity) {
+            reader.capacity *= 2;
+            reader.buffer = (char *)realloc(reader.buffer, reader.capacity);
+            if (!reader.buffer) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        ssize_t n = read(reader.fd, reader.buffer + reader.filled, reader.capacity - reader.filled);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) reader.eof = true;
+        reader.filled += n;
+    }
+}
+
+inline void reader_free(run_reader &reader) {
+    free(reader.buffer);
+    close(reader.fd);
+}
+
+//***************************************************************************
+// k-way merge
+
+struct heap_less {
+    std::vector<run_reader> *readers;
+    // std heap is max-heap, so the comparison is reversed
+    bool operator()(int a, int b) const {
+        return line_less((*readers)[b].line, (*readers)[a].line);
+    }
+};
+
+// Merges runs and passes every line to sink(data, len); closes run fds.
+// Read buffers share read_budget.
+template <typename Sink>
+void merge_runs(const std::vector<int> &runs, size_t read_budget, Sink &sink) {
+    size_t read_size = read_budget / std::max(runs.size(), (size_t)1);
+    if (read_size < EXTSORT_MIN_READ) read_size = EXTSORT_MIN_READ;
+
+    std::vector<run_reader> readers(runs.size());
+    std::vector<int> heap;
+    heap_less less = { &readers };
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        reader_init(readers[i], runs[i], read_size);
+        if (reader_next(readers[i])) heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), less);
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), less);
+        int top = heap.back();
+        sink(readers[top].line.data, readers[top].line.len);
+        if (reader_next(readers[top])) {
+            std::push_heap(heap.begin(), heap.end(), less);
+        } else {
+            heap.pop_back();
+        }
+    }
+
+    for (size_t i = 0; i < readers.size(); i++) reader_free(readers[i]);
+}
+
+// Sink writing lines into a new run file
+struct run_sink {
+    out_buffer out;
+    void operator()(const char *data, size_t len) {
+        char *dst = out_reserve(out, len + 1);
+        memcpy(dst, data, len);
+        dst[len] = '\n';
+        out.used += len + 1;
+    }
+};
+
+// Sink feeding uppercase and numbering stage
+struct emit_sink {
+    out_buffer out;
+    nl_state state;
+    void operator()(const char *data, size_t len) {
+        emit_line(out, state, data, len);
+    }
+};
+
+//***************************************************************************
+// run generation
+
+struct run_input {
+    int fd;
+    bool eof;
+    std::vector<char> carry;    // partial line left from previous chunk
+    std::mutex mutex;
+    std::vector<int> runs;      // spilled run files
+    std::mutex runs_mutex;
+};
+
+// Reads next chunk ending at line boundary into buffer, returns its length.
+// Text and EXTSORT_LINE_COST per line take at most budget bytes, unless a
+// single line alone is larger.
+inline size_t read_chunk(run_input &input, std::vector<char> &buffer, size_t budget) {
+    std::lock_guard<std::mutex> lock(input.mutex);
+    if (input.eof && input.carry.empty()) return 0;
+
+    size_t filled = input.carry.size();
+    if (filled > buffer.size()) buffer.resize(filled);
+    if (filled) memcpy(&buffer[0], &input.carry[0], filled);
+    input.carry.clear();
+    size_t lines = std::count(buffer.begin(), buffer.begin() + filled, '\n');
+
+    while (!input.eof) {
+        size_t cost = filled + lines * EXTSORT_LINE_COST;
+        if (lines && cost >= budget) break;
+
+        // Lines seen so far tell how much more text fits, a line without
+        // end yet is read in doubling steps
+        size_t want = lines ? (budget - cost) * filled / cost : std::max(filled, EXTSORT_MIN_READ);
+        if (want < EXTSORT_MIN_READ) want = EXTSORT_MIN_READ;
+        if (buffer.size() < filled + want) buffer.resize(filled + want);
+
+        ssize_t n = read(input.fd, &buffer[filled], want);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) input.eof = true;
+        lines += std::count(buffer.begin() + filled, buffer.begin() + filled + n, '\n');
+        filled += n;
+    }
+
+    // Chunk ends with the last whole line within the budget, the rest
+    // waits in carry for the next chunk
+    char *base = buffer.data();
+    size_t used = filled;
+    if (lines && (!input.eof || filled + lines * EXTSORT_LINE_COST > budget)) {
+        used = (char *)memrchr(base, '\n', filled) - base + 1;
+        while (lines > 1 && used + lines * EXTSORT_LINE_COST > budget) {
+            used = (char *)memrchr(base, '\n', used - 1) - base + 1;
+            lines--;
+        }
+    }
+    input.carry.assign(base + used, base + filled);
+    return used;
+}
+
+inline void sort_chunk(const char *data, size_t len, std::vector<line_view> &lines) {
+    lines.clear();
+    split_lines(data, len, lines);
+    radix_sort_lines(lines);
+}
+
+inline void write_run(int fd, const std::vector<line_view> &lines) {
+    out_buffer out;
+    out_init(out, fd, false, EXTSORT_IO_BUFFER);
+    run_sink sink = { out };
+    for (size_t i = 0; i < lines.size(); i++) sink(lines[i].data, lines[i].len);
+    out_free(sink.out);
+}
+
+// Sorts chunk and spills it as a new run
+inline void spill_run(run_input &input, const char *data, size_t len, std::vector<line_view> &lines) {
+    sort_chunk(data, len, lines);
+    int fd = create_run_file();
+    write_run(fd, lines);
+
+    std::lock_guard<std::mutex> lock(input.runs_mutex);
+    input.runs.push_back(fd);
+}
+
+inline void run_worker(run_input &input, size_t budget) {
+    std::vector<char> buffer;
+    std::vector<line_view> lines;
+
+    while (1) {
+        size_t len = read_chunk(input, buffer, budget);
+        if (len == 0) break;
+        spill_run(input, &buffer[0], len, lines);
+    }
+}
+
+//***************************************************************************
+
+// Sorts file with bounded memory, output goes through uppercase/nl to fd_out
+inline int run_extsort_pipeline(const char *filename, int fd_out, const extsort_config &config) {
+    run_input input;
+    input.fd = open(filename, O_RDONLY);
+    if (input.fd == -1) {
+        perror("open");
+        return -1;
+    }
+    input.eof = false;
+    posix_fadvise(input.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Chunks and merge buffers are mapped and unmapped when freed. Otherwise
+    // glibc raises the threshold after the first free and keeps freed
+    // chunks of the workers in their arenas during the merge.
+    mallopt(M_MMAP_THRESHOLD, EXTSORT_MIN_READ);
+
+    size_t mem_limit = config.mem_limit;
+    if (mem_limit < EXTSORT_MIN_MEM) {
+        fprintf(stderr, "Memory limit raised to the minimum of %lu bytes.\n", EXTSORT_MIN_MEM);
+        mem_limit = EXTSORT_MIN_MEM;
+    }
+
+    // Every worker has its chunk and run write buffer, at least 1M together
+    int threads = config.threads > 0 ? config.threads : 1;
+    if ((size_t)threads > mem_limit / EXTSORT_MIN_MEM) threads = mem_limit / EXTSORT_MIN_MEM;
+    size_t run_budget = mem_limit / threads - EXTSORT_IO_BUFFER;
+
+    // Merge reads take what the output buffer leaves
+    size_t merge_budget = mem_limit - EXTSORT_IO_BUFFER;
+    size_t fan_in = std::min((size_t)EXTSORT_MAX_MERGE, merge_budget / EXTSORT_MIN_READ);
+
+    emit_sink emit;
+    out_init(emit.out, fd_out, true, EXTSORT_IO_BUFFER);
+    nl_init(emit.state);
+
+    // Input which fits into the budget is sorted in memory without spilling,
+    // otherwise the chunk read is the first run
+    struct stat st;
+    if (fstat(input.fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size <= mem_limit / 2) {
+        stats_phase("sort");
+        std::vector<char> buffer;
+        std::vector<line_view> lines;
+        size_t len = read_chunk(input, buffer, merge_budget);
+        if (input.eof && input.carry.empty()) {
+            sort_chunk(buffer.data(), len, lines);
+            stats_phase("number");
+            for (size_t i = 0; i < lines.size(); i++) emit(lines[i].data, lines[i].len);
+            out_free(emit.out);
+            close(input.fd);
+            return 0;
+        }
+        spill_run(input, &buffer[0], len, lines);
+    }
+
+    stats_phase("runs");
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(std::thread(run_worker, std::ref(input), run_budget));
+    }
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    close(input.fd);
+
+    // Too many runs are merged in several passes
+    stats_phase("merge");
+    std::vector<int> runs = input.runs;
+    while (runs.size() > fan_in) {
+        std::vector<int> next;
+        for (size_t i = 0; i < runs.size(); i += fan_in) {
+            size_t end = std::min(runs.size(), i + fan_in);
+            std::vector<int> group(runs.begin() + i, runs.begin() + end);
+            run_sink sink;
+            out_init(sink.out, create_run_file(), false, EXTSORT_IO_BUFFER);
+            merge_runs(group, merge_budget, sink);
+            out_flush(sink.out);
+            next.push_back(sink.out.fd);
+            free(sink.out.data);
+        }
+        runs.swap(next);
+    }
+
+    merge_runs(runs, merge_budget, emit);
+    out_free(emit.out);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,241 @@
+// Mapped name index, the pipeline output in a form which can be queried.
+//
+// File layout (host byte order, sections 8-byte aligned):
+//
+//   index_header
+//   names        sorted names, each followed by '\n'
+//   lines        final output (numbered, uppercase), line i belongs to name i
+//   name_offsets count + 1 offsets into names
+//   line_offsets count + 1 offsets into lines
+//   samples      8-byte big-endian prefix of every INDEX_STEP-th name
+//
+// Samples are small enough to stay in cache, a search over them narrows the
+// range to about INDEX_STEP names before names themselves are compared.
+// Names with the same key or prefix are adjacent, so every answer is one
+// contiguous range of the lines section which can be sent from the file.
+
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include "inproc.h"
+#include "radix_sort.h"
+
+#define INDEX_MAGIC "NAMEIDX1"
+#define INDEX_STEP 64
+
+struct index_header {
+    char magic[8];
+    uint64_t count;
+    uint64_t step;
+    uint64_t names_off;
+    uint64_t lines_off;
+    uint64_t lines_len;
+    uint64_t name_offsets_off;
+    uint64_t line_offsets_off;
+    uint64_t samples_off;
+    uint64_t sample_count;
+};
+
+inline uint64_t index_align(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+//***************************************************************************
+// writing
+
+// Writes index of already sorted lines into filename
+inline int index_write(const char *filename, const std::vector<line_view> &lines) {
+    size_t count = lines.size();
+    index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.count = count;
+    header.step = INDEX_STEP;
+    header.sample_count = (count + INDEX_STEP - 1) / INDEX_STEP;
+
+    // Offsets are known before anything is written
+    std::vector<uint64_t> name_offsets(count + 1), line_offsets(count + 1);
+    nl_state state;
+    nl_init(state);
+    name_offsets[0] = line_offsets[0] = 0;
+    for (size_t i = 0; i < count; i++) {
+        name_offsets[i + 1] = name_offsets[i] + lines[i].len + 1;
+        line_offsets[i + 1] = line_offsets[i] + nl_line_size(lines[i], state);
+    }
+    header.names_off = index_align(sizeof(header));
+    header.lines_off = index_align(header.names_off + name_offsets[count]);
+    header.lines_len = line_offsets[count];
+    header.name_offsets_off = index_align(header.lines_off + header.lines_len);
+    header.line_offsets_off = header.name_offsets_off + (count + 1) * 8;
+    header.samples_off = header.line_offsets_off + (count + 1) * 8;
+
+    int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1) {
+        perror("open index");
+        return -1;
+    }
+
+    static const char zeros[8] = { 0 };
+    out_buffer out;
+    out_init(out, fd);
+    memcpy(out_reserve(out, sizeof(header)), &header, sizeof(header));
+    out.used += sizeof(header);
+    memcpy(out_reserve(out, 8), zeros, header.names_off - sizeof(header));
+    out.used += header.names_off - sizeof(header);
+
+    for (size_t i = 0; i < count; i++) {
+        char *dst = out_reserve(out, lines[i].len + 1);
+        memcpy(dst, lines[i].data, lines[i].len);
+        dst[lines[i].len] = '\n';
+        out.used += lines[i].len + 1;
+    }
+    size_t pad = header.lines_off - header.names_off - name_offsets[count];
+    memcpy(out_reserve(out, 8), zeros, pad);
+    out.used += pad;
+
+    // Output lines have to be uppercased while the rest must stay as it is
+    out_flush(out);
+    out.upper = true;
+    nl_init(state);
+    for (size_t i = 0; i < count; i++) emit_line(out, state, lines[i].data, lines[i].len);
+    out_flush(out);
+    out.upper = false;
+
+    pad = header.name_offsets_off - header.lines_off - header.lines_len;
+    memcpy(out_reserve(out, 8), zeros, pad);
+    out.used += pad;
+
+    for (size_t i = 0; i <= count; i++) {
+        memcpy(out_reserve(out, 8), &name_offsets[i], 8);
+        out.used += 8;
+    }
+    for (size_t i = 0; i <= count; i++) {
+        memcpy(out_reserve(out, 8), &line_offsets[i], 8);
+        out.used += 8;
+    }
+    for (size_t i = 0; i < count; i += INDEX_STEP) {
+        uint64_t prefix = load_prefix(lines[i].data, lines[i].len, 0);
+        memcpy(out_reserve(out, 8), &prefix, 8);
+        out.used += 8;
+    }
+    out_free(out);
+
+    if (close(fd) == -1) {
+        perror("close index");
+        return -1;
+    }
+    return 0;
+}
+
+//***************************************************************************
+// reading
+
+struct name_index {
+    int fd;                     // kept open for sendfile()
+    const char *base;
+    size_t size;
+    const index_header *header;
+    const char *names;
+    const uint64_t *name_offsets;
+    const uint64_t *line_offsets;
+    const uint64_t *samples;
+};
+
+inline int index_open(const char *filename, name_index &index) {
+    index.fd = open(filename, O_RDONLY);
+    if (index.fd == -1) {
+        perror("open index");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(index.fd, &st) == -1 || (size_t)st.st_size < sizeof(index_header)) {
+        fprintf(stderr, "Index file is too short.\n");
+        close(index.fd);
+        return -1;
+    }
+    index.size = st.st_size;
+    void *data = mmap(NULL, index.size, PROT_READ, MAP_SHARED, index.fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap index");
+        close(index.fd);
+        return -1;
+    }
+    index.base = (const char *)data;
+    index.header = (const index_header *)data;
+
+    const index_header &h = *index.header;
+    if (memcmp(h.magic, INDEX_MAGIC, 8) != 0 || h.step == 0 ||
+        h.samples_off + h.sample_count * 8 > index.size) {
+        fprintf(stderr, "Not an index file.\n");
+        munmap(data, index.size);
+        close(index.fd);
+        return -1;
+    }
+    index.names = index.base + h.names_off;
+    index.name_offsets = (const uint64_t *)(index.base + h.name_offsets_off);
+    index.line_offsets = (const uint64_t *)(index.base + h.line_offsets_off);
+    index.samples = (const uint64_t *)(index.base + h.samples_off);
+    return 0;
+}
+
+inline void index_close(name_index &index) {
+    munmap((void *)index.base, index.size);
+    close(index.fd);
+}
+
+inline line_view index_name(const name_index &index, size_t i) {
+    line_view name = { index.names + index.name_offsets[i], index.name_offsets[i + 1] - index.name_offsets[i] - 1 };
+    return name;
+}
+
+enum index_bound {
+    INDEX_LOWER,        // first name >= key
+    INDEX_UPPER,        // first name > key
+    INDEX_PREFIX_END    // first name > key which doesn't start with key
+};
+
+// Binary search, O(log n) with samples first
+inline size_t index_search(const name_index &index, const char *key, size_t len, index_bound bound) {
+    uint64_t prefix = load_prefix(key, len, 0);
+    // Names starting with key are all below key padded with 0xff
+    if (bound == INDEX_PREFIX_END) {
+        for (size_t i = len; i < 8; i++) prefix |= (uint64_t)0xff << (56 - 8 * i);
+    }
+
+    // Sample below prefix is below key, sample above prefix is above it
+    const uint64_t *samples = index.samples;
+    size_t sample_count = index.header->sample_count;
+    size_t below = std::lower_bound(samples, samples + sample_count, prefix) - samples;
+    size_t above = std::upper_bound(samples, samples + sample_count, prefix) - samples;
+
+    size_t step = index.header->step;
+    size_t count = index.header->count;
+    size_t lo = below ? (below - 1) * step + 1 : 0;
+    size_t hi = above * step < count ? above * step : count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        line_view name = index_name(index, mid);
+        if (bound == INDEX_PREFIX_END && name.len > len) name.len = len;
+
+        size_t n = name.len < len ? name.len : len;
+        int cmp = memcmp(name.data, key, n);
+        if (cmp == 0) cmp = name.len < len ? -1 : name.len > len ? 1 : 0;
+
+        if (cmp < 0 || (cmp == 0 && bound != INDEX_LOWER)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+#endif
@@ -0,0 +1,244 @@
+// TCP lookup server over index written by "main --index file".
+//
+// Requests are lines:
+//   = NAME     lines with exactly this name
+//   ^ PREFIX   lines with names starting with PREFIX
+//   # N        output line N (1-based)
+//   close      end of connection
+// Answer is "OK count\n" followed by count output lines, or "ERR text\n".
+// Output lines are sent by sendfile() straight from the index file, they
+// are never copied into the server.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include "index.h"
+
+#define STR_CLOSE "close"
+#define DEFAULT_INDEX "names.idx"
+#define REQUEST_SIZE 4096
+#define LOG_ERROR 0
+#define LOG_INFO  1
+#define LOG_DEBUG 2
+
+int g_debug = LOG_INFO;
+name_index g_index;
+
+void log_msg(int log_level, const char *format, ...) {
+    const char *prefix[] = { "ERR: ", "INF: ", "DEB: " };
+    if (log_level > g_debug) return;
+
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    fprintf(log_level == LOG_ERROR ? stderr : stdout, "%s%s\n", prefix[log_level], buffer);
+}
+
+int send_all(int socket, const char *data, size_t len, int flags) {
+    while (len > 0) {
+        ssize_t n = send(socket, data, len, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends header and output lines [first, last) of the index
+int send_lines(int client_socket, size_t first, size_t last) {
+    char header[64];
+    int len = snprintf(header, sizeof(header), "OK %zu\n", last - first);
+    if (send_all(client_socket, header, len, first < last ? MSG_MORE : 0) != 0) return -1;
+
+    off_t offset = g_index.header->lines_off + g_index.line_offsets[first];
+    size_t remaining = g_index.line_offsets[last] - g_index.line_offsets[first];
+    while (remaining > 0) {
+        ssize_t n = sendfile(client_socket, g_index.fd, &offset, remaining);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        remaining -= n;
+    }
+    return 0;
+}
+
+int send_error(int client_socket, const char *message) {
+    char response[256];
+    int len = snprintf(response, sizeof(response), "ERR %s\n", message);
+    return send_all(client_socket, response, len, 0);
+}
+
+// Handles one request line (without '\n'), returns -1 to close connection
+int handle_request(int client_socket, char *request, size_t len) {
+    if (len > 0 && request[len - 1] == '\r') len--;
+    log_msg(LOG_DEBUG, "Request from client %d: %.*s", client_socket, (int)len, request);
+
+    if (len == strlen(STR_CLOSE) && strncmp(request, STR_CLOSE, len) == 0) return -1;
+    if (len < 2 || request[1] != ' ') return send_error(client_socket, "Use '= name', '^ prefix' or '# line'.");
+
+    const char *key = request + 2;
+    size_t key_len = len - 2;
+    size_t count = g_index.header->count;
+
+    switch (request[0]) {
+        case '=':
+            return send_lines(client_socket, index_search(g_index, key, key_len, INDEX_LOWER),
+                              index_search(g_index, key, key_len, INDEX_UPPER));
+        case '^':
+            return send_lines(client_socket, index_search(g_index, key, key_len, INDEX_LOWER),
+                              index_search(g_index, key, key_len, INDEX_PREFIX_END));
+        case '#': {
+            request[len] = '\0';
+            char *end;
+            unsigned long long line = strtoull(key, &end, 10);
+            if (end == key || *end != '\0' || line == 0 || line > count) {
+                return send_error(client_socket, "Line number out of range.");
+            }
+            return send_lines(client_socket, line - 1, line);
+        }
+        default:
+            return send_error(client_socket, "Unknown request.");
+    }
+}
+
+void handle_client(int client_socket) {
+    char buffer[REQUEST_SIZE];
+    size_t used = 0;
+    while (1) {
+        int length = read(client_socket, buffer + used, sizeof(buffer) - used);
+        if (length <= 0) break;
+        used += length;
+
+        // Every complete line is one request
+        size_t start = 0;
+        bool closing = false;
+        while (!closing) {
+            char *nl = (char *)memchr(buffer + start, '\n', used - start);
+            if (!nl) break;
+            if (handle_request(client_socket, buffer + start, nl - (buffer + start)) != 0) closing = true;
+            start = nl + 1 - buffer;
+        }
+        if (closing) break;
+
+        memmove(buffer, buffer + start, used - start);
+        used -= start;
+        if (used == sizeof(buffer)) {
+            send_error(client_socket, "Request too long.");
+            break;
+        }
+    }
+
+    close(client_socket);
+    exit(0);
+}
+
+void help(const char *program_name) {
+    printf("Usage: %s [-d] [-i index_file] <port>\n", program_name);
+    printf("Options:\n");
+    printf("  -d  Enable debug mode\n");
+    printf("  -i  Index file written by main --index (default %s)\n", DEFAULT_INDEX);
+    printf("  -h  Show help\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) help(argv[0]);
+
+    int server_port = 0;
+    const char *index_file = DEFAULT_INDEX;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) g_debug = LOG_DEBUG;
+        else if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) index_file = argv[++i];
+        else server_port = atoi(argv[i]);
+    }
+
+    if (server_port <= 0) {
+        log_msg(LOG_ERROR, "Invalid or missing port number.");
+        help(argv[0]);
+    }
+
+    if (index_open(index_file, g_index) != 0) {
+        log_msg(LOG_ERROR, "Can't open index '%s'.", index_file);
+        exit(1);
+    }
+    log_msg(LOG_INFO, "Index '%s' with %llu names.", index_file, (unsigned long long)g_index.header->count);
+
+    // Children are not waited for
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listening_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listening_socket == -1) {
+        log_msg(LOG_ERROR, "Socket creation failed.");
+        exit(1);
+    }
+
+    int reuse_option = 1;
+    setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &reuse_option, sizeof(reuse_option));
+
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(server_port);
+    server_address.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(listening_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+        log_msg(LOG_ERROR, "Bind failed.");
+        close(listening_socket);
+        exit(1);
+    }
+
+    if (listen(listening_socket, 10) < 0) {
+        log_msg(LOG_ERROR, "Listen failed.");
+        close(listening_socket);
+        exit(1);
+    }
+
+    log_msg(LOG_INFO, "Server listening on port %d", server_port);
+
+    while (1) {
+        struct sockaddr_in client_address;
+        socklen_t client_len = sizeof(client_address);
+        int client_socket = accept(listening_socket, (struct sockaddr *)&client_address, &client_len);
+
+        if (client_socket == -1) {
+            log_msg(LOG_ERROR, "Accept failed.");
+            continue;
+        }
+
+        log_msg(LOG_INFO, "Connected: %s:%d",
+                inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+
+        // Mapped index is shared with children
+        pid_t pid = fork();
+        if (pid < 0) {
+            log_msg(LOG_ERROR, "Fork failed.");
+            close(client_socket);
+        } else if (pid == 0) { // Child process
+            close(listening_socket);
+            handle_client(client_socket);
+        } else {
+            close(client_socket); // Parent process closes client socket
+        }
+    }
+
+    close(listening_socket);
+    index_close(g_index);
+    return 0;
+}
@@ -0,0 +1,237 @@
+// Building blocks of the in-process "sort | tr [a-z] [A-Z] | nl -s '. '".
+//
+// Input file is mapped into memory and split into line views, output goes
+// through out_buffer, which can uppercase itself in place with the kernel
+// from upper.h before it is written. Numbering follows nl rules exactly,
+// so the engines are byte-identical to the fork/exec pipeline when
+// LC_COLLATE is C/POSIX (sort then compares bytes).
+
+#ifndef INPROC_H
+#define INPROC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "upper.h"
+#include "stats.h"
+#include "radix_sort.h"
+
+#define OUT_BUFFER_SIZE (1 << 20)
+#define NL_WIDTH 6              // nl default -w 6
+#define NL_SEPARATOR ". "       // nl -s ". "
+
+//***************************************************************************
+// mapped input
+
+struct mapped_file {
+    const char *data;
+    size_t size;
+};
+
+// Maps whole file read-only. Empty file gives data == NULL and size 0.
+inline int map_file(const char *filename, mapped_file &file) {
+    file.data = NULL;
+    file.size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        file.data = (const char *)addr;
+        file.size = st.st_size;
+    }
+
+    close(fd);
+    return 0;
+}
+
+inline void unmap_file(mapped_file &file) {
+    if (file.data) munmap((void *)file.data, file.size);
+    file.data = NULL;
+    file.size = 0;
+}
+
+// Splits buffer into lines, last line may be missing its '\n' (sort adds it)
+inline void split_lines(const char *data, size_t size, std::vector<line_view> &lines) {
+    const char *pos = data;
+    const char *end = data + size;
+    while (pos < end) {
+        const char *nl = (const char *)memchr(pos, '\n', end - pos);
+        if (!nl) nl = end;
+        line_view line = { pos, (size_t)(nl - pos) };
+        lines.push_back(line);
+        pos = nl + 1;
+    }
+}
+
+//***************************************************************************
+// buffered output
+
+struct out_buffer {
+    int fd;
+    char *data;
+    size_t used;
+    size_t capacity;
+    bool upper;         // uppercase whole buffer before it is written
+};
+
+inline void out_init(out_buffer &out, int fd, bool upper = false, size_t capacity = OUT_BUFFER_SIZE) {
+    out.fd = fd;
+    out.upper = upper;
+    out.capacity = capacity;
+    out.used = 0;
+    out.data = (char *)malloc(out.capacity);
+    if (!out.data) {
+        perror("malloc");
+        exit(1);
+    }
+}
+
+inline void out_flush(out_buffer &out) {
+    // Number prefixes contain no lowercase letters, so they pass unchanged
+    if (out.upper) upper_inplace(out.data, out.used);
+
+    size_t done = 0;
+    while (done < out.used) {
+        ssize_t n = write(out.fd, out.data + done, out.used - done);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+    out.used = 0;
+}
+
+// Returns pointer to at least 'len' free bytes
+inline char *out_reserve(out_buffer &out, size_t len) {
+    if (out.used + len > out.capacity) {
+        out_flush(out);
+        if (len > out.capacity) {
+            out.capacity = len;
+            out.data = (char *)realloc(out.data, out.capacity);
+            if (!out.data) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+    }
+    return out.data + out.used;
+}
+
+inline void out_free(out_buffer &out) {
+    out_flush(out);
+    free(out.data);
+    out.data = NULL;
+}
+
+//***************************************************************************
+// nl -s ". "
+//
+// Default nl numbers only non-empty body lines (-b t), header and footer
+// lines are not numbered (-h n -f n). Lines "\:\:\:", "\:\:" and "\:" switch
+// to header, body and footer section, they are replaced by an empty line
+// and numbering starts again from 1. Unnumbered lines get blank prefix of
+// the same width as the number and separator.
+
+enum nl_section { NL_HEADER, NL_BODY, NL_FOOTER };
+
+struct nl_state {
+    long long line_no;
+    nl_section section;
+};
+
+inline void nl_init(nl_state &state) {
+    state.line_no = 1;
+    state.section = NL_BODY;
+}
+
+// Returns section for delimiter line or -1 for ordinary line
+inline int nl_delimiter(const char *data, size_t len) {
+    if (len == 0 || len > 6 || len % 2) return -1;
+    for (size_t i = 0; i < len; i += 2) {
+        if (data[i] != '\\' || data[i + 1] != ':') return -1;
+    }
+    if (len == 6) return NL_HEADER;
+    if (len == 4) return NL_BODY;
+    return NL_FOOTER;
+}
+
+// Writes prefix for one line, returns its length
+inline size_t nl_prefix(nl_state &state, char *dst, size_t len) {
+    if (state.section != NL_BODY || len == 0) {
+        size_t blank = NL_WIDTH + sizeof(NL_SEPARATOR) - 1;
+        memset(dst, ' ', blank);
+        return blank;
+    }
+
+    // Right-aligned like printf("%6lld"), longer numbers just widen
+    char digits[24];
+    int count = 0;
+    unsigned long long value = state.line_no++;
+    do {
+        digits[sizeof(digits) - 1 - count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    int pad = NL_WIDTH > count ? NL_WIDTH - count : 0;
+    memset(dst, ' ', pad);
+    memcpy(dst + pad, digits + sizeof(digits) - count, count);
+    memcpy(dst + pad + count, NL_SEPARATOR, sizeof(NL_SEPARATOR) - 1);
+    return pad + count + sizeof(NL_SEPARATOR) - 1;
+}
+
+// Numbers one line into output (line without '\n'), uppercase is done
+// on the whole buffer when it is flushed
+inline void emit_line(out_buffer &out, nl_state &state, const char *data, size_t len) {
+    int section = nl_delimiter(data, len);
+    if (section >= 0) {
+        state.section = (nl_section)section;
+        state.line_no = 1;
+        *out_reserve(out, 1) = '\n';
+        out.used++;
+        return;
+    }
+
+    char *dst = out_reserve(out, len + 32);
+    size_t prefix = nl_prefix(state, dst, len);
+    memcpy(dst + prefix, data, len);
+    dst[prefix + len] = '\n';
+    out.used += prefix + len + 1;
+}
+
+// Length of the output line emit_line() would write, moves state the same way
+inline size_t nl_line_size(const line_view &line, nl_state &state) {
+    char prefix[NL_WIDTH + 32];
+    int section = nl_delimiter(line.data, line.len);
+    if (section >= 0) {
+        state.section = (nl_section)section;
+        state.line_no = 1;
+        return 1;
+    }
+    return nl_prefix(state, prefix, line.len) + line.len + 1;
+}
+
+#endif
@@ -3,83 +3,245 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <string.h>
+#include <locale.h>
+#include <sys/stat.h>
+#include "inproc.h"
+#include "extsort.h"
+#include "pipeline.h"
+#include "numbering.h"
+#include "aggregate.h"
+#include "watch.h"
+#include "index.h"
 
-int main() {
-    int pipe1[2], pipe2[2];
+#define DEFAULT_INPUT "names.txt"
 
-    if (pipe(pipe1) == -1) {
-        perror("pipe1");
-        exit(1);
+enum pipeline_mode { MODE_AUTO, MODE_EXEC, MODE_INPROC, MODE_EXTSORT, MODE_AGGREGATE };
+
+// Original pipeline, with simd_upper the tr stage is replaced by @upper
+#define EXEC_SPEC       "sort | tr [a-z] [A-Z] | nl -s '. '"
+#define EXEC_SPEC_SIMD  "sort | @upper | nl -s '. '"
+
+// Aggregation with occurrence counts
+#define COUNT_SPEC      "sort | uniq -c | tr [a-z] [A-Z] | nl -s '. '"
+#define COUNT_SPEC_SIMD "sort | uniq -c | @upper | nl -s '. '"
+
+// Runs pipeline described by spec with filename on stdin of first stage
+int run_exec_pipeline(const char *filename, const char *spec) {
+    pipeline p;
+    pipeline_init(p, filename);
+    if (pipeline_parse(p, spec) != 0) return -1;
+    return pipeline_run(p, STDOUT_FILENO);
+}
+
+// In-process engine: mapped input is split into line views, sorted and
+// numbered. With more threads sorted lines are gathered into blocks which
+// are numbered and uppercased in parallel by number_block().
+int run_inproc_pipeline(const char *filename, int fd_out, int threads) {
+    stats_phase("split");
+    mapped_file file;
+    if (map_file(filename, file) != 0) return -1;
+
+    std::vector<line_view> lines;
+    lines.reserve(file.size / 8 + 1);
+    split_lines(file.data, file.size, lines);
+
+    stats_phase("sort");
+    radix_sort_lines(lines);
+
+    stats_phase("number");
+    nl_state state;
+    nl_init(state);
+    int result = 0;
+
+    if (threads > 1) {
+        std::vector<char> block;
+        block.reserve(NUMBER_BLOCK);
+        for (size_t i = 0; i < lines.size() && result == 0; i++) {
+            block.insert(block.end(), lines[i].data, lines[i].data + lines[i].len);
+            block.push_back('\n');
+            if (block.size() >= NUMBER_BLOCK || i + 1 == lines.size()) {
+                result = number_block(&block[0], block.size(), state, threads, true, fd_out);
+                block.clear();
+            }
+        }
+    } else {
+        out_buffer out;
+        out_init(out, fd_out, true);
+        for (size_t i = 0; i < lines.size(); i++) {
+            emit_line(out, state, lines[i].data, lines[i].len);
+        }
+        out_free(out);
     }
 
-    if (pipe(pipe2) == -1) {
-        perror("pipe2");
-        exit(1);
+    unmap_file(file);
+    return result;
+}
+
+// Sorted lines go into a mapped index for index_srv instead of stdout
+int run_index_build(const char *filename, const char *index_file) {
+    stats_phase("split");
+    mapped_file file;
+    if (map_file(filename, file) != 0) return -1;
+
+    std::vector<line_view> lines;
+    lines.reserve(file.size / 8 + 1);
+    split_lines(file.data, file.size, lines);
+
+    stats_phase("sort");
+    radix_sort_lines(lines);
+
+    stats_phase("index");
+    int result = index_write(index_file, lines);
+    unmap_file(file);
+    return result;
+}
+
+// In-process engine sorts bytes, so it matches sort(1) only in C collation
+bool collation_is_bytewise() {
+    const char *collate = setlocale(LC_COLLATE, "");
+    if (!collate) return true;
+    return strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+}
+
+// Whole file is mapped in inproc mode, larger files go through external sort
+pipeline_mode choose_mode(const char *filename, const extsort_config &config) {
+    if (!collation_is_bytewise()) return MODE_EXEC;
+
+    struct stat st;
+    if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size <= config.mem_limit / 2) {
+        return MODE_INPROC;
     }
+    return MODE_EXTSORT;
+}
 
-    // First child (sort)
-    if (fork() == 0) {
-        // Redirection of output to pipe1
-        dup2(pipe1[1], STDOUT_FILENO);
-        close(pipe1[0]);
-        close(pipe1[1]);
-        close(pipe2[0]);
-        close(pipe2[1]);
-
-        int input = open("names.txt", O_RDONLY);
-        if (input == -1) {
-            perror("open");
-            exit(1);
-        }
+void help(const char *program_name) {
+    printf("Usage: %s [-h] [-m auto|exec|inproc|extsort] [--mem-limit size] [--threads n] [--upper tr|simd] [-c] [-p spec] [-w [-o file]] [--index file] [--stats file] [input_file]\n", program_name);
+    printf("Options:\n");
+    printf("  -m auto          inproc or extsort by input size, exec if locale is not C (default)\n");
+    printf("  -m exec          fork/exec pipeline sort | tr | nl\n");
+    printf("  -m inproc        in-process engine (mmap, sort, uppercase, number)\n");
+    printf("  -m extsort       parallel external merge sort with spilled runs\n");
+    printf("  --mem-limit size memory budget for sorting, K/M/G suffix allowed (default 512M, min 1M)\n");
+    printf("  --threads n      threads for sorting and numbering (default number of cores)\n");
+    printf("  --upper tr|simd  uppercase stage of exec pipeline (default tr)\n");
+    printf("  -c, --count      distinct names with occurrence counts (like uniq -c)\n");
+    printf("  -p spec          exec mode with own pipeline, e.g. \"sort | @upper | @nl\"\n");
+    printf("                   built-in stages: @cat, @sort, @upper, @nl\n");
+    printf("  -w, --watch      keep output up to date while input grows (inotify)\n");
+    printf("  -o file          watch output file rewritten from the first changed line,\n");
+    printf("                   without it stdout gets \"+line:text\" records of every line\n");
+    printf("                   from the first changed one, \"!reset\" when input was replaced\n");
+    printf("  --index file     write mapped lookup index for index_srv instead of output\n");
+    printf("  --stats file     write per-stage CPU time and peak RSS as CSV\n");
+    printf("  -h               show help\n");
+    printf("Default input file is %s.\n", DEFAULT_INPUT);
+    exit(0);
+}
 
-        dup2(input, STDIN_FILENO);
-        close(input);
+int main(int argc, char **argv) {
+    pipeline_mode mode = MODE_AUTO;
+    const char *filename = DEFAULT_INPUT;
+    extsort_config config;
+    extsort_defaults(config);
+    bool simd_upper = false;
+    const char *spec = NULL;
+    const char *stats_file = NULL;
+    bool count = false;
+    bool watch = false;
+    const char *output_file = NULL;
+    const char *index_file = NULL;
 
-        // Executing sort command
-        execlp("sort", "sort", (char *)NULL);
-        perror("execlp sort");
-        exit(1);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "auto") == 0) mode = MODE_AUTO;
+            else if (strcmp(argv[i], "exec") == 0) mode = MODE_EXEC;
+            else if (strcmp(argv[i], "inproc") == 0) mode = MODE_INPROC;
+            else if (strcmp(argv[i], "extsort") == 0) mode = MODE_EXTSORT;
+            else {
+                fprintf(stderr, "Unknown mode '%s'.\n", argv[i]);
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc) {
+            config.mem_limit = parse_size(argv[++i]);
+            if (config.mem_limit == 0) {
+                fprintf(stderr, "Invalid memory limit '%s'.\n", argv[i]);
+                help(argv[0]);
+            }
+            if (config.mem_limit < EXTSORT_MIN_MEM) {
+                fprintf(stderr, "Memory limit '%s' is below the minimum of 1M.\n", argv[i]);
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.threads = atoi(argv[++i]);
+            if (config.threads <= 0) {
+                fprintf(stderr, "Invalid number of threads '%s'.\n", argv[i]);
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--upper") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "tr") == 0) simd_upper = false;
+            else if (strcmp(argv[i], "simd") == 0) simd_upper = true;
+            else {
+                fprintf(stderr, "Unknown uppercase stage '%s'.\n", argv[i]);
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--count") == 0) count = true;
+        else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--watch") == 0) watch = true;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output_file = argv[++i];
+        else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc) index_file = argv[++i];
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_file = argv[++i];
+            g_stats().enabled = true;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            spec = argv[++i];
+            mode = MODE_EXEC;
+        }
+        else filename = argv[i];
     }
 
-    // Second child (a -> A)
-    if (fork() == 0) {
-        // Redirecting input to pipe1 and output to pipe2
-        dup2(pipe1[0], STDIN_FILENO);
-        dup2(pipe2[1], STDOUT_FILENO);
-        close(pipe1[0]);
-        close(pipe1[1]);
-        close(pipe2[0]);
-        close(pipe2[1]);
-
-        // Executing "tr" command
-        execlp("tr", "tr", "[a-z]", "[A-Z]", (char *)NULL);
-        perror("execlp tr");
-        exit(1);
+    // Watch mode keeps its own sorted state, it never returns on success
+    if (watch) {
+        if (!collation_is_bytewise()) fprintf(stderr, "Watch mode sorts bytewise (LC_ALL=C order).\n");
+        return run_watch(filename, output_file) == 0 ? 0 : 1;
     }
 
-    // Third child (line numbers)
-    if (fork() == 0) {
-        // Redirecting input to pipe2
-        dup2(pipe2[0], STDIN_FILENO);
-        close(pipe2[0]);
-        close(pipe2[1]);
-        close(pipe1[0]);
-        close(pipe1[1]);
-
-        // Executing "nl" command
-        execlp("nl", "nl", "-s", ". ", (char *)NULL);
-        perror("execlp nl");
-        exit(1);
+    if (index_file) {
+        if (!collation_is_bytewise()) fprintf(stderr, "Index is sorted bytewise (LC_ALL=C order).\n");
+        int result = run_index_build(filename, index_file);
+        if (stats_file) stats_write(stats_file);
+        return result == 0 ? 0 : 1;
     }
 
-    close(pipe1[0]);
-    close(pipe1[1]);
-    close(pipe2[0]);
-    close(pipe2[1]);
+    if (mode == MODE_AUTO) mode = choose_mode(filename, config);
 
-    for (int i = 0; i < 3; i++) {
-        wait(NULL);
-    }
+    // Hash aggregation keeps only distinct names, so it replaces both engines
+    if (count && mode != MODE_EXEC) mode = MODE_AGGREGATE;
 
-    return 0;
+    int result = 0;
+    switch (mode) {
+        case MODE_EXEC:
+            if (!spec && count) spec = simd_upper ? COUNT_SPEC_SIMD : COUNT_SPEC;
+            if (!spec) spec = simd_upper ? EXEC_SPEC_SIMD : EXEC_SPEC;
+            result = run_exec_pipeline(filename, spec);
+            break;
+        case MODE_AGGREGATE:
+            result = run_aggregate_pipeline(filename, STDOUT_FILENO, config.threads);
+            break;
+        case MODE_EXTSORT:
+            result = run_extsort_pipeline(filename, STDOUT_FILENO, config);
+            break;
+        default:
+            result = run_inproc_pipeline(filename, STDOUT_FILENO, config.threads);
+            break;
+    }
+    if (stats_file) stats_write(stats_file);
+    return result == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+// Parallel "nl -s '. '" over a block of text.
+//
+// Block is cut into chunks at line ends, one per thread. Each thread first
+// summarises its chunk: how many lines get a number and whether a section
+// delimiter resets the counter. Chunks without '\' can't contain
+// delimiters, for them numbered lines are just newlines minus empty lines,
+// both counted with SIMD. Summaries are prefix-summed into the starting
+// nl_state of every chunk, then all chunks are formatted (and uppercased)
+// concurrently into their own buffers and written out with writev().
+
+#ifndef NUMBERING_H
+#define NUMBERING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <vector>
+#include <thread>
+#include "inproc.h"
+#include "upper.h"
+
+#define NUMBER_BLOCK (32 << 20)     // text numbered at once by all threads
+#define NUMBER_MIN_CHUNK (64 << 10) // smaller chunks aren't worth a thread
+#define NUMBER_MAX_PREFIX 24        // longest prefix incl. separator
+
+//***************************************************************************
+// newline counting
+
+struct newline_count {
+    size_t lines;   // '\n' characters
+    size_t empty;   // '\n' directly after another '\n' or at chunk start
+};
+
+inline newline_count count_newlines_scalar(const char *data, size_t len, char prev) {
+    newline_count count = { 0, 0 };
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            count.lines++;
+            if (prev == '\n') count.empty++;
+        }
+        prev = data[i];
+    }
+    return count;
+}
+
+#ifdef UPPER_X86
+
+// prev is the byte before data, '\n' at chunk start means an empty line
+__attribute__((target("sse2")))
+inline newline_count count_newlines_sse2(const char *data, size_t len, char prev) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    newline_count count = { 0, 0 };
+    size_t i = 0;
+    if (len >= 16) {
+        // First vector needs the byte before it
+        count = count_newlines_scalar(data, 1, prev);
+        for (i = 1; i + 16 <= len; i += 16) {
+            __m128i cur = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), nl);
+            __m128i before = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i - 1)), nl);
+            count.lines += __builtin_popcount(_mm_movemask_epi8(cur));
+            count.empty += __builtin_popcount(_mm_movemask_epi8(_mm_and_si128(cur, before)));
+        }
+        prev = data[i - 1];
+    }
+    newline_count tail = count_newlines_scalar(data + i, len - i, prev);
+    count.lines += tail.lines;
+    count.empty += tail.empty;
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline newline_count count_newlines_avx2(const char *data, size_t len, char prev) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    newline_count count = { 0, 0 };
+    size_t i = 0;
+    if (len >= 32) {
+        count = count_newlines_scalar(data, 1, prev);
+        for (i = 1; i + 32 <= len; i += 32) {
+            __m256i cur = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), nl);
+            __m256i before = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i - 1)), nl);
+            count.lines += __builtin_popcount(_mm256_movemask_epi8(cur));
+            count.empty += __builtin_popcount(_mm256_movemask_epi8(_mm256_and_si256(cur, before)));
+        }
+        prev = data[i - 1];
+    }
+    newline_count tail = count_newlines_sse2(data + i, len - i, prev);
+    count.lines += tail.lines;
+    count.empty += tail.empty;
+    return count;
+}
+
+#endif
+
+inline newline_count count_newlines(const char *data, size_t len, char prev) {
+    typedef newline_count (*count_fn)(const char *, size_t, char);
+#ifdef UPPER_X86
+    static count_fn fn = __builtin_cpu_supports("avx2") ? count_newlines_avx2 :
+                         __builtin_cpu_supports("sse2") ? count_newlines_sse2 : count_newlines_scalar;
+#else
+    static count_fn fn = count_newlines_scalar;
+#endif
+    return fn(data, len, prev);
+}
+
+//***************************************************************************
+// chunk summary
+
+struct nl_summary {
+    long long before;       // numbered lines before first delimiter if in body
+    bool delimiter;         // chunk contains a delimiter line
+    nl_section section;     // section after the last delimiter
+    long long after;        // numbered lines after the last delimiter
+};
+
+// Chunk ends with '\n' unless it is the tail of the input
+inline nl_summary summarize_chunk(const char *data, size_t len) {
+    nl_summary summary = { 0, false, NL_BODY, 0 };
+
+    if (!memchr(data, '\\', len)) {
+        newline_count count = count_newlines(data, len, '\n');
+        size_t lines = count.lines;
+        if (len > 0 && data[len - 1] != '\n') lines++;   // unterminated tail
+        summary.before = lines - count.empty;
+        return summary;
+    }
+
+    const char *pos = data;
+    const char *end = data + len;
+    while (pos < end) {
+        const char *nl = (const char *)memchr(pos, '\n', end - pos);
+        if (!nl) nl = end;
+        size_t line_len = nl - pos;
+
+        int section = nl_delimiter(pos, line_len);
+        if (section >= 0) {
+            summary.delimiter = true;
+            summary.section = (nl_section)section;
+            summary.after = 0;
+        } else if (line_len > 0) {
+            if (!summary.delimiter) summary.before++;
+            else if (summary.section == NL_BODY) summary.after++;
+        }
+        pos = nl + 1;
+    }
+    return summary;
+}
+
+// State after a chunk which started in 'state'
+inline nl_state apply_summary(nl_state state, const nl_summary &summary) {
+    if (!summary.delimiter) {
+        if (state.section == NL_BODY) state.line_no += summary.before;
+        return state;
+    }
+    state.section = summary.section;
+    state.line_no = 1 + summary.after;
+    return state;
+}
+
+//***************************************************************************
+// formatting
+
+struct number_chunk {
+    const char *data;
+    size_t len;
+    nl_summary summary;
+    nl_state state;         // state at chunk start
+    out_buffer out;         // formatted chunk, never flushed by itself
+};
+
+inline void format_chunk(number_chunk &chunk, bool upper) {
+    // Every line grows by its prefix at most
+    newline_count count = count_newlines(chunk.data, chunk.len, '\n');
+    chunk.out.fd = -1;
+    chunk.out.upper = false;
+    chunk.out.used = 0;
+    chunk.out.capacity = chunk.len + (count.lines + 1) * NUMBER_MAX_PREFIX;
+    chunk.out.data = (char *)malloc(chunk.out.capacity);
+    if (!chunk.out.data) {
+        perror("malloc");
+        exit(1);
+    }
+
+    nl_state state = chunk.state;
+    const char *pos = chunk.data;
+    const char *end = chunk.data + chunk.len;
+    while (pos < end) {
+        const char *nl = (const char *)memchr(pos, '\n', end - pos);
+        if (!nl) nl = end;
+        emit_line(chunk.out, state, pos, nl - pos);
+        pos = nl + 1;
+    }
+
+    if (upper) upper_inplace(chunk.out.data, chunk.out.used);
+}
+
+inline int writev_all(int fd, std::vector<struct iovec> &iov) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        int count = iov.size() - first > IOV_MAX ? IOV_MAX : iov.size() - first;
+        ssize_t n = writev(fd, &iov[first], count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("writev");
+            return -1;
+        }
+        while (first < iov.size() && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Numbers block of whole lines (the last may miss '\n' only at the end of
+// input) with given number of threads and writes it to fd_out
+inline int number_block(const char *data, size_t len, nl_state &state, int threads, bool upper, int fd_out) {
+    if (len == 0) return 0;
+
+    size_t chunk_count = len / NUMBER_MIN_CHUNK + 1;
+    if (threads < 1) threads = 1;
+    if (chunk_count > (size_t)threads) chunk_count = threads;
+
+    // Chunks end after '\n' near equal split points
+    std::vector<number_chunk> chunks;
+    const char *pos = data;
+    const char *end = data + len;
+    for (size_t i = 0; i < chunk_count && pos < end; i++) {
+        const char *cut = end;
+        if (i + 1 < chunk_count) {
+            cut = data + len / chunk_count * (i + 1);
+            if (cut < pos) cut = pos;
+            const char *nl = (const char *)memchr(cut, '\n', end - cut);
+            cut = nl ? nl + 1 : end;
+        }
+        number_chunk chunk;
+        chunk.data = pos;
+        chunk.len = cut - pos;
+        chunks.push_back(chunk);
+        pos = cut;
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunks.size(); i++) {
+        workers.push_back(std::thread([&chunks, i]() {
+            chunks[i].summary = summarize_chunk(chunks[i].data, chunks[i].len);
+        }));
+    }
+    chunks[0].summary = summarize_chunk(chunks[0].data, chunks[0].len);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    workers.clear();
+
+    // Exclusive prefix "sum" of the summaries
+    for (size_t i = 0; i < chunks.size(); i++) {
+        chunks[i].state = state;
+        state = apply_summary(state, chunks[i].summary);
+    }
+
+    for (size_t i = 1; i < chunks.size(); i++) {
+        workers.push_back(std::thread(format_chunk, std::ref(chunks[i]), upper));
+    }
+    format_chunk(chunks[0], upper);
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+    std::vector<struct iovec> iov(chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++) {
+        iov[i].iov_base = chunks[i].out.data;
+        iov[i].iov_len = chunks[i].out.used;
+    }
+    int result = writev_all(fd_out, iov);
+
+    for (size_t i = 0; i < chunks.size(); i++) free(chunks[i].out.data);
+    return result;
+}
+
+#endif
@@ -0,0 +1,372 @@
+// N-stage pipeline builder.
+//
+// Pipeline is described by a spec string like "sort | tr [a-z] [A-Z] | nl",
+// words may be quoted with '' or "". Every stage runs in its own child
+// process connected by pipes enlarged with F_SETPIPE_SZ. Stage names
+// starting with '@' are built-in in-process filters which don't exec:
+//
+//   @cat    passes data with splice(), no copy through user space
+//   @sort   sorts lines in memory with radix_sort.h, like "LC_ALL=C sort"
+//   @upper  uppercases with upper.h kernel and hands pages over by vmsplice()
+//   @nl     numbers lines the same way as "nl -s '. '", in parallel
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <vector>
+#include <string>
+#include "upper.h"
+#include "inproc.h"
+#include "extsort.h"
+#include "numbering.h"
+
+#define PIPELINE_PIPE_SIZE (1 << 20)    // requested pipe capacity
+#define PIPELINE_CHUNK     (1 << 16)    // splice/vmsplice transfer unit
+#define PIPELINE_REGION    (4 << 20)    // pages handed to vmsplice at once
+
+typedef int (*stage_filter)(int fd_in, int fd_out);
+
+struct pipeline_stage {
+    std::vector<std::string> argv;  // exec stage, argv[0] is the command
+    stage_filter filter;            // in-process stage or NULL
+};
+
+struct pipeline {
+    std::string input;              // file for stdin of first stage, may be empty
+    std::vector<pipeline_stage> stages;
+};
+
+//***************************************************************************
+// in-process filters
+
+inline bool fd_is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+inline int write_fd(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+inline int filter_cat(int fd_in, int fd_out) {
+    // splice needs a pipe on one side, read/write is the fallback
+    if (fd_is_pipe(fd_in) || fd_is_pipe(fd_out)) {
+        while (1) {
+            ssize_t n = splice(fd_in, NULL, fd_out, NULL, PIPELINE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == 0) return 0;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL) break;
+                perror("splice");
+                return -1;
+            }
+        }
+    }
+
+    static char buffer[PIPELINE_CHUNK];
+    while (1) {
+        ssize_t n = read(fd_in, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("read");
+            return -1;
+        }
+        if (n == 0) return 0;
+        if (write_fd(fd_out, buffer, n) != 0) return -1;
+    }
+}
+
+// Pages given to vmsplice() stay referenced by the pipe (and by any pipe
+// they are spliced into later) until the reader takes them, so they are
+// never written again. Filled region is unmapped and replaced by fresh
+// pages, the kernel keeps the old ones alive while they are referenced.
+inline int filter_upper(int fd_in, int fd_out) {
+    if (!fd_is_pipe(fd_out)) return upper_filter(fd_in, fd_out);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *region = NULL;
+    size_t pos = PIPELINE_REGION;
+
+    while (1) {
+        if (pos + PIPELINE_CHUNK > PIPELINE_REGION) {
+            if (region) munmap(region, PIPELINE_REGION);
+            region = (char *)mmap(NULL, PIPELINE_REGION, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (region == MAP_FAILED) {
+                perror("mmap");
+                return -1;
+            }
+            pos = 0;
+        }
+
+        ssize_t len = read(fd_in, region + pos, PIPELINE_CHUNK);
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0) {
+            perror("read");
+            munmap(region, PIPELINE_REGION);
+            return -1;
+        }
+        if (len == 0) break;
+
+        upper_inplace(region + pos, len);
+
+        struct iovec iov = { region + pos, (size_t)len };
+        while (iov.iov_len > 0) {
+            ssize_t n = vmsplice(fd_out, &iov, 1, 0);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("vmsplice");
+                munmap(region, PIPELINE_REGION);
+                return -1;
+            }
+            iov.iov_base = (char *)iov.iov_base + n;
+            iov.iov_len -= n;
+        }
+
+        // Next chunk starts on a fresh page
+        pos += (len + page - 1) & ~(page - 1);
+    }
+
+    munmap(region, PIPELINE_REGION);
+    return 0;
+}
+
+// Whole input has to be in memory, the same as for sort(1) without spills
+inline int filter_sort(int fd_in, int fd_out) {
+    std::vector<char> buffer(PIPELINE_CHUNK);
+    size_t filled = 0;
+    while (1) {
+        if (filled == buffer.size()) buffer.resize(buffer.size() * 2);
+        ssize_t n = read(fd_in, &buffer[filled], buffer.size() - filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("read");
+            return -1;
+        }
+        if (n == 0) break;
+        filled += n;
+    }
+
+    std::vector<line_view> lines;
+    split_lines(&buffer[0], filled, lines);
+    radix_sort_lines(lines);
+
+    run_sink sink;
+    out_init(sink.out, fd_out);
+    for (size_t i = 0; i < lines.size(); i++) sink(lines[i].data, lines[i].len);
+    out_free(sink.out);
+    return 0;
+}
+
+// Input is numbered in blocks by all cores, see numbering.h
+inline int filter_nl(int fd_in, int fd_out) {
+    int threads = std::thread::hardware_concurrency();
+    std::vector<char> block(NUMBER_BLOCK);
+    size_t filled = 0;
+    bool eof = false;
+    nl_state state;
+    nl_init(state);
+
+    while (!eof) {
+        ssize_t n = read(fd_in, &block[filled], block.size() - filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("read");
+            return -1;
+        }
+        if (n == 0) eof = true;
+        filled += n;
+        if (filled < block.size() && !eof) continue;
+
+        // Only whole lines are numbered, the rest waits for more data
+        size_t used = filled;
+        if (!eof) {
+            char *nl = (char *)memrchr(&block[0], '\n', filled);
+            if (!nl) {
+                block.resize(block.size() * 2);
+                continue;
+            }
+            used = nl - &block[0] + 1;
+        }
+        if (number_block(&block[0], used, state, threads, false, fd_out) != 0) return -1;
+        memmove(&block[0], &block[used], filled - used);
+        filled -= used;
+    }
+    return 0;
+}
+
+inline stage_filter find_filter(const std::string &name) {
+    if (name == "@cat") return filter_cat;
+    if (name == "@sort") return filter_sort;
+    if (name == "@upper") return filter_upper;
+    if (name == "@nl") return filter_nl;
+    return NULL;
+}
+
+//***************************************************************************
+// building
+
+inline void pipeline_init(pipeline &p, const char *input) {
+    p.input = input ? input : "";
+    p.stages.clear();
+}
+
+inline void pipeline_add_exec(pipeline &p, const std::vector<std::string> &argv) {
+    pipeline_stage stage;
+    stage.argv = argv;
+    stage.filter = NULL;
+    p.stages.push_back(stage);
+}
+
+inline void pipeline_add_filter(pipeline &p, const char *name, stage_filter filter) {
+    pipeline_stage stage;
+    stage.argv.push_back(name);
+    stage.filter = filter;
+    p.stages.push_back(stage);
+}
+
+// Appends stages from spec string, returns -1 on syntax error
+inline int pipeline_parse(pipeline &p, const char *spec) {
+    std::vector<std::string> words;
+    std::string word;
+    bool in_word = false;
+
+    for (const char *c = spec; ; c++) {
+        if (*c == '\'' || *c == '"') {
+            const char *end = strchr(c + 1, *c);
+            if (!end) {
+                fprintf(stderr, "Unterminated quote in pipeline '%s'.\n", spec);
+                return -1;
+            }
+            word.append(c + 1, end - c - 1);
+            in_word = true;
+            c = end;
+            continue;
+        }
+        if (*c && *c != '|' && *c != ' ' && *c != '\t') {
+            word += *c;
+            in_word = true;
+            continue;
+        }
+
+        if (in_word) words.push_back(word);
+        word.clear();
+        in_word = false;
+
+        if (*c == '|' || *c == '\0') {
+            if (words.empty()) {
+                fprintf(stderr, "Empty stage in pipeline '%s'.\n", spec);
+                return -1;
+            }
+            if (words[0][0] == '@') {
+                stage_filter filter = find_filter(words[0]);
+                if (!filter || words.size() > 1) {
+                    fprintf(stderr, "Unknown built-in stage '%s'.\n", words[0].c_str());
+                    return -1;
+                }
+                pipeline_add_filter(p, words[0].c_str(), filter);
+            } else {
+                pipeline_add_exec(p, words);
+            }
+            words.clear();
+        }
+        if (*c == '\0') break;
+    }
+    return 0;
+}
+
+//***************************************************************************
+// running
+
+inline void exec_stage(const pipeline_stage &stage) {
+    std::vector<char *> argv;
+    for (size_t i = 0; i < stage.argv.size(); i++) argv.push_back((char *)stage.argv[i].c_str());
+    argv.push_back(NULL);
+
+    execvp(argv[0], &argv[0]);
+    fprintf(stderr, "execvp %s: %s\n", argv[0], strerror(errno));
+    exit(1);
+}
+
+// Runs all stages, last one writes into fd_out. Returns 0 if all succeeded.
+inline int pipeline_run(const pipeline &p, int fd_out) {
+    size_t count = p.stages.size();
+    if (count == 0) return 0;
+
+    int fd_in = STDIN_FILENO;
+    if (!p.input.empty()) {
+        fd_in = open(p.input.c_str(), O_RDONLY);
+        if (fd_in == -1) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    // pipes[i] connects stage i and i + 1
+    std::vector<int> pipes(2 * (count - 1));
+    for (size_t i = 0; i + 1 < count; i++) {
+        if (pipe(&pipes[2 * i]) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        fcntl(pipes[2 * i + 1], F_SETPIPE_SZ, PIPELINE_PIPE_SIZE);
+    }
+
+    std::vector<pid_t> pids;
+    for (size_t i = 0; i < count; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            int stage_in = i == 0 ? fd_in : pipes[2 * (i - 1)];
+            int stage_out = i + 1 == count ? fd_out : pipes[2 * i + 1];
+
+            dup2(stage_in, STDIN_FILENO);
+            dup2(stage_out, STDOUT_FILENO);
+            for (size_t j = 0; j < pipes.size(); j++) close(pipes[j]);
+            if (fd_in != STDIN_FILENO) close(fd_in);
+
+            const pipeline_stage &stage = p.stages[i];
+            if (stage.filter) exit(stage.filter(STDIN_FILENO, STDOUT_FILENO) == 0 ? 0 : 1);
+            exec_stage(stage);
+        }
+        pids.push_back(pid);
+    }
+
+    for (size_t j = 0; j < pipes.size(); j++) close(pipes[j]);
+    if (fd_in != STDIN_FILENO) close(fd_in);
+
+    int result = pids.size() == count ? 0 : -1;
+    for (size_t i = 0; i < pids.size(); i++) {
+        int status;
+        struct rusage usage;
+        wait4(pids[i], &status, 0, &usage);
+        stats_add(p.stages[i].argv[0].c_str(), usage);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) result = -1;
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,150 @@
+// MSD radix sort of lines, ordering is the same as "LC_ALL=C sort".
+//
+// Every line is represented by a key with the next 8 bytes of the line
+// stored inline as big-endian integer, so most byte fetches and compares
+// don't touch the string itself. Keys are distributed by one byte at a
+// time into 257 buckets (bucket 0 holds lines which already ended), the
+// prefix is reloaded from the string every 8 levels. Small buckets are
+// finished with insertion sort on the prefixes.
+
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define RADIX_SMALL 32      // buckets below this size use insertion sort
+
+// View of one line inside the input (without '\n')
+struct line_view {
+    const char *data;
+    size_t len;
+};
+
+// Byte order comparison, shorter line first on equal prefix (LC_ALL=C sort)
+inline bool line_less(const line_view &a, const line_view &b) {
+    size_t n = a.len < b.len ? a.len : b.len;
+    int cmp = memcmp(a.data, b.data, n);
+    if (cmp != 0) return cmp < 0;
+    return a.len < b.len;
+}
+
+struct radix_key {
+    uint64_t prefix;        // bytes [depth & ~7, +8) of the line, zero padded
+    const char *data;
+    size_t len;
+};
+
+inline uint64_t load_prefix(const char *data, size_t len, size_t offset) {
+    uint64_t prefix = 0;
+    if (offset >= len) return 0;
+    if (len - offset >= 8) {
+        memcpy(&prefix, data + offset, 8);
+        return __builtin_bswap64(prefix);
+    }
+    for (size_t i = 0; offset + i < len; i++) {
+        prefix |= (uint64_t)(unsigned char)data[offset + i] << (56 - 8 * i);
+    }
+    return prefix;
+}
+
+// Zero padding makes equal prefixes ambiguous, full compare decides then
+inline bool key_less(const radix_key &a, const radix_key &b) {
+    if (a.prefix != b.prefix) return a.prefix < b.prefix;
+    line_view va = { a.data, a.len };
+    line_view vb = { b.data, b.len };
+    return line_less(va, vb);
+}
+
+inline void radix_insertion_sort(radix_key *keys, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        radix_key key = keys[i];
+        size_t j = i;
+        while (j > 0 && key_less(key, keys[j - 1])) {
+            keys[j] = keys[j - 1];
+            j--;
+        }
+        keys[j] = key;
+    }
+}
+
+// Bucket of key at given depth, 0 for lines shorter than depth
+inline unsigned radix_bucket(const radix_key &key, size_t depth) {
+    if (depth >= key.len) return 0;
+    return ((key.prefix >> (56 - 8 * (depth & 7))) & 0xFF) + 1;
+}
+
+// All keys share their first 'depth' bytes, tmp has room for n keys
+inline void radix_sort_range(radix_key *keys, radix_key *tmp, size_t n, size_t depth) {
+    while (n >= RADIX_SMALL) {
+        if (depth > 0 && (depth & 7) == 0) {
+            for (size_t i = 0; i < n; i++) keys[i].prefix = load_prefix(keys[i].data, keys[i].len, depth);
+        }
+
+        size_t count[257];
+        memset(count, 0, sizeof(count));
+        for (size_t i = 0; i < n; i++) count[radix_bucket(keys[i], depth)]++;
+
+        // Common byte, no need to move anything
+        if (count[0] == n) return;
+        unsigned single = 0;
+        while (count[single] == 0) single++;
+        if (count[single] == n) {
+            depth++;
+            continue;
+        }
+
+        size_t start[257];
+        size_t pos = 0;
+        for (int b = 0; b < 257; b++) {
+            start[b] = pos;
+            pos += count[b];
+        }
+        for (size_t i = 0; i < n; i++) tmp[start[radix_bucket(keys[i], depth)]++] = keys[i];
+        memcpy(keys, tmp, n * sizeof(radix_key));
+
+        // Bucket 0 holds equal lines which ended here. The largest bucket
+        // is sorted by this loop, the others are at most half of n, so
+        // recursion is at most log2(n) deep even for nested prefixes.
+        int largest = 1;
+        for (int b = 2; b < 257; b++) {
+            if (count[b] > count[largest]) largest = b;
+        }
+        size_t largest_pos = 0;
+        pos = count[0];
+        for (int b = 1; b < 257; b++) {
+            if (b == largest) largest_pos = pos;
+            else if (count[b] > 1) radix_sort_range(keys + pos, tmp + pos, count[b], depth + 1);
+            pos += count[b];
+        }
+        keys += largest_pos;
+        tmp += largest_pos;
+        n = count[largest];
+        depth++;
+    }
+    radix_insertion_sort(keys, n);
+}
+
+// Sorts lines in place in byte order
+inline void radix_sort_lines(std::vector<line_view> &lines) {
+    size_t n = lines.size();
+    if (n < 2) return;
+
+    std::vector<radix_key> keys(n);
+    std::vector<radix_key> tmp(n);
+    for (size_t i = 0; i < n; i++) {
+        keys[i].prefix = load_prefix(lines[i].data, lines[i].len, 0);
+        keys[i].data = lines[i].data;
+        keys[i].len = lines[i].len;
+    }
+
+    radix_sort_range(&keys[0], &tmp[0], n, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        lines[i].data = keys[i].data;
+        lines[i].len = keys[i].len;
+    }
+}
+
+#endif
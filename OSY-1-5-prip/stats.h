@@ -0,0 +1,87 @@
+// Per-stage CPU and memory statistics of the names pipeline.
+//
+// Stage is either a child process of the exec pipeline (rusage from wait4)
+// or a phase of the in-process engines (getrusage delta of this process).
+// Records are written as "stage,user_s,sys_s,maxrss_kb" lines with --stats,
+// bench_pipeline reads them back.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <vector>
+#include <string>
+
+struct stage_stat {
+    std::string name;
+    double user;
+    double sys;
+    long maxrss_kb;
+};
+
+struct stats_state {
+    bool enabled;
+    std::vector<stage_stat> stages;
+    std::string phase;          // in-process phase being measured
+    struct rusage phase_start;
+};
+
+inline stats_state &g_stats() {
+    static stats_state state = { false, std::vector<stage_stat>(), std::string(), rusage() };
+    return state;
+}
+
+inline double tv_sec(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+inline void stats_add(const char *name, const struct rusage &usage) {
+    if (!g_stats().enabled) return;
+    stage_stat stat;
+    stat.name = name;
+    stat.user = tv_sec(usage.ru_utime);
+    stat.sys = tv_sec(usage.ru_stime);
+    stat.maxrss_kb = usage.ru_maxrss;
+    g_stats().stages.push_back(stat);
+}
+
+// Ends previous phase of this process (if any) and starts a new one
+inline void stats_phase(const char *name) {
+    stats_state &state = g_stats();
+    if (!state.enabled) return;
+
+    struct rusage now;
+    getrusage(RUSAGE_SELF, &now);
+    if (!state.phase.empty()) {
+        stage_stat stat;
+        stat.name = state.phase;
+        stat.user = tv_sec(now.ru_utime) - tv_sec(state.phase_start.ru_utime);
+        stat.sys = tv_sec(now.ru_stime) - tv_sec(state.phase_start.ru_stime);
+        stat.maxrss_kb = now.ru_maxrss;
+        state.stages.push_back(stat);
+    }
+    state.phase = name ? name : "";
+    state.phase_start = now;
+}
+
+inline int stats_write(const char *filename) {
+    stats_phase(NULL);
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror("fopen stats");
+        return -1;
+    }
+    const std::vector<stage_stat> &stages = g_stats().stages;
+    for (size_t i = 0; i < stages.size(); i++) {
+        fprintf(file, "%s,%.6f,%.6f,%ld\n", stages[i].name.c_str(),
+                stages[i].user, stages[i].sys, stages[i].maxrss_kb);
+    }
+    fclose(file);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,116 @@
+// ASCII uppercase kernel, the same mapping as "tr [a-z] [A-Z]" in C locale.
+//
+// Buffer is converted in place. AVX2 and SSE2 versions are compiled with
+// target attributes, so the makefile flags stay unchanged, and the best
+// one supported by the CPU is picked on first use.
+
+#ifndef UPPER_H
+#define UPPER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UPPER_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*upper_fn)(char *data, size_t len);
+
+inline void upper_scalar(char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        // Unsigned trick: only 'a'..'z' fall below 26 after subtraction
+        data[i] -= ((unsigned char)(data[i] - 'a') < 26) * ('a' - 'A');
+    }
+}
+
+#ifdef UPPER_X86
+
+// Lowercase bytes are moved to -128..-103, so one signed compare finds them
+__attribute__((target("sse2")))
+inline void upper_sse2(char *data, size_t len) {
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - 'a'));
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i diff = _mm_set1_epi8('a' - 'A');
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i lower = _mm_cmplt_epi8(_mm_add_epi8(v, shift), limit);
+        v = _mm_sub_epi8(v, _mm_and_si128(lower, diff));
+        _mm_storeu_si128((__m128i *)(data + i), v);
+    }
+    upper_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+inline void upper_avx2(char *data, size_t len) {
+    const __m256i shift = _mm256_set1_epi8((char)(0x80 - 'a'));
+    const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i diff = _mm256_set1_epi8('a' - 'A');
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        // AVX2 has only greater-than, so compare limit > value
+        __m256i lower = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift));
+        v = _mm256_sub_epi8(v, _mm256_and_si256(lower, diff));
+        _mm256_storeu_si256((__m256i *)(data + i), v);
+    }
+    upper_sse2(data + i, len - i);
+}
+
+#endif
+
+inline const char *upper_name(upper_fn fn) {
+#ifdef UPPER_X86
+    if (fn == upper_avx2) return "avx2";
+    if (fn == upper_sse2) return "sse2";
+#endif
+    return "scalar";
+}
+
+// Best kernel for this CPU
+inline upper_fn upper_select() {
+#ifdef UPPER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return upper_avx2;
+    if (__builtin_cpu_supports("sse2")) return upper_sse2;
+#endif
+    return upper_scalar;
+}
+
+inline void upper_inplace(char *data, size_t len) {
+    static upper_fn fn = upper_select();
+    fn(data, len);
+}
+
+// Pipeline stage replacing tr: copies fd_in to fd_out in uppercase
+inline int upper_filter(int fd_in, int fd_out) {
+    static char buffer[1 << 16];
+    while (1) {
+        ssize_t len = read(fd_in, buffer, sizeof(buffer));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        if (len == 0) return 0;
+
+        upper_inplace(buffer, len);
+        for (ssize_t done = 0; done < len; ) {
+            ssize_t n = write(fd_out, buffer + done, len - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("write");
+                return -1;
+            }
+            done += n;
+        }
+    }
+}
+
+#endif
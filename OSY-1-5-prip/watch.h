@@ -0,0 +1,323 @@
+// Watch mode: keeps numbered sorted output up to date while input grows.
+//
+// Lines are copied into an append-only arena and kept in a sorted array of
+// views together with the nl state and output offset of every line. When
+// inotify reports a change, only the appended bytes are read, new lines are
+// radix sorted and merged into the array (O(n) instead of O(n log n) sort
+// and fork/exec). Output before the first new line doesn't change:
+//
+//   -o file   file is rewritten from the first changed line, the rest stays
+//   stdout    full output once, then "+line:output line" delta records for
+//             every line from the first changed one to the end (line = its
+//             1-based position, the record replaces or adds that line, as
+//             numbers after an inserted line change too)
+//
+// Unterminated last line waits until its '\n' arrives. Truncated input is
+// read again from the beginning, so is a new file under the input name
+// (found by its inode, the directory is watched for it). Stdout then gets
+// "!reset" record, all lines before it are void, and full output again.
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "inproc.h"
+#include "radix_sort.h"
+
+#define WATCH_ARENA_BLOCK (16 << 20)
+#define WATCH_READ_SIZE (1 << 20)
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)
+#define WATCH_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+// Stable storage of line bytes, blocks are never moved or freed
+struct line_arena {
+    std::vector<char *> blocks;
+    size_t used;        // in the last block
+    size_t capacity;    // of the last block
+};
+
+inline const char *arena_add(line_arena &arena, const char *data, size_t len) {
+    if (arena.blocks.empty() || arena.used + len > arena.capacity) {
+        arena.capacity = len > WATCH_ARENA_BLOCK ? len : WATCH_ARENA_BLOCK;
+        char *block = (char *)malloc(arena.capacity ? arena.capacity : 1);
+        if (!block) {
+            perror("malloc");
+            exit(1);
+        }
+        arena.blocks.push_back(block);
+        arena.used = 0;
+    }
+    char *dst = arena.blocks.back() + arena.used;
+    memcpy(dst, data, len);
+    arena.used += len;
+    return dst;
+}
+
+inline void arena_free(line_arena &arena) {
+    for (size_t i = 0; i < arena.blocks.size(); i++) free(arena.blocks[i]);
+    arena.blocks.clear();
+    arena.used = arena.capacity = 0;
+}
+
+struct watch_state {
+    const char *filename;
+    int fd_in;
+    off_t offset;                   // input bytes already processed
+    std::vector<char> carry;        // unterminated last line
+    line_arena arena;
+    std::vector<line_view> lines;   // sorted
+    std::vector<nl_state> states;   // nl state before line i, size n + 1
+    std::vector<uint64_t> offsets;  // output offset of line i, size n + 1
+    int fd_out;                     // -1 = stdout with delta records
+};
+
+// Reads bytes appended since last call, returns complete new lines
+inline int watch_read(watch_state &watch, std::vector<line_view> &fresh) {
+    static char buffer[WATCH_READ_SIZE];
+    while (1) {
+        ssize_t n = pread(watch.fd_in, buffer, sizeof(buffer), watch.offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return -1;
+        }
+        if (n == 0) break;
+        watch.offset += n;
+
+        const char *pos = buffer;
+        const char *end = buffer + n;
+        while (pos < end) {
+            const char *nl = (const char *)memchr(pos, '\n', end - pos);
+            if (!nl) {
+                watch.carry.insert(watch.carry.end(), pos, end);
+                break;
+            }
+            line_view line;
+            if (watch.carry.empty()) {
+                line.data = arena_add(watch.arena, pos, nl - pos);
+                line.len = nl - pos;
+            } else {
+                watch.carry.insert(watch.carry.end(), pos, nl);
+                line.len = watch.carry.size();
+                line.data = arena_add(watch.arena, &watch.carry[0], line.len);
+                watch.carry.clear();
+            }
+            fresh.push_back(line);
+            pos = nl + 1;
+        }
+    }
+    return 0;
+}
+
+// Recomputes states and offsets from line 'first' and writes the output
+// from there to the end of -o file
+inline int watch_rewrite(watch_state &watch, size_t first) {
+    size_t n = watch.lines.size();
+    watch.states.resize(n + 1);
+    watch.offsets.resize(n + 1);
+
+    nl_state state = watch.states[first];
+    for (size_t i = first; i < n; i++) {
+        watch.states[i] = state;
+        uint64_t size = nl_line_size(watch.lines[i], state);
+        watch.offsets[i + 1] = watch.offsets[i] + size;
+    }
+    watch.states[n] = state;
+
+    if (watch.fd_out < 0) return 0;
+
+    if (lseek(watch.fd_out, watch.offsets[first], SEEK_SET) == (off_t)-1) {
+        perror("lseek");
+        return -1;
+    }
+    out_buffer out;
+    out_init(out, watch.fd_out, true);
+    state = watch.states[first];
+    for (size_t i = first; i < n; i++) emit_line(out, state, watch.lines[i].data, watch.lines[i].len);
+    out_free(out);
+
+    if (ftruncate(watch.fd_out, watch.offsets[n]) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    return 0;
+}
+
+// Delta records for stdout mode, lines from first to the end
+inline void watch_print_delta(watch_state &watch, size_t first) {
+    out_buffer out;
+    out_init(out, STDOUT_FILENO, true);
+    for (size_t i = first; i < watch.lines.size(); i++) {
+        char *dst = out_reserve(out, 32);
+        out.used += sprintf(dst, "+%zu:", i + 1);
+        nl_state state = watch.states[i];
+        emit_line(out, state, watch.lines[i].data, watch.lines[i].len);
+    }
+    out_free(out);
+}
+
+// Merges new lines into the sorted array and updates the output
+inline int watch_apply(watch_state &watch, std::vector<line_view> &fresh) {
+    if (fresh.empty()) return 0;
+    radix_sort_lines(fresh);
+
+    // New lines go after equal old ones, so everything before stays
+    std::vector<line_view> &lines = watch.lines;
+    size_t first = std::upper_bound(lines.begin(), lines.end(), fresh[0], line_less) - lines.begin();
+
+    std::vector<line_view> merged;
+    merged.reserve(lines.size() + fresh.size());
+    merged.insert(merged.end(), lines.begin(), lines.begin() + first);
+
+    size_t a = first, b = 0;
+    while (a < lines.size() || b < fresh.size()) {
+        if (b < fresh.size() && (a == lines.size() || line_less(fresh[b], lines[a]))) {
+            merged.push_back(fresh[b++]);
+        } else {
+            merged.push_back(lines[a++]);
+        }
+    }
+    lines.swap(merged);
+
+    if (watch_rewrite(watch, first) != 0) return -1;
+    if (watch.fd_out < 0) watch_print_delta(watch, first);
+    return 0;
+}
+
+// Reads whole input again, used at start and after truncation or rename
+inline int watch_reload(watch_state &watch) {
+    bool reset = watch.fd_in >= 0;
+    if (watch.fd_in >= 0) close(watch.fd_in);
+    watch.fd_in = open(watch.filename, O_RDONLY);
+    if (watch.fd_in == -1) {
+        perror("open");
+        return -1;
+    }
+
+    watch.offset = 0;
+    watch.carry.clear();
+    arena_free(watch.arena);
+    watch.lines.clear();
+
+    nl_state initial;
+    nl_init(initial);
+    watch.states.assign(1, initial);
+    watch.offsets.assign(1, 0);
+
+    if (watch_read(watch, watch.lines) != 0) return -1;
+    radix_sort_lines(watch.lines);
+    if (watch_rewrite(watch, 0) != 0) return -1;
+
+    // Stdout gets the full output once, then only deltas. On reload the
+    // consumer drops what it has first.
+    if (watch.fd_out < 0) {
+        out_buffer out;
+        out_init(out, STDOUT_FILENO, true);
+        if (reset) {
+            out.upper = false;
+            memcpy(out_reserve(out, 7), "!reset\n", 7);
+            out.used += 7;
+            out_flush(out);
+            out.upper = true;
+        }
+        nl_state state = initial;
+        for (size_t i = 0; i < watch.lines.size(); i++) {
+            emit_line(out, state, watch.lines[i].data, watch.lines[i].len);
+        }
+        out_free(out);
+    }
+    return 0;
+}
+
+// Watches filename forever, output goes into output_file or to stdout
+inline int run_watch(const char *filename, const char *output_file) {
+    watch_state watch;
+    watch.filename = filename;
+    watch.fd_in = -1;
+    watch.fd_out = -1;
+    watch.arena.used = watch.arena.capacity = 0;
+
+    if (output_file) {
+        watch.fd_out = open(output_file, O_CREAT | O_RDWR, 0644);
+        if (watch.fd_out == -1) {
+            perror("open output");
+            return -1;
+        }
+    }
+
+    int notify_fd = inotify_init1(IN_CLOEXEC);
+    if (notify_fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    // Replaced input (rename over it, or delete and create) shows up in the
+    // directory only, the open fd_in keeps the old file alive
+    std::string path(filename);
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+    int dir_wd = inotify_add_watch(notify_fd, dir.c_str(), WATCH_DIR_EVENTS);
+    if (dir_wd == -1) {
+        perror("inotify_add_watch");
+        return -1;
+    }
+    int wd = inotify_add_watch(notify_fd, filename, WATCH_EVENTS);
+    if (wd == -1) {
+        perror("inotify_add_watch");
+        return -1;
+    }
+    if (watch_reload(watch) != 0) return -1;
+
+    char events[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(8)));
+    while (1) {
+        ssize_t len = read(notify_fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            perror("read inotify");
+            return -1;
+        }
+
+        bool relevant = false;
+        for (char *p = events; p < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->wd == wd && !(event->mask & IN_IGNORED)) relevant = true;
+            if (event->wd == dir_wd && event->len > 0 && base == event->name) relevant = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (!relevant) continue;
+
+        // Another file under the name, moved away or deleted one waits for it
+        struct stat current, named;
+        if (stat(filename, &named) != 0) continue;
+        if (fstat(watch.fd_in, &current) != 0 ||
+            current.st_ino != named.st_ino || current.st_dev != named.st_dev) {
+            if (wd != -1) inotify_rm_watch(notify_fd, wd);
+            wd = inotify_add_watch(notify_fd, filename, WATCH_EVENTS);
+            if (watch_reload(watch) != 0) return -1;
+            continue;
+        }
+
+        if (current.st_size < watch.offset) {
+            if (watch_reload(watch) != 0) return -1;
+            continue;
+        }
+
+        std::vector<line_view> fresh;
+        if (watch_read(watch, fresh) != 0) return -1;
+        if (watch_apply(watch, fresh) != 0) return -1;
+    }
+}
+
+#endif
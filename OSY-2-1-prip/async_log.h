@@ -0,0 +1,443 @@
+// Asynchronous backend of log_msg() for the servers.
+//
+// Caller doesn't format anything. log_record() walks the format, copies
+// the arguments (strings included) into a slot of its thread's ring and
+// returns. Every thread has its own single producer ring, rings are
+// chained into a lock-free list when a thread logs for the first time.
+// The writer thread takes the slots, formats them conversion by
+// conversion with snprintf() and writes them in batches with writev():
+// errors to stderr, the rest to stdout, "ERR: ", "INF: ", "DEB: " prefix.
+//
+// Full ring makes the caller wait for the writer, nothing is lost. Records
+// left in rings are written by fork() (pthread_atfork) and exit() (atexit),
+// so forked children neither lose nor repeat them.
+//
+// Level filter stays in log_msg() of the server (compare with g_debug),
+// a disabled level costs only the call.
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+
+#define LOG_RING_SLOTS 256
+#define LOG_SLOT_SIZE 512
+#define LOG_MAX_ARGS 16
+#define LOG_LINE_MAX 1024           // formatted record, as the former buffer
+#define LOG_BATCH_SIZE (64 << 10)
+#define LOG_BATCH_IOV 64
+#define LOG_IDLE_MS 10              // writer checks the rings at least this often
+
+// Type of a copied argument
+enum log_arg_type { LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_DOUBLE, LOG_ARG_STRING, LOG_ARG_POINTER };
+
+union log_value {
+    long long integer;
+    double real;
+    const void *pointer;
+    uint32_t string;                // offset of the copy in the slot
+};
+
+struct log_slot {
+    const char *format;             // NULL = text is already formatted
+    uint8_t level;
+    uint8_t count;
+    uint8_t types[LOG_MAX_ARGS];
+    log_value values[LOG_MAX_ARGS];
+    char data[LOG_SLOT_SIZE - sizeof(const char *) - 2 - LOG_MAX_ARGS - LOG_MAX_ARGS * sizeof(log_value)];
+};
+
+// head and tail are apart, each on its own cache line
+struct log_ring {
+    std::atomic<uint32_t> head;     // next slot to write
+    char head_pad[64];
+    std::atomic<uint32_t> tail;     // next slot to format
+    char tail_pad[64];
+    log_ring *next;
+    log_slot slots[LOG_RING_SLOTS];
+};
+
+struct log_backend {
+    std::atomic<log_ring *> rings;
+    std::atomic<bool> started;
+    std::atomic<bool> sleeping;
+    std::mutex mutex;               // one consumer at a time
+    std::condition_variable wake;
+};
+
+// Never destroyed, the writer thread may still use it during exit()
+inline log_backend &g_log() {
+    static log_backend *backend = new log_backend();
+    return *backend;
+}
+
+//***************************************************************************
+// conversions
+
+// One conversion spec of printf, fmt points at '%'
+struct log_spec {
+    const char *end;                // after the conversion character
+    char conversion;
+    bool wide;                      // l, ll, z, j, t: 64-bit integer
+    bool long_double;               // L
+    int stars;                      // width or precision given by argument
+    bool star_precision;            // the last star is the precision
+    int precision;                  // -1 = none, -2 = from argument
+};
+
+inline void log_parse_spec(const char *fmt, log_spec &spec) {
+    const char *pos = fmt + 1;
+    spec.wide = false;
+    spec.long_double = false;
+    spec.stars = 0;
+    spec.star_precision = false;
+    spec.precision = -1;
+
+    while (*pos && strchr("-+ #0'", *pos)) pos++;
+    if (*pos == '*') { spec.stars++; pos++; }
+    while (*pos >= '0' && *pos <= '9') pos++;
+    if (*pos == '.') {
+        pos++;
+        if (*pos == '*') {
+            spec.stars++;
+            spec.star_precision = true;
+            spec.precision = -2;
+            pos++;
+        } else {
+            spec.precision = 0;
+            while (*pos >= '0' && *pos <= '9') spec.precision = spec.precision * 10 + *pos++ - '0';
+        }
+    }
+    while (*pos && strchr("hlLqjzt", *pos)) {
+        if (strchr("lqjzt", *pos)) spec.wide = true;
+        if (*pos == 'L') spec.long_double = true;
+        pos++;
+    }
+    spec.conversion = *pos;
+    spec.end = *pos ? pos + 1 : pos;
+}
+
+// Copies the arguments of a record into slot, false when they don't fit
+inline bool log_capture(log_slot &slot, const char *format, va_list args) {
+    size_t used = 0;
+    slot.count = 0;
+    for (const char *pos = format; *pos; ) {
+        if (*pos != '%') {
+            pos++;
+            continue;
+        }
+        if (pos[1] == '%') {
+            pos += 2;
+            continue;
+        }
+        log_spec spec;
+        log_parse_spec(pos, spec);
+        pos = spec.end;
+        if (slot.count + spec.stars + 1 > LOG_MAX_ARGS) return false;
+
+        int precision = spec.precision;
+        for (int i = 0; i < spec.stars; i++) {
+            int value = va_arg(args, int);
+            if (spec.star_precision && i == spec.stars - 1) precision = value;
+            slot.types[slot.count] = LOG_ARG_INT;
+            slot.values[slot.count++].integer = value;
+        }
+
+        uint8_t &type = slot.types[slot.count];
+        log_value &value = slot.values[slot.count++];
+        switch (spec.conversion) {
+            case 'd': case 'i': case 'c':
+                type = spec.wide ? LOG_ARG_LONG : LOG_ARG_INT;
+                value.integer = spec.wide ? va_arg(args, long long) : va_arg(args, int);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                type = spec.wide ? LOG_ARG_LONG : LOG_ARG_INT;
+                value.integer = spec.wide ? (long long)va_arg(args, unsigned long long) : (long long)va_arg(args, unsigned);
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                type = LOG_ARG_DOUBLE;
+                value.real = spec.long_double ? (double)va_arg(args, long double) : va_arg(args, double);
+                break;
+            case 's': {
+                const char *text = va_arg(args, const char *);
+                if (!text) text = "(null)";
+                size_t len = precision >= 0 ? strnlen(text, precision) : strlen(text);
+                if (used + len + 1 > sizeof(slot.data)) return false;
+                memcpy(slot.data + used, text, len);
+                slot.data[used + len] = '\0';
+                type = LOG_ARG_STRING;
+                value.string = used;
+                used += len + 1;
+                break;
+            }
+            case 'p':
+                type = LOG_ARG_POINTER;
+                value.pointer = va_arg(args, void *);
+                break;
+            default:
+                // %n and unknown conversions are not supported
+                return false;
+        }
+    }
+    return true;
+}
+
+// Formats slot into dst, returns its length with the '\n'
+inline size_t log_format(const log_slot &slot, char *dst, size_t size) {
+    static const char *prefix[] = { "ERR: ", "INF: ", "DEB: " };
+    size_t len = snprintf(dst, size, "%s", prefix[slot.level < 3 ? slot.level : 2]);
+
+    if (!slot.format) {
+        len += snprintf(dst + len, size - len, "%s", slot.data);
+    } else {
+        int arg = 0;
+        for (const char *pos = slot.format; *pos && len < size - 1; ) {
+            if (*pos != '%' || pos[1] == '%') {
+                dst[len++] = *pos;
+                pos += *pos == '%' ? 2 : 1;
+                continue;
+            }
+
+            // Spec with stars replaced by their values and 64-bit
+            // integers as "ll"
+            log_spec spec;
+            log_parse_spec(pos, spec);
+            char piece[64];
+            size_t piece_len = 0;
+            for (const char *c = pos; c < spec.end && piece_len < sizeof(piece) - 24; c++) {
+                if (*c == '*') piece_len += snprintf(piece + piece_len, 24, "%lld", slot.values[arg++].integer);
+                else if (strchr("hlLqjzt", *c)) continue;
+                else if (c == spec.end - 1 && slot.types[arg] == LOG_ARG_LONG) {
+                    piece[piece_len++] = 'l';
+                    piece[piece_len++] = 'l';
+                    piece[piece_len++] = *c;
+                }
+                else piece[piece_len++] = *c;
+            }
+            piece[piece_len] = '\0';
+            pos = spec.end;
+
+            const log_value &value = slot.values[arg];
+            size_t room = size - len;
+            int written = 0;
+            switch (slot.types[arg++]) {
+                case LOG_ARG_INT:     written = snprintf(dst + len, room, piece, (int)value.integer); break;
+                case LOG_ARG_LONG:    written = snprintf(dst + len, room, piece, value.integer); break;
+                case LOG_ARG_DOUBLE:  written = snprintf(dst + len, room, piece, value.real); break;
+                case LOG_ARG_STRING:  written = snprintf(dst + len, room, piece, slot.data + value.string); break;
+                case LOG_ARG_POINTER: written = snprintf(dst + len, room, piece, value.pointer); break;
+            }
+            len += written > 0 ? (size_t)written : 0;
+            if (len > size - 1) len = size - 1;
+        }
+        dst[len < size ? len : size - 1] = '\0';
+    }
+    if (len > size - 2) len = size - 2;
+    dst[len++] = '\n';
+    return len;
+}
+
+//***************************************************************************
+// writer
+
+struct log_batch {
+    char text[LOG_BATCH_SIZE];
+    size_t used;
+    struct iovec iov[2][LOG_BATCH_IOV];     // stdout, stderr
+    int count[2];
+};
+
+inline void log_batch_write(log_batch &batch) {
+    for (int stream = 0; stream < 2; stream++) {
+        int fd = stream ? STDERR_FILENO : STDOUT_FILENO;
+        struct iovec *iov = batch.iov[stream];
+        int count = batch.count[stream];
+        while (count > 0) {
+            ssize_t written = writev(fd, iov, count);
+            if (written < 0) break;
+            while (count > 0 && (size_t)written >= iov->iov_len) {
+                written -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = (char *)iov->iov_base + written;
+                iov->iov_len -= written;
+            }
+        }
+        batch.count[stream] = 0;
+    }
+    batch.used = 0;
+}
+
+// Formats and writes everything in the rings, caller holds g_log().mutex.
+// Returns number of records.
+inline size_t log_drain() {
+    static log_batch batch;
+    size_t records = 0;
+    batch.used = 0;
+    batch.count[0] = batch.count[1] = 0;
+
+    for (log_ring *ring = g_log().rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            if (batch.used + LOG_LINE_MAX > LOG_BATCH_SIZE ||
+                batch.count[0] == LOG_BATCH_IOV || batch.count[1] == LOG_BATCH_IOV) log_batch_write(batch);
+
+            const log_slot &slot = ring->slots[tail % LOG_RING_SLOTS];
+            char *text = batch.text + batch.used;
+            size_t len = log_format(slot, text, LOG_LINE_MAX);
+            batch.used += len;
+
+            // Neighbouring records of one stream share the iovec
+            int stream = slot.level == 0;
+            struct iovec *last = batch.count[stream] ? &batch.iov[stream][batch.count[stream] - 1] : NULL;
+            if (last && (char *)last->iov_base + last->iov_len == text) {
+                last->iov_len += len;
+            } else {
+                batch.iov[stream][batch.count[stream]].iov_base = text;
+                batch.iov[stream][batch.count[stream]++].iov_len = len;
+            }
+            records++;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    log_batch_write(batch);
+    return records;
+}
+
+// Mutex is released after every pass, so that fork() and exit() get it
+inline void *log_writer(void *) {
+    log_backend &backend = g_log();
+    while (1) {
+        size_t records;
+        {
+            std::lock_guard<std::mutex> lock(backend.mutex);
+            records = log_drain();
+        }
+        if (records > 0) {
+            sched_yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(backend.mutex);
+        backend.sleeping.store(true);
+        if (log_drain() == 0) backend.wake.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_MS));
+        backend.sleeping.store(false);
+    }
+    return NULL;
+}
+
+// Writes what is left, for exit() and fork()
+inline void log_flush() {
+    std::lock_guard<std::mutex> lock(g_log().mutex);
+    log_drain();
+}
+
+inline void log_fork_prepare() {
+    g_log().mutex.lock();
+    log_drain();
+}
+
+inline void log_fork_parent() {
+    g_log().mutex.unlock();
+}
+
+// Child has no writer thread and the records were written by the parent.
+// Condition variable may have had waiters of the parent, it starts anew.
+inline void log_fork_child() {
+    log_backend &backend = g_log();
+    new (&backend.wake) std::condition_variable();
+    for (log_ring *ring = backend.rings.load(); ring; ring = ring->next) ring->tail.store(ring->head.load());
+    backend.started.store(false);
+    backend.sleeping.store(false);
+    backend.mutex.unlock();
+}
+
+inline void log_start_writer() {
+    log_backend &backend = g_log();
+    std::lock_guard<std::mutex> lock(backend.mutex);
+    if (backend.started.load()) return;
+
+    static bool registered = false;
+    if (!registered) {
+        registered = true;
+        atexit(log_flush);
+        pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_writer, NULL) == 0) {
+        pthread_detach(thread);
+        backend.started.store(true);
+    }
+}
+
+//***************************************************************************
+// producer
+
+inline log_ring *log_thread_ring() {
+    static thread_local log_ring *ring = NULL;
+    if (ring) return ring;
+
+    ring = new log_ring;
+    ring->head.store(0);
+    ring->tail.store(0);
+    log_ring *first = g_log().rings.load();
+    do {
+        ring->next = first;
+    } while (!g_log().rings.compare_exchange_weak(first, ring));
+    return ring;
+}
+
+// Puts one record into the ring of the calling thread
+inline void log_record(int level, const char *format, va_list args) {
+    log_backend &backend = g_log();
+    if (!backend.started.load(std::memory_order_acquire)) log_start_writer();
+
+    log_ring *ring = log_thread_ring();
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    while (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS) {
+        if (!backend.started.load()) {
+            // No writer thread, the caller writes it
+            log_flush();
+            continue;
+        }
+        backend.wake.notify_one();
+        sched_yield();
+    }
+
+    // Not captured records are formatted right away
+    log_slot &slot = ring->slots[head % LOG_RING_SLOTS];
+    slot.level = level;
+    va_list copy;
+    va_copy(copy, args);
+    if (log_capture(slot, format, copy)) {
+        slot.format = format;
+    } else {
+        slot.format = NULL;
+        vsnprintf(slot.data, sizeof(slot.data), format, args);
+    }
+    va_end(copy);
+    ring->head.store(head + 1, std::memory_order_release);
+
+    // Writer polls every LOG_IDLE_MS, it is woken up only for a filling ring
+    if (head + 1 - ring->tail.load(std::memory_order_relaxed) == LOG_RING_SLOTS / 2 &&
+        backend.sleeping.load(std::memory_order_relaxed)) backend.wake.notify_one();
+}
+
+#endif
@@ -0,0 +1,119 @@
+// Micro-benchmark of calc.h against the former sscanf/snprintf calculator.
+//
+// Expressions are generated the same way as generate_random_expression()
+// in socket_cl, so both evaluators get the traffic they see in practice.
+// Results of both are compared first, then each one evaluates the whole
+// set several times and the best round is printed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include "calc.h"
+
+#define DEFAULT_COUNT 100000
+#define DEFAULT_ROUNDS 5
+
+// Former calculator() of socket_srv
+int calculator_sscanf(const char *expression, char *response) {
+    int num1, num2, result;
+    char op;
+
+    if (sscanf(expression, "%d %c %d", &num1, &op, &num2) != 3) {
+        snprintf(response, 256, "Invalid expression format. Use format: <number> <operator> <number>\n");
+        return -1;
+    }
+
+    switch (op) {
+        case '+': result = num1 + num2; break;
+        case '-': result = num1 - num2; break;
+        case '*': result = num1 * num2; break;
+        case '/':
+            if (num2 == 0) {
+                snprintf(response, 256, "Error: Division by zero.\n");
+                return -1;
+            }
+            result = num1 / num2;
+            break;
+        default:
+            snprintf(response, 256, "Invalid operator. Use +, -, *, or /.\n");
+            return -1;
+    }
+
+    snprintf(response, 256, "%d %c %d = %d\n", num1, op, num2, result);
+    return 0;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*calculator_fn)(const char *, char *);
+
+double bench(calculator_fn fn, const std::vector<std::string> &expressions, int rounds) {
+    char response[256];
+    double best = 1e9;
+    unsigned checksum = 0;
+    for (int r = 0; r < rounds; r++) {
+        double start = now_sec();
+        for (size_t i = 0; i < expressions.size(); i++) {
+            fn(expressions[i].c_str(), response);
+            checksum += response[0];
+        }
+        double elapsed = now_sec() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    // Keeps the calls from being optimised out
+    if (checksum == 1) printf(" ");
+    return best;
+}
+
+void help(const char *program_name) {
+    printf("Usage: %s [-h] [-n count] [-r rounds]\n", program_name);
+    printf("Options:\n");
+    printf("  -n count   number of expressions (default %d)\n", DEFAULT_COUNT);
+    printf("  -r rounds  rounds per evaluator, best one is reported (default %d)\n", DEFAULT_ROUNDS);
+    printf("  -h         show help\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    int count = DEFAULT_COUNT;
+    int rounds = DEFAULT_ROUNDS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+        else help(argv[0]);
+    }
+    if (count <= 0 || rounds <= 0) help(argv[0]);
+
+    // Same as generate_random_expression() in socket_cl.cpp
+    srand(1);
+    std::vector<std::string> expressions;
+    char operators[] = "+-*/";
+    for (int i = 0; i < count; i++) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "%d %c %d\n", rand() % 100, operators[rand() % 4], rand() % 100 + 1);
+        expressions.push_back(buffer);
+    }
+
+    int mismatches = 0;
+    for (size_t i = 0; i < expressions.size(); i++) {
+        char expected[256], response[256];
+        calculator_sscanf(expressions[i].c_str(), expected);
+        calculator(expressions[i].c_str(), response);
+        if (strcmp(expected, response) != 0) mismatches++;
+    }
+
+    double old_time = bench(calculator_sscanf, expressions, rounds);
+    double new_time = bench(calculator, expressions, rounds);
+    printf("%d expressions, best of %d rounds, %d different results\n", count, rounds, mismatches);
+    printf("%-8s %8.1f ns/expression\n", "sscanf", old_time / count * 1e9);
+    printf("%-8s %8.1f ns/expression\n", "calc.h", new_time / count * 1e9);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,291 @@
+// Expression evaluator of the calculator servers.
+//
+// Expression is split into tokens in a fixed array on the stack and
+// evaluated by precedence climbing: + - (lowest), * /, unary + -,
+// parentheses. Arithmetic is on 64-bit integers, every operation is checked
+// for overflow. Nothing is allocated, numbers are formatted two digits at a
+// time. Response repeats the expression in normalised form:
+//
+//   "2*(3+4)"  ->  "2 * (3 + 4) = 14\n"
+
+#ifndef CALC_H
+#define CALC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CALC_RESPONSE_SIZE 256
+#define CALC_MAX_TOKENS 256         // expression is a line of at most 255 chars
+#define CALC_MAX_DEPTH 64           // nested parentheses
+
+enum calc_token_type { CALC_NUMBER, CALC_OPERATOR, CALC_OPEN, CALC_CLOSE, CALC_END };
+
+struct calc_token {
+    calc_token_type type;
+    char op;                // operator
+    bool unary;             // operator with no left operand
+    uint64_t magnitude;     // number, sign comes from unary minus
+};
+
+enum calc_error {
+    CALC_OK,
+    CALC_SYNTAX,
+    CALC_RANGE,             // number doesn't fit 64 bits
+    CALC_OVERFLOW,
+    CALC_DIVISION_BY_ZERO,
+    CALC_TOO_LONG
+};
+
+inline const char *calc_error_message(calc_error error) {
+    switch (error) {
+        case CALC_SYNTAX:           return "Invalid expression format. Use numbers, + - * / and parentheses.\n";
+        case CALC_RANGE:            return "Error: Number out of 64-bit range.\n";
+        case CALC_OVERFLOW:         return "Error: Result out of 64-bit range.\n";
+        case CALC_DIVISION_BY_ZERO: return "Error: Division by zero.\n";
+        case CALC_TOO_LONG:         return "Error: Expression is too long.\n";
+        default:                    return "";
+    }
+}
+
+//***************************************************************************
+// number formatting
+
+static const char calc_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Writes decimal value, returns its length (at most 20)
+inline int calc_utoa(uint64_t value, char *dst) {
+    char digits[20];
+    int pos = sizeof(digits);
+    while (value >= 100) {
+        int pair = value % 100 * 2;
+        value /= 100;
+        digits[--pos] = calc_digit_pairs[pair + 1];
+        digits[--pos] = calc_digit_pairs[pair];
+    }
+    if (value >= 10) {
+        digits[--pos] = calc_digit_pairs[value * 2 + 1];
+        digits[--pos] = calc_digit_pairs[value * 2];
+    } else {
+        digits[--pos] = '0' + value;
+    }
+    memcpy(dst, digits + pos, sizeof(digits) - pos);
+    return sizeof(digits) - pos;
+}
+
+inline int calc_itoa(int64_t value, char *dst) {
+    if (value >= 0) return calc_utoa(value, dst);
+    *dst = '-';
+    return 1 + calc_utoa(0 - (uint64_t)value, dst + 1);
+}
+
+//***************************************************************************
+// tokenizer
+
+// Count of tokens is without the final CALC_END
+inline calc_error calc_tokenize(const char *expression, calc_token *tokens, int &count) {
+    count = 0;
+    const char *pos = expression;
+    while (1) {
+        while (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n') pos++;
+
+        calc_token &token = tokens[count];
+        if (*pos == '\0') {
+            token.type = CALC_END;
+            return CALC_OK;
+        }
+        if (count == CALC_MAX_TOKENS - 1) return CALC_TOO_LONG;
+
+        if (*pos >= '0' && *pos <= '9') {
+            uint64_t value = 0;
+            for (; *pos >= '0' && *pos <= '9'; pos++) {
+                if (__builtin_mul_overflow(value, 10, &value) ||
+                    __builtin_add_overflow(value, (uint64_t)(*pos - '0'), &value)) return CALC_RANGE;
+            }
+            token.type = CALC_NUMBER;
+            token.magnitude = value;
+        } else if (*pos == '+' || *pos == '-' || *pos == '*' || *pos == '/') {
+            // Operator is unary at the start, after another operator or '('
+            token.type = CALC_OPERATOR;
+            token.op = *pos++;
+            token.unary = count == 0 || tokens[count - 1].type == CALC_OPERATOR || tokens[count - 1].type == CALC_OPEN;
+            if (token.unary && token.op != '+' && token.op != '-') return CALC_SYNTAX;
+        } else if (*pos == '(') {
+            token.type = CALC_OPEN;
+            pos++;
+        } else if (*pos == ')') {
+            token.type = CALC_CLOSE;
+            pos++;
+        } else {
+            return CALC_SYNTAX;
+        }
+        count++;
+    }
+}
+
+//***************************************************************************
+// precedence climbing
+
+struct calc_parser {
+    const calc_token *tokens;
+    int pos;
+    int depth;
+    calc_error error;
+};
+
+inline int calc_precedence(char op) {
+    return op == '*' || op == '/' ? 2 : 1;
+}
+
+inline bool calc_apply(char op, int64_t a, int64_t b, int64_t &result, calc_error &error) {
+    bool overflow = false;
+    switch (op) {
+        case '+': overflow = __builtin_add_overflow(a, b, &result); break;
+        case '-': overflow = __builtin_sub_overflow(a, b, &result); break;
+        case '*': overflow = __builtin_mul_overflow(a, b, &result); break;
+        default:
+            if (b == 0) {
+                error = CALC_DIVISION_BY_ZERO;
+                return false;
+            }
+            overflow = a == INT64_MIN && b == -1;
+            if (!overflow) result = a / b;
+            break;
+    }
+    if (overflow) error = CALC_OVERFLOW;
+    return !overflow;
+}
+
+inline bool calc_expression(calc_parser &parser, int min_precedence, int64_t &value);
+
+inline bool calc_primary(calc_parser &parser, int64_t &value) {
+    const calc_token &token = parser.tokens[parser.pos];
+    if (token.type == CALC_NUMBER) {
+        if (token.magnitude > INT64_MAX) {
+            parser.error = CALC_RANGE;
+            return false;
+        }
+        value = token.magnitude;
+        parser.pos++;
+        return true;
+    }
+
+    if (token.type == CALC_OPERATOR && token.unary) {
+        parser.pos++;
+        const calc_token &next = parser.tokens[parser.pos];
+        // -9223372036854775808 is the only literal which needs the sign
+        if (token.op == '-' && next.type == CALC_NUMBER && next.magnitude == (uint64_t)INT64_MAX + 1) {
+            value = INT64_MIN;
+            parser.pos++;
+            return true;
+        }
+        if (!calc_primary(parser, value)) return false;
+        if (token.op == '-') {
+            if (value == INT64_MIN) {
+                parser.error = CALC_OVERFLOW;
+                return false;
+            }
+            value = -value;
+        }
+        return true;
+    }
+
+    if (token.type == CALC_OPEN) {
+        if (++parser.depth > CALC_MAX_DEPTH) {
+            parser.error = CALC_TOO_LONG;
+            return false;
+        }
+        parser.pos++;
+        if (!calc_expression(parser, 1, value)) return false;
+        if (parser.tokens[parser.pos].type != CALC_CLOSE) {
+            parser.error = CALC_SYNTAX;
+            return false;
+        }
+        parser.pos++;
+        parser.depth--;
+        return true;
+    }
+
+    parser.error = CALC_SYNTAX;
+    return false;
+}
+
+inline bool calc_expression(calc_parser &parser, int min_precedence, int64_t &value) {
+    if (!calc_primary(parser, value)) return false;
+    while (1) {
+        const calc_token &token = parser.tokens[parser.pos];
+        if (token.type != CALC_OPERATOR || calc_precedence(token.op) < min_precedence) return true;
+        parser.pos++;
+
+        // Left associative, right side binds only tighter operators
+        int64_t right;
+        if (!calc_expression(parser, calc_precedence(token.op) + 1, right)) return false;
+        if (!calc_apply(token.op, value, right, value, parser.error)) return false;
+    }
+}
+
+//***************************************************************************
+
+// Normalised expression: spaces around binary operators only
+inline int calc_render(const calc_token *tokens, int count, char *dst, int size) {
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        // Longest token with spaces is 22 characters
+        if (len + 24 > size) return -1;
+        const calc_token &token = tokens[i];
+        switch (token.type) {
+            case CALC_NUMBER: len += calc_utoa(token.magnitude, dst + len); break;
+            case CALC_OPEN:   dst[len++] = '('; break;
+            case CALC_CLOSE:  dst[len++] = ')'; break;
+            default:
+                if (token.unary) {
+                    dst[len++] = token.op;
+                } else {
+                    dst[len++] = ' ';
+                    dst[len++] = token.op;
+                    dst[len++] = ' ';
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+// Tokens stay in the caller's array for calc_render()
+inline calc_error calc_evaluate(const char *expression, calc_token *tokens, int &count, int64_t &value) {
+    calc_error error = calc_tokenize(expression, tokens, count);
+    if (error != CALC_OK) return error;
+
+    calc_parser parser = { tokens, 0, 0, CALC_OK };
+    if (!calc_expression(parser, 1, value)) return parser.error;
+    if (tokens[parser.pos].type != CALC_END) return CALC_SYNTAX;
+    return CALC_OK;
+}
+
+// Evaluates expression into "normalised = result\n" response of
+// CALC_RESPONSE_SIZE bytes, returns -1 with error message instead
+inline int calculator(const char *expression, char *response) {
+    calc_token tokens[CALC_MAX_TOKENS];
+    int count;
+    int64_t value;
+    calc_error error = calc_evaluate(expression, tokens, count, value);
+
+    // " = " with the longest result and "\n" takes 25 characters
+    int len = error == CALC_OK ? calc_render(tokens, count, response, CALC_RESPONSE_SIZE - 25) : 0;
+    if (len < 0) error = CALC_TOO_LONG;
+    if (error != CALC_OK) {
+        strcpy(response, calc_error_message(error));
+        return -1;
+    }
+
+    memcpy(response + len, " = ", 3);
+    len += 3;
+    len += calc_itoa(value, response + len);
+    response[len++] = '\n';
+    response[len] = '\0';
+    return 0;
+}
+
+#endif
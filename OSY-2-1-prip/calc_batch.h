@@ -0,0 +1,217 @@
+// Binary batch protocol of the calculator server.
+//
+// Connection whose first byte is CALC_BATCH_MAGIC talks in frames instead
+// of text lines (all numbers little-endian):
+//
+//   request   uint32 count, count x { int32 a, int32 b, uint8 op, 3 x pad }
+//   reply     uint32 count, uint32 errors, count x int64 result,
+//             count x uint8 status, zero padding to a multiple of 8
+//
+// Operator is one of + - * /, status is batch_status. Results are exact,
+// 32-bit operands can't overflow 64 bits. A batch is grouped by operator
+// (counting sort of the records) and every group is evaluated by one
+// kernel, AVX2 when the CPU has it.
+
+#ifndef CALC_BATCH_H
+#define CALC_BATCH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+#define CALC_BATCH_MAGIC 0xCA
+#define CALC_BATCH_MAX 65536        // records in one request
+#define BATCH_RECORD_SIZE 12
+#define BATCH_OPERATORS 5           // + - * / and the invalid ones
+
+enum batch_status { BATCH_OK, BATCH_DIVISION_BY_ZERO, BATCH_BAD_OPERATOR };
+
+struct batch_session {
+    std::vector<char> pending;      // unfinished request
+    std::vector<char> reply;        // replies not sent yet
+    std::vector<int32_t> a, b;      // operands grouped by operator
+    std::vector<uint32_t> index;    // original position of grouped record
+    std::vector<int64_t> results;
+    std::vector<uint8_t> status;
+};
+
+typedef void (*batch_kernel)(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *status, size_t n);
+
+//***************************************************************************
+// kernels, status of + - * is zeroed by the caller
+
+inline void batch_add_scalar(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)a[i] + b[i];
+}
+
+inline void batch_sub_scalar(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)a[i] - b[i];
+}
+
+inline void batch_mul_scalar(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = (int64_t)a[i] * b[i];
+}
+
+inline void batch_div_scalar(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *status, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        status[i] = b[i] == 0 ? BATCH_DIVISION_BY_ZERO : BATCH_OK;
+        out[i] = b[i] == 0 ? 0 : (int64_t)a[i] / b[i];
+    }
+}
+
+#ifdef BATCH_X86
+
+// Four 32-bit operands are widened into four 64-bit lanes
+#define BATCH_AVX2_KERNEL(name, expression, scalar)                                         \
+__attribute__((target("avx2")))                                                             \
+inline void name(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *status, size_t n) { \
+    size_t i = 0;                                                                           \
+    for (; i + 4 <= n; i += 4) {                                                            \
+        __m256i va = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(a + i)));      \
+        __m256i vb = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(b + i)));      \
+        _mm256_storeu_si256((__m256i *)(out + i), expression);                              \
+    }                                                                                       \
+    scalar(a + i, b + i, out + i, status + i, n - i);                                       \
+}
+
+BATCH_AVX2_KERNEL(batch_add_avx2, _mm256_add_epi64(va, vb), batch_add_scalar)
+BATCH_AVX2_KERNEL(batch_sub_avx2, _mm256_sub_epi64(va, vb), batch_sub_scalar)
+// Signed 32 x 32 -> 64 bit product of the low halves
+BATCH_AVX2_KERNEL(batch_mul_avx2, _mm256_mul_epi32(va, vb), batch_mul_scalar)
+
+// Quotient of 32-bit integers in double is exact enough to truncate. The
+// truncated double is turned into int64 by adding 2^52 + 2^51, then its
+// mantissa bits are the integer. Zero divisor lanes are masked out.
+__attribute__((target("avx2")))
+inline void batch_div_avx2(const int32_t *a, const int32_t *b, int64_t *out, uint8_t *status, size_t n) {
+    const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i zero_lanes = _mm_cmpeq_epi32(vb, zero);
+        vb = _mm_blendv_epi8(vb, one, zero_lanes);
+
+        __m256d quotient = _mm256_div_pd(_mm256_cvtepi32_pd(va), _mm256_cvtepi32_pd(vb));
+        quotient = _mm256_round_pd(quotient, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m256i result = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(quotient, magic)),
+                                          _mm256_castpd_si256(magic));
+        result = _mm256_andnot_si256(_mm256_cvtepi32_epi64(zero_lanes), result);
+        _mm256_storeu_si256((__m256i *)(out + i), result);
+
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(zero_lanes));
+        for (int k = 0; k < 4; k++) status[i + k] = (mask >> k) & 1 ? BATCH_DIVISION_BY_ZERO : BATCH_OK;
+    }
+    batch_div_scalar(a + i, b + i, out + i, status + i, n - i);
+}
+
+#endif
+
+inline int batch_operator(uint8_t op) {
+    switch (op) {
+        case '+': return 0;
+        case '-': return 1;
+        case '*': return 2;
+        case '/': return 3;
+        default:  return 4;
+    }
+}
+
+inline const batch_kernel *batch_kernels() {
+    static const batch_kernel scalar[4] = { batch_add_scalar, batch_sub_scalar, batch_mul_scalar, batch_div_scalar };
+#ifdef BATCH_X86
+    static const batch_kernel avx2[4] = { batch_add_avx2, batch_sub_avx2, batch_mul_avx2, batch_div_avx2 };
+    static const batch_kernel *selected = __builtin_cpu_supports("avx2") ? avx2 : scalar;
+    return selected;
+#else
+    return scalar;
+#endif
+}
+
+//***************************************************************************
+// frames
+
+// Evaluates one request and appends its reply to session.reply
+inline void batch_evaluate(batch_session &session, const char *records, uint32_t count) {
+    // Counting sort by operator
+    size_t start[BATCH_OPERATORS + 1] = { 0 };
+    for (uint32_t i = 0; i < count; i++) {
+        start[batch_operator(records[i * BATCH_RECORD_SIZE + 8]) + 1]++;
+    }
+    for (int op = 0; op < BATCH_OPERATORS; op++) start[op + 1] += start[op];
+
+    session.a.resize(count);
+    session.b.resize(count);
+    session.index.resize(count);
+    session.results.resize(count);
+    session.status.resize(count);
+
+    size_t fill[BATCH_OPERATORS];
+    memcpy(fill, start, sizeof(fill));
+    for (uint32_t i = 0; i < count; i++) {
+        const char *record = records + i * BATCH_RECORD_SIZE;
+        size_t pos = fill[batch_operator(record[8])]++;
+        memcpy(&session.a[pos], record, 4);
+        memcpy(&session.b[pos], record + 4, 4);
+        session.index[pos] = i;
+    }
+
+    const batch_kernel *kernels = batch_kernels();
+    memset(session.status.data(), BATCH_OK, count);
+    for (int op = 0; op < 4; op++) {
+        size_t n = start[op + 1] - start[op];
+        if (n) kernels[op](&session.a[start[op]], &session.b[start[op]], &session.results[start[op]], &session.status[start[op]], n);
+    }
+    for (size_t pos = start[4]; pos < count; pos++) {
+        session.results[pos] = 0;
+        session.status[pos] = BATCH_BAD_OPERATOR;
+    }
+
+    // Results go back in request order
+    size_t frame = session.reply.size();
+    size_t size = 8 + count * 9;
+    size_t padded = (size + 7) & ~(size_t)7;
+    session.reply.resize(frame + padded, 0);
+    char *reply = &session.reply[frame];
+    char *results = reply + 8;
+    char *status = results + (size_t)count * 8;
+
+    uint32_t errors = 0;
+    for (size_t pos = 0; pos < count; pos++) {
+        uint32_t i = session.index[pos];
+        memcpy(results + (size_t)i * 8, &session.results[pos], 8);
+        status[i] = session.status[pos];
+        errors += session.status[pos] != BATCH_OK;
+    }
+    memcpy(reply, &count, 4);
+    memcpy(reply + 4, &errors, 4);
+}
+
+// Takes received bytes (without the magic byte) and evaluates every
+// complete request. Returns -1 for a request over CALC_BATCH_MAX.
+inline int batch_feed(batch_session &session, const char *data, size_t len) {
+    session.pending.insert(session.pending.end(), data, data + len);
+
+    size_t pos = 0;
+    while (session.pending.size() - pos >= 4) {
+        uint32_t count;
+        memcpy(&count, &session.pending[pos], 4);
+        if (count > CALC_BATCH_MAX) return -1;
+
+        size_t size = 4 + (size_t)count * BATCH_RECORD_SIZE;
+        if (session.pending.size() - pos < size) break;
+        batch_evaluate(session, &session.pending[pos + 4], count);
+        pos += size;
+    }
+    session.pending.erase(session.pending.begin(), session.pending.begin() + pos);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,238 @@
+// Result cache of the calculator servers.
+//
+// Key is the expression without white space, value the whole response of
+// calculator(). Table has a fixed size given at start (memory bound) and
+// lives in a shared anonymous mapping, so forked children and threads
+// all share it. It is split into CACHE_SHARDS shards by the top bits of
+// the hash, every shard is an array of sets of CACHE_WAYS slots and its
+// own counters; a full set evicts its slots in turn.
+//
+// Every slot is guarded by a sequence number (seqlock). Readers never lock
+// nor write the slot, a slot changed while it was copied is just a miss.
+// Writer takes the slot by moving the sequence to odd with CAS and skips
+// the insert when another writer has it.
+
+#ifndef CALC_CACHE_H
+#define CALC_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <atomic>
+#include "calc.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_WAYS 4
+#define CACHE_SLOT_SIZE 128
+#define CACHE_DATA_SIZE (CACHE_SLOT_SIZE - 12)
+#define CACHE_KEY_MAX 64
+
+struct cache_slot {
+    std::atomic<uint32_t> seq;      // odd while the slot is written
+    uint32_t hash;                  // 0 = empty slot
+    uint8_t key_len;
+    uint8_t response_len;
+    char data[CACHE_DATA_SIZE];     // key followed by response
+} __attribute__((aligned(CACHE_SLOT_SIZE)));
+
+// Counters of a shard have their own cache line
+struct cache_counters {
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> inserts;
+    std::atomic<uint64_t> evictions;
+} __attribute__((aligned(64)));
+
+struct calc_cache {
+    cache_slot *slots;              // NULL = cache is off
+    cache_counters *counters;
+    size_t sets;                    // per shard, power of two
+    size_t size;                    // of the mapping
+};
+
+inline calc_cache &g_cache() {
+    static calc_cache cache = { NULL, NULL, 0, 0 };
+    return cache;
+}
+
+// Maps cache of at most bytes, before fork() so that children share it
+inline int cache_init(size_t bytes) {
+    calc_cache &cache = g_cache();
+    size_t set_size = CACHE_SLOT_SIZE * CACHE_WAYS;
+    cache.sets = 1;
+    while (cache.sets * 2 * set_size * CACHE_SHARDS <= bytes) cache.sets *= 2;
+
+    size_t slots_size = cache.sets * CACHE_SHARDS * set_size;
+    cache.size = slots_size + CACHE_SHARDS * sizeof(cache_counters);
+    void *data = mmap(NULL, cache.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) return -1;
+
+    // Zero filled mapping is an empty table with zero counters
+    cache.slots = (cache_slot *)data;
+    cache.counters = (cache_counters *)((char *)data + slots_size);
+    return 0;
+}
+
+inline bool cache_enabled() {
+    return g_cache().slots != NULL;
+}
+
+// Size with K/M/G suffix, 0 when invalid
+inline size_t cache_parse_size(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    if (*end == 'K' || *end == 'k') size <<= 10;
+    else if (*end == 'M' || *end == 'm') size <<= 20;
+    else if (*end == 'G' || *end == 'g') size <<= 30;
+    else if (*end) return 0;
+    return size;
+}
+
+// Expression without white space, returns -1 when it is too long to cache.
+// "1 2" is not "12", space between digits is not cached either.
+inline int cache_key(const char *expression, char *key) {
+    int len = 0;
+    bool space = false;
+    for (const char *pos = expression; *pos; pos++) {
+        if (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n') {
+            space = true;
+            continue;
+        }
+        if (len == CACHE_KEY_MAX) return -1;
+        bool digit = *pos >= '0' && *pos <= '9';
+        if (space && digit && len > 0 && key[len - 1] >= '0' && key[len - 1] <= '9') return -1;
+        space = false;
+        key[len++] = *pos;
+    }
+    return len;
+}
+
+inline uint32_t cache_hash(const char *key, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    return hash ? hash : 1;
+}
+
+inline cache_slot *cache_set(uint32_t hash, int &shard) {
+    calc_cache &cache = g_cache();
+    shard = hash >> 28;
+    size_t set = (hash * 0x9E3779B1u >> 4) & (cache.sets - 1);
+    return cache.slots + ((size_t)shard * cache.sets + set) * CACHE_WAYS;
+}
+
+// Copies cached response, false on miss
+inline bool cache_lookup(const char *key, int len, uint32_t hash, char *response) {
+    int shard;
+    cache_slot *set = cache_set(hash, shard);
+    for (int way = 0; way < CACHE_WAYS; way++) {
+        cache_slot &slot = set[way];
+        uint32_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq & 1 || slot.hash != hash || slot.key_len != len) continue;
+
+        char data[CACHE_DATA_SIZE];
+        int response_len = slot.response_len;
+        if (len + response_len > CACHE_DATA_SIZE) continue;
+        memcpy(data, slot.data, len + response_len);
+
+        // Slot rewritten while it was copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+        if (memcmp(data, key, len) != 0) continue;
+
+        memcpy(response, data + len, response_len);
+        response[response_len] = '\0';
+        g_cache().counters[shard].hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    g_cache().counters[shard].misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+inline void cache_insert(const char *key, int len, uint32_t hash, const char *response) {
+    int response_len = strlen(response);
+    if (len + response_len > CACHE_DATA_SIZE) return;
+
+    int shard;
+    cache_slot *set = cache_set(hash, shard);
+    cache_counters &counters = g_cache().counters[shard];
+
+    // Empty slot first, otherwise the ways are evicted in turn
+    int victim = -1;
+    for (int way = 0; way < CACHE_WAYS && victim == -1; way++) {
+        if (set[way].hash == 0) victim = way;
+    }
+    bool evict = victim == -1;
+    if (evict) victim = counters.inserts.load(std::memory_order_relaxed) % CACHE_WAYS;
+
+    cache_slot &slot = set[victim];
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    if (seq & 1 || !slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.hash = hash;
+    slot.key_len = len;
+    slot.response_len = response_len;
+    memcpy(slot.data, key, len);
+    memcpy(slot.data + len, response, response_len);
+    slot.seq.store(seq + 2, std::memory_order_release);
+
+    counters.inserts.fetch_add(1, std::memory_order_relaxed);
+    if (evict) counters.evictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+// calculator() through the cache, only successful results are cached
+inline int cached_calculator(const char *expression, char *response) {
+    if (!cache_enabled()) return calculator(expression, response);
+
+    char key[CACHE_KEY_MAX];
+    int len = cache_key(expression, key);
+    if (len < 0) return calculator(expression, response);
+
+    uint32_t hash = cache_hash(key, len);
+    if (cache_lookup(key, len, hash, response)) return 0;
+    if (calculator(expression, response) != 0) return -1;
+    cache_insert(key, len, hash, response);
+    return 0;
+}
+
+// Puts "a op b" for all a, b in [low, high] and all operators into cache,
+// returns number of cached expressions
+inline size_t cache_prefill(int low, int high) {
+    const char operators[] = "+-*/";
+    size_t count = 0;
+    for (int a = low; a <= high; a++) {
+        for (int b = low; b <= high; b++) {
+            for (int op = 0; op < 4; op++) {
+                char expression[64], response[CALC_RESPONSE_SIZE];
+                int len = calc_itoa(a, expression);
+                expression[len++] = operators[op];
+                len += calc_itoa(b, expression + len);
+                expression[len] = '\0';
+                if (calculator(expression, response) != 0) continue;
+                cache_insert(expression, len, cache_hash(expression, len), response);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+// "cache hits H misses M inserts I evictions E\n"
+inline void cache_stats(char *response, size_t size) {
+    uint64_t hits = 0, misses = 0, inserts = 0, evictions = 0;
+    for (int i = 0; cache_enabled() && i < CACHE_SHARDS; i++) {
+        cache_counters &counters = g_cache().counters[i];
+        hits += counters.hits.load(std::memory_order_relaxed);
+        misses += counters.misses.load(std::memory_order_relaxed);
+        inserts += counters.inserts.load(std::memory_order_relaxed);
+        evictions += counters.evictions.load(std::memory_order_relaxed);
+    }
+    snprintf(response, size, "cache hits %llu misses %llu inserts %llu evictions %llu\n",
+             (unsigned long long)hits, (unsigned long long)misses,
+             (unsigned long long)inserts, (unsigned long long)evictions);
+}
+
+#endif
@@ -0,0 +1,443 @@
+// Event loop engine for the calculator servers.
+//
+// One thread per core runs its own edge-triggered epoll loop with its own
+// SO_REUSEPORT listener, so loops share nothing and the kernel spreads new
+// connections among them. Sockets are non-blocking. State of a connection
+// is one small slab entry of its loop (no stack, no process), output buffer
+// and the buffer of an unfinished line are allocated only while needed.
+// Lines of one read are answered by one writev() (framing.h). With
+// binary_batches a connection starting with CALC_BATCH_MAGIC gets binary
+// frames of calc_batch.h instead.
+//
+// Engine logs through log_msg() of the server, LOG_* levels have to be
+// defined before this header is included.
+
+#ifndef EPOLL_ENGINE_H
+#define EPOLL_ENGINE_H
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <thread>
+#include "framing.h"
+#include "calc_batch.h"
+
+#define ENGINE_MAX_EVENTS 256
+#define ENGINE_MAX_PENDING (1 << 20)    // slower reader is disconnected
+#define ENGINE_LISTENER_ID 0            // epoll data of listener, connections are id + 1
+
+void log_msg(int log_level, const char *format, ...);
+
+struct engine_conn {
+    int fd;                 // -1 = free entry
+    int next_free;          // free list of the slab
+    bool started;           // first byte seen, mode is decided
+    bool closing;           // closed once out is sent, nothing more is read
+    line_buffer *in;        // unfinished line, NULL when none
+    batch_session *binary;  // binary mode, NULL for text
+    char *out;              // unsent output, NULL when empty
+    uint32_t out_len;
+    uint32_t out_cap;
+};
+
+struct engine_loop;
+
+// Line handler puts its reply into loop.batch (one free slot is
+// guaranteed) and returns -1 when the connection should be closed. Length
+// -1 means too long line. Replies go back to the client unless on_replies
+// is set, then it gets them instead.
+struct engine_callbacks {
+    int (*on_message)(engine_loop &loop, int conn_id, char *line, int len);
+    int (*on_replies)(engine_loop &loop, int conn_id, struct iovec *iov, int count);   // may be NULL
+    void (*on_open)(int fd);        // may be NULL
+    void (*on_close)(int fd);       // may be NULL
+    bool binary_batches;            // accept calc_batch.h frames
+};
+
+struct engine_loop {
+    int id;
+    int epoll_fd;
+    int listening_socket;
+    std::vector<engine_conn> slab;
+    int free_head;
+    engine_callbacks callbacks;
+    reply_batch batch;
+};
+
+//***************************************************************************
+// slab
+
+inline int engine_alloc(engine_loop &loop, int fd) {
+    int id = loop.free_head;
+    if (id == -1) {
+        engine_conn conn;
+        memset(&conn, 0, sizeof(conn));
+        loop.slab.push_back(conn);
+        id = loop.slab.size() - 1;
+    } else {
+        loop.free_head = loop.slab[id].next_free;
+    }
+    engine_conn &conn = loop.slab[id];
+    conn.fd = fd;
+    conn.next_free = -1;
+    conn.started = false;
+    conn.closing = false;
+    conn.in = NULL;
+    conn.binary = NULL;
+    conn.out = NULL;
+    conn.out_len = conn.out_cap = 0;
+    return id;
+}
+
+inline void engine_close(engine_loop &loop, int conn_id) {
+    engine_conn &conn = loop.slab[conn_id];
+    if (conn.fd == -1) return;
+    if (loop.callbacks.on_close) loop.callbacks.on_close(conn.fd);
+    log_msg(LOG_DEBUG, "Loop %d: client %d closed.", loop.id, conn.fd);
+
+    close(conn.fd);     // removes it from epoll too
+    free(conn.in);
+    free(conn.out);
+    delete conn.binary;
+    conn.fd = -1;
+    conn.in = NULL;
+    conn.binary = NULL;
+    conn.out = NULL;
+    conn.out_len = conn.out_cap = 0;
+    conn.next_free = loop.free_head;
+    loop.free_head = conn_id;
+}
+
+//***************************************************************************
+// output
+
+inline int engine_queue(engine_conn &conn, const char *data, size_t len) {
+    if (conn.out_len + len > ENGINE_MAX_PENDING) {
+        log_msg(LOG_ERROR, "Client %d doesn't read its replies.", conn.fd);
+        return -1;
+    }
+    if (conn.out_len + len > conn.out_cap) {
+        uint32_t cap = conn.out_cap ? conn.out_cap : 1024;
+        while (cap < conn.out_len + len) cap *= 2;
+        char *out = (char *)realloc(conn.out, cap);
+        if (!out) return -1;
+        conn.out = out;
+        conn.out_cap = cap;
+    }
+    memcpy(conn.out + conn.out_len, data, len);
+    conn.out_len += len;
+    return 0;
+}
+
+// Sends or queues buffers, returns -1 when the connection is broken
+inline int engine_sendv(engine_loop &loop, int conn_id, struct iovec *iov, int count) {
+    engine_conn &conn = loop.slab[conn_id];
+    // Order of replies must stay, so nothing goes before the queue
+    while (count > 0 && !conn.out_len) {
+        ssize_t n = writev(conn.fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (engine_queue(conn, (const char *)iov[i].iov_base, iov[i].iov_len) != 0) return -1;
+    }
+    return 0;
+}
+
+inline int engine_send_replies(engine_loop &loop, int conn_id) {
+    int count = loop.batch.count;
+    loop.batch.count = 0;
+    if (count == 0) return 0;
+    if (loop.callbacks.on_replies) return loop.callbacks.on_replies(loop, conn_id, loop.batch.iov, count);
+    return engine_sendv(loop, conn_id, loop.batch.iov, count);
+}
+
+// Socket became writable again
+inline int engine_flush(engine_conn &conn) {
+    size_t done = 0;
+    while (done < conn.out_len) {
+        ssize_t n = write(conn.fd, conn.out + done, conn.out_len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        done += n;
+    }
+    memmove(conn.out, conn.out + done, conn.out_len - done);
+    conn.out_len -= done;
+    if (conn.out_len == 0) {
+        free(conn.out);
+        conn.out = NULL;
+        conn.out_cap = 0;
+    }
+    return 0;
+}
+
+// Client sent EOF or "close": replies still queued go out first, the rest
+// waits for EPOLLOUT, then the connection is closed
+inline void engine_finish(engine_loop &loop, int conn_id) {
+    engine_conn &conn = loop.slab[conn_id];
+    conn.closing = true;
+    if (conn.out_len && engine_flush(conn) == 0 && conn.out_len) return;
+    engine_close(loop, conn_id);
+}
+
+//***************************************************************************
+// loop
+
+inline int engine_listener(int server_port) {
+    int listening_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listening_socket == -1) {
+        log_msg(LOG_ERROR, "Socket creation failed.");
+        return -1;
+    }
+
+    int reuse_option = 1;
+    setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &reuse_option, sizeof(reuse_option));
+    setsockopt(listening_socket, SOL_SOCKET, SO_REUSEPORT, &reuse_option, sizeof(reuse_option));
+
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(server_port);
+    server_address.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(listening_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0 ||
+        listen(listening_socket, SOMAXCONN) < 0) {
+        log_msg(LOG_ERROR, "Bind or listen failed.");
+        close(listening_socket);
+        return -1;
+    }
+    return listening_socket;
+}
+
+inline void engine_accept(engine_loop &loop) {
+    while (1) {
+        struct sockaddr_in client_address;
+        socklen_t client_len = sizeof(client_address);
+        int client_socket = accept4(loop.listening_socket, (struct sockaddr *)&client_address, &client_len, SOCK_NONBLOCK);
+        if (client_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_msg(LOG_ERROR, "Accept failed.");
+            return;
+        }
+
+        int conn_id = engine_alloc(loop, client_socket);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.u64 = conn_id + 1;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            log_msg(LOG_ERROR, "epoll_ctl failed.");
+            engine_close(loop, conn_id);
+            continue;
+        }
+        if (loop.callbacks.on_open) loop.callbacks.on_open(client_socket);
+
+        log_msg(LOG_DEBUG, "Loop %d: connected %s:%d", loop.id,
+                inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+    }
+}
+
+struct engine_lines {
+    engine_loop *loop;
+    int conn_id;
+
+    int operator()(char *line, int len) {
+        if (reply_full(loop->batch) && engine_send_replies(*loop, conn_id) != 0) return -1;
+        return loop->callbacks.on_message(*loop, conn_id, line, len);
+    }
+};
+
+inline int engine_batches(engine_loop &loop, int conn_id, const char *data, int length) {
+    batch_session &session = *loop.slab[conn_id].binary;
+    if (batch_feed(session, data, length) != 0) {
+        log_msg(LOG_ERROR, "Client %d sent too large batch.", loop.slab[conn_id].fd);
+        return -1;
+    }
+    if (session.reply.empty()) return 0;
+
+    struct iovec iov = { &session.reply[0], session.reply.size() };
+    int result = engine_sendv(loop, conn_id, &iov, 1);
+    session.reply.clear();
+    return result;
+}
+
+// Edge triggered, so the socket is read until it is empty
+inline void engine_read(engine_loop &loop, int conn_id) {
+    char buffer[READ_CHUNK];
+    engine_lines handler = { &loop, conn_id };
+    while (loop.slab[conn_id].fd != -1) {
+        engine_conn &conn = loop.slab[conn_id];
+        ssize_t length = read(conn.fd, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) engine_close(loop, conn_id);
+            return;
+        }
+        if (length == 0) {
+            engine_finish(loop, conn_id);
+            return;
+        }
+
+        char *data = buffer;
+        if (!conn.started) {
+            conn.started = true;
+            if (loop.callbacks.binary_batches && (unsigned char)buffer[0] == CALC_BATCH_MAGIC) {
+                conn.binary = new batch_session;
+                data++;
+                length--;
+            }
+        }
+        if (conn.binary) {
+            if (engine_batches(loop, conn_id, data, length) != 0) {
+                engine_close(loop, conn_id);
+                return;
+            }
+            continue;
+        }
+
+        // Idle connection keeps no line buffer
+        line_buffer local;
+        line_init(local);
+        line_buffer &pending = conn.in ? *conn.in : local;
+        int result = frame_lines(pending, data, length, handler);
+        if (engine_send_replies(loop, conn_id) != 0) {
+            engine_close(loop, conn_id);
+            return;
+        }
+        if (result != 0) {
+            engine_finish(loop, conn_id);
+            return;
+        }
+
+        if (!conn.in && (local.used || local.overflow)) {
+            conn.in = (line_buffer *)malloc(sizeof(line_buffer));
+            if (!conn.in) {
+                engine_close(loop, conn_id);
+                return;
+            }
+            *conn.in = local;
+        } else if (conn.in && !conn.in->used && !conn.in->overflow) {
+            free(conn.in);
+            conn.in = NULL;
+        }
+    }
+}
+
+inline void engine_loop_run(engine_loop &loop) {
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    while (1) {
+        int count = epoll_wait(loop.epoll_fd, events, ENGINE_MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            log_msg(LOG_ERROR, "epoll_wait failed.");
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == ENGINE_LISTENER_ID) {
+                engine_accept(loop);
+                continue;
+            }
+
+            int conn_id = events[i].data.u64 - 1;
+            if (loop.slab[conn_id].fd == -1) continue;
+
+            engine_conn &conn = loop.slab[conn_id];
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR) && conn.out_len) {
+                if (engine_flush(conn) != 0) {
+                    engine_close(loop, conn_id);
+                    continue;
+                }
+            }
+            if (conn.closing) {
+                if (!conn.out_len) engine_close(loop, conn_id);
+                continue;
+            }
+            // Data before hang up is still answered
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) engine_read(loop, conn_id);
+        }
+    }
+}
+
+inline void engine_thread(engine_loop *loop) {
+    // Loop i stays on core i, its slab stays in that core's cache
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->id % cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    engine_loop_run(*loop);
+}
+
+// Enough descriptors for 100k connections if the hard limit allows it
+inline void engine_raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        log_msg(LOG_DEBUG, "Descriptor limit %llu.", (unsigned long long)limit.rlim_cur);
+    }
+}
+
+// Runs loop_count loops (0 = one per core), returns only on error
+inline int engine_run(int server_port, int loop_count, const engine_callbacks &callbacks) {
+    if (loop_count <= 0) loop_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (loop_count <= 0) loop_count = 1;
+    engine_raise_fd_limit();
+
+    std::vector<engine_loop> loops(loop_count);
+    for (int i = 0; i < loop_count; i++) {
+        engine_loop &loop = loops[i];
+        loop.id = i;
+        loop.free_head = -1;
+        loop.callbacks = callbacks;
+        loop.batch.count = 0;
+        loop.listening_socket = engine_listener(server_port);
+        loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop.listening_socket == -1 || loop.epoll_fd == -1) return -1;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = ENGINE_LISTENER_ID;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.listening_socket, &event) == -1) {
+            log_msg(LOG_ERROR, "epoll_ctl failed.");
+            return -1;
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < loop_count; i++) threads.push_back(std::thread(engine_thread, &loops[i]));
+    engine_thread(&loops[0]);
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+    return -1;
+}
+
+#endif
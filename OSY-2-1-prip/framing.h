@@ -0,0 +1,120 @@
+// Line framing and batched replies for the calculator servers.
+//
+// Clients may pipeline expressions, one read() can bring several lines and
+// a line can be split among reads. Complete lines of a read are handled
+// one after another, the unfinished tail waits in line_buffer for the next
+// read. Replies are collected in reply_batch and sent by one writev().
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#define LINE_MAX_LEN 255        // longer line is answered with an error
+#define READ_CHUNK 16384        // bytes taken by one read()
+#define REPLY_BATCH 64          // replies sent by one writev()
+#define REPLY_SIZE 256
+
+// Unfinished line carried over between reads
+struct line_buffer {
+    char data[LINE_MAX_LEN + 1];
+    int used;
+    bool overflow;              // line is too long, rest is skipped up to '\n'
+};
+
+inline void line_init(line_buffer &buffer) {
+    buffer.used = 0;
+    buffer.overflow = false;
+}
+
+// Calls handler(line, length) for every complete line of data, line is
+// without '\n' and terminated by '\0', length -1 means too long line.
+// Stops when handler returns non-zero and returns that value.
+template <class Handler>
+int frame_lines(line_buffer &buffer, char *data, int length, Handler &handler) {
+    char *pos = data;
+    char *end = data + length;
+    while (pos < end) {
+        char *nl = (char *)memchr(pos, '\n', end - pos);
+        int part = (nl ? nl : end) - pos;
+
+        if (buffer.overflow || buffer.used + part > LINE_MAX_LEN) {
+            buffer.overflow = true;
+            buffer.used = 0;
+        } else if (!nl || buffer.used) {
+            memcpy(buffer.data + buffer.used, pos, part);
+            buffer.used += part;
+        }
+        if (!nl) break;
+
+        int result;
+        if (buffer.overflow) {
+            result = handler((char *)NULL, -1);
+        } else if (buffer.used) {
+            buffer.data[buffer.used] = '\0';
+            result = handler(buffer.data, buffer.used);
+        } else {
+            *nl = '\0';         // line is handled right in the read buffer
+            result = handler(pos, part);
+        }
+        line_init(buffer);
+        if (result != 0) return result;
+        pos = nl + 1;
+    }
+    return 0;
+}
+
+//***************************************************************************
+
+struct reply_batch {
+    struct iovec iov[REPLY_BATCH];
+    char text[REPLY_BATCH][REPLY_SIZE];
+    int count;
+};
+
+// Space for the next reply, caller sends the batch when it is full
+inline char *reply_slot(reply_batch &batch) {
+    return batch.text[batch.count];
+}
+
+inline void reply_commit(reply_batch &batch) {
+    batch.iov[batch.count].iov_base = batch.text[batch.count];
+    batch.iov[batch.count].iov_len = strlen(batch.text[batch.count]);
+    batch.count++;
+}
+
+inline bool reply_full(const reply_batch &batch) {
+    return batch.count == REPLY_BATCH;
+}
+
+// Writes all buffers, iov is modified. Blocking socket is expected.
+inline int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+inline int reply_send(reply_batch &batch, int fd) {
+    int count = batch.count;
+    batch.count = 0;
+    return writev_all(fd, batch.iov, count);
+}
+
+#endif
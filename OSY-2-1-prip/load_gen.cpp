@@ -0,0 +1,691 @@
+// Load generator for the servers of this repository.
+//
+// Opens many non-blocking connections from one epoll loop and drives
+// three kinds of traffic, each against its own port:
+//
+//   calc  calculator servers, "id op k\n" pipelined on a persistent
+//         connection, done when the line starting with the same
+//         expression comes back (broadcasting server sends replies of
+//         other clients too, those are skipped), any other line is an
+//         error reply to the oldest request
+//   img   image server, new connection per "#img season\n", done at EOF
+//   chat  chat server, "load conn id\n" sent after the nick is accepted,
+//         done when another connection of the generator receives it
+//
+// Closed loop (no -r): every connection has one request outstanding and
+// sends the next one when it is done. Open loop (-r rate): requests are
+// scheduled at a fixed rate regardless of answers and their latency is
+// measured from the scheduled time, so a stalled server is not hidden
+// (coordinated omission).
+//
+// Latencies go into log-linear histograms (HDR style, 128 sub-buckets per
+// power of two, < 1 % error) and are printed as text, CSV or JSON.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define DEFAULT_CONNECTIONS 100
+#define DEFAULT_DURATION 10
+#define READ_SIZE 65536
+#define MAX_EVENTS 256
+#define CONNECT_TIMEOUT_MS 5000
+
+//***************************************************************************
+// log messages
+
+#define LOG_ERROR 0       // errors
+#define LOG_INFO  1       // information and notifications
+#define LOG_DEBUG 2       // debug messages
+
+int g_debug = LOG_INFO;
+
+void log_msg(int log_level, const char *format, ...) {
+    const char *out_fmt[] = {
+        "ERR: %s\n",
+        "INF: %s\n",
+        "DEB: %s\n"
+    };
+
+    if (log_level > g_debug) return;
+
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    fprintf(stderr, out_fmt[log_level], buffer);
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//***************************************************************************
+// histogram
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * (HIST_SUB / 2) + HIST_SUB)
+
+struct histogram {
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t min, max;
+    double sum;
+};
+
+void hist_init(histogram &hist) {
+    hist.counts.assign(HIST_SIZE, 0);
+    hist.total = 0;
+    hist.min = UINT64_MAX;
+    hist.max = 0;
+    hist.sum = 0;
+}
+
+// Values below HIST_SUB are exact, above them the top 7 bits are kept
+size_t hist_index(uint64_t value) {
+    if (value < HIST_SUB) return value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+    return (size_t)shift * (HIST_SUB / 2) + (value >> shift);
+}
+
+// Highest value of the bucket
+uint64_t hist_value(size_t index) {
+    if (index < HIST_SUB) return index;
+    int shift = index / (HIST_SUB / 2) - 1;
+    uint64_t top = index - (size_t)shift * (HIST_SUB / 2);
+    return ((top + 1) << shift) - 1;
+}
+
+void hist_record(histogram &hist, uint64_t value) {
+    hist.counts[hist_index(value)]++;
+    hist.total++;
+    hist.sum += value;
+    if (value < hist.min) hist.min = value;
+    if (value > hist.max) hist.max = value;
+}
+
+void hist_merge(histogram &into, const histogram &from) {
+    for (size_t i = 0; i < HIST_SIZE; i++) into.counts[i] += from.counts[i];
+    into.total += from.total;
+    into.sum += from.sum;
+    if (from.min < into.min) into.min = from.min;
+    if (from.max > into.max) into.max = from.max;
+}
+
+uint64_t hist_percentile(const histogram &hist, double percentile) {
+    if (hist.total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist.total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_SIZE; i++) {
+        seen += hist.counts[i];
+        if (seen >= rank) return hist_value(i) < hist.max ? hist_value(i) : hist.max;
+    }
+    return hist.max;
+}
+
+//***************************************************************************
+// connections
+
+enum load_kind { LOAD_CALC, LOAD_IMG, LOAD_CHAT, LOAD_KINDS };
+const char *kind_names[LOAD_KINDS] = { "calc", "img", "chat" };
+
+struct load_request {
+    uint64_t start;         // sent or scheduled, ns
+    uint64_t id;
+};
+
+struct load_conn {
+    int fd;                 // -1 = not connected
+    load_kind kind;
+    int index;              // in g_conns
+    bool connected;
+    bool ready;             // takes requests (chat: nick accepted)
+    bool writable;
+    std::string out;        // not sent yet
+    std::string in;         // unfinished line
+    std::deque<load_request> outstanding;
+    std::deque<uint64_t> waiting;       // img: scheduled, not started yet
+};
+
+struct load_stats {
+    histogram latency;
+    uint64_t errors;
+    uint64_t sent;
+};
+
+std::vector<load_conn> g_conns;
+std::vector<int> g_kind_conns[LOAD_KINDS];
+size_t g_kind_next[LOAD_KINDS];
+load_stats g_stats[LOAD_KINDS];
+sockaddr_in g_address[LOAD_KINDS];
+int g_epoll_fd;
+uint64_t g_next_id = 1;
+bool g_open_loop = false;
+bool g_recording = true;
+uint64_t g_failed = 0;      // connections failed or lost
+
+// Calculator expression is derived from the id, no text is kept. It is
+// already in the normalised form, so the reply starts with it.
+int calc_expression(uint64_t id, char *buffer, size_t size) {
+    const char operators[] = "+-*/";
+    return snprintf(buffer, size, "%llu %c %llu", (unsigned long long)id, operators[id % 4],
+                    (unsigned long long)(id % 97 + 1));
+}
+
+void conn_flush(load_conn &conn) {
+    while (conn.writable && !conn.out.empty()) {
+        ssize_t sent = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) conn.writable = false;
+            else if (errno != EINTR) return;
+            continue;
+        }
+        conn.out.erase(0, sent);
+    }
+}
+
+int conn_open(load_conn &conn) {
+    conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd < 0) return -1;
+    int nodelay = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    conn.connected = false;
+    conn.ready = false;
+    conn.writable = false;
+    conn.out.clear();
+    conn.in.clear();
+    if (connect(conn.fd, (sockaddr *)&g_address[conn.kind], sizeof(sockaddr_in)) < 0 && errno != EINPROGRESS) {
+        close(conn.fd);
+        conn.fd = -1;
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u32 = conn.index;
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, conn.fd, &event);
+    return 0;
+}
+
+void conn_close(load_conn &conn) {
+    if (conn.fd >= 0) close(conn.fd);
+    conn.fd = -1;
+    conn.ready = false;
+}
+
+void send_calc(load_conn &conn, uint64_t start) {
+    load_request request = { start, g_next_id++ };
+    char buffer[64];
+    int len = calc_expression(request.id, buffer, sizeof(buffer));
+    buffer[len++] = '\n';
+    conn.out.append(buffer, len);
+    conn.outstanding.push_back(request);
+    g_stats[LOAD_CALC].sent++;
+    conn_flush(conn);
+}
+
+void send_chat(load_conn &conn, uint64_t start) {
+    load_request request = { start, g_next_id++ };
+    char buffer[64];
+    int len = snprintf(buffer, sizeof(buffer), "load %d %llu\n", conn.index, (unsigned long long)request.id);
+    conn.out.append(buffer, len);
+    conn.outstanding.push_back(request);
+    g_stats[LOAD_CHAT].sent++;
+    conn_flush(conn);
+}
+
+// Image request needs its own connection
+void start_img(load_conn &conn, uint64_t start) {
+    const char *seasons[] = { "jaro", "leto", "podzim", "zima" };
+    if (conn_open(conn) != 0) {
+        if (g_recording) g_stats[LOAD_IMG].errors++;
+        return;
+    }
+    load_request request = { start, g_next_id++ };
+    conn.out = std::string("#img ") + seasons[request.id % 4] + "\n";
+    conn.outstanding.push_back(request);
+    g_stats[LOAD_IMG].sent++;
+}
+
+void send_next(load_conn &conn, uint64_t start) {
+    switch (conn.kind) {
+        case LOAD_CALC: send_calc(conn, start); break;
+        case LOAD_CHAT: send_chat(conn, start); break;
+        case LOAD_IMG:
+            if (conn.fd < 0) start_img(conn, start);
+            else conn.waiting.push_back(start);
+            break;
+        default: break;
+    }
+}
+
+void record(load_kind kind, uint64_t start) {
+    if (!g_recording) return;
+    uint64_t now = now_ns();
+    hist_record(g_stats[kind].latency, now > start ? now - start : 0);
+}
+
+//***************************************************************************
+// replies
+
+// Result of another expression is a broadcast reply of another client and
+// is skipped. Any other line (server error text too) answers the oldest
+// request.
+void calc_line(load_conn &conn, const char *line, size_t len) {
+    if (conn.outstanding.empty()) return;
+    char expected[64];
+    int expected_len = calc_expression(conn.outstanding.front().id, expected, sizeof(expected));
+    bool answer = len >= (size_t)expected_len + 3 && memcmp(line, expected, expected_len) == 0 &&
+                  memcmp(line + expected_len, " = ", 3) == 0;
+
+    if (answer) {
+        record(LOAD_CALC, conn.outstanding.front().start);
+    } else {
+        std::string text(line, len);
+        unsigned long long a, b;
+        char op;
+        int used = 0;
+        if (sscanf(text.c_str(), "%llu %c %llu = %n", &a, &op, &b, &used) == 3 && used > 0) return;
+        if (g_recording) g_stats[LOAD_CALC].errors++;
+    }
+    conn.outstanding.pop_front();
+    if (!g_open_loop) send_calc(conn, now_ns());
+}
+
+void chat_line(load_conn &conn, const char *line, size_t len) {
+    std::string text(line, len);
+    if (!conn.ready) {
+        // Own join message, the nick is taken
+        char nick[32];
+        snprintf(nick, sizeof(nick), "load%d:", conn.index);
+        if (text.compare(0, strlen(nick), nick) == 0 && text.find("has joined") != std::string::npos) {
+            conn.ready = true;
+            if (!g_open_loop) send_chat(conn, now_ns());
+        }
+        return;
+    }
+
+    size_t pos = text.find("load ");
+    unsigned sender;
+    unsigned long long id;
+    if (pos == std::string::npos || sscanf(text.c_str() + pos, "load %u %llu", &sender, &id) != 2) return;
+    if (sender >= g_conns.size() || g_conns[sender].kind != LOAD_CHAT) return;
+
+    // First delivery to another connection completes the message
+    load_conn &origin = g_conns[sender];
+    while (!origin.outstanding.empty() && origin.outstanding.front().id < id) {
+        origin.outstanding.pop_front();
+        if (g_recording) g_stats[LOAD_CHAT].errors++;
+    }
+    if (origin.outstanding.empty() || origin.outstanding.front().id != id) return;
+    record(LOAD_CHAT, origin.outstanding.front().start);
+    origin.outstanding.pop_front();
+    if (!g_open_loop && origin.ready) send_chat(origin, now_ns());
+}
+
+void img_done(load_conn &conn, bool ok) {
+    conn_close(conn);
+    if (!conn.outstanding.empty()) {
+        if (ok) record(LOAD_IMG, conn.outstanding.front().start);
+        else if (g_recording) g_stats[LOAD_IMG].errors++;
+        conn.outstanding.pop_front();
+    }
+    if (!conn.waiting.empty()) {
+        uint64_t start = conn.waiting.front();
+        conn.waiting.pop_front();
+        start_img(conn, start);
+    } else if (!g_open_loop) {
+        start_img(conn, now_ns());
+    }
+}
+
+// Lost connection, its requests are errors
+void conn_failed(load_conn &conn) {
+    if (conn.kind == LOAD_IMG) {
+        img_done(conn, false);
+        return;
+    }
+    if (g_recording) g_stats[conn.kind].errors += conn.outstanding.size();
+    conn.outstanding.clear();
+    conn_close(conn);
+    g_failed++;
+    log_msg(LOG_DEBUG, "Connection %d closed.", conn.index);
+}
+
+void conn_read(load_conn &conn) {
+    char buffer[READ_SIZE];
+    while (1) {
+        ssize_t len = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            conn_failed(conn);
+            return;
+        }
+        if (len == 0) {
+            if (conn.kind == LOAD_IMG) img_done(conn, true);
+            else conn_failed(conn);
+            return;
+        }
+        if (conn.kind == LOAD_IMG) continue;
+
+        // Lines, the unfinished one waits in conn.in
+        conn.in.append(buffer, len);
+        size_t start = 0, end;
+        while ((end = conn.in.find('\n', start)) != std::string::npos) {
+            if (conn.kind == LOAD_CALC) calc_line(conn, conn.in.data() + start, end - start);
+            else chat_line(conn, conn.in.data() + start, end - start);
+            start = end + 1;
+        }
+        conn.in.erase(0, start);
+    }
+}
+
+void conn_event(load_conn &conn, uint32_t events) {
+    if (conn.fd < 0) return;
+    if (events & EPOLLOUT) {
+        if (!conn.connected) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error) {
+                log_msg(LOG_DEBUG, "Connect of %d failed: %s", conn.index, strerror(error));
+                conn_failed(conn);
+                return;
+            }
+            conn.connected = true;
+            conn.ready = conn.kind != LOAD_CHAT;
+            if (conn.kind == LOAD_CALC && !g_open_loop) send_calc(conn, now_ns());
+        }
+        conn.writable = true;
+        conn_flush(conn);
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) conn_read(conn);
+}
+
+//***************************************************************************
+// open loop
+
+// Scheduled request goes to the next connection of its kind
+void schedule(load_kind kind, uint64_t start) {
+    std::vector<int> &conns = g_kind_conns[kind];
+    for (size_t tries = 0; tries < conns.size(); tries++) {
+        load_conn &conn = g_conns[conns[g_kind_next[kind]++ % conns.size()]];
+        if (kind == LOAD_IMG || conn.ready) {
+            send_next(conn, start);
+            return;
+        }
+    }
+    if (g_recording) g_stats[kind].errors++;
+}
+
+//***************************************************************************
+// output
+
+void print_results(const char *format, double elapsed) {
+    histogram all;
+    hist_init(all);
+    uint64_t all_errors = 0;
+    for (int kind = 0; kind < LOAD_KINDS; kind++) {
+        hist_merge(all, g_stats[kind].latency);
+        all_errors += g_stats[kind].errors;
+    }
+
+    const double percentiles[] = { 50, 90, 99, 99.9 };
+    bool json = strcmp(format, "json") == 0;
+    bool csv = strcmp(format, "csv") == 0;
+    if (csv) printf("kind,count,errors,throughput,min_us,mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n");
+    if (json) printf("{\n  \"duration_s\": %.3f,\n  \"results\": [", elapsed);
+    else if (!csv) printf("%-5s %10s %8s %10s %10s %10s %10s %10s %10s %10s (us)\n",
+                          "kind", "count", "errors", "req/s", "min", "p50", "p90", "p99", "p99.9", "max");
+
+    bool first = true;
+    for (int kind = 0; kind <= LOAD_KINDS; kind++) {
+        const histogram &hist = kind < LOAD_KINDS ? g_stats[kind].latency : all;
+        uint64_t errors = kind < LOAD_KINDS ? g_stats[kind].errors : all_errors;
+        if (kind < LOAD_KINDS && g_kind_conns[kind].empty()) continue;
+        const char *name = kind < LOAD_KINDS ? kind_names[kind] : "all";
+
+        double values[4];
+        for (int i = 0; i < 4; i++) values[i] = hist_percentile(hist, percentiles[i]) / 1e3;
+        double min = hist.total ? hist.min / 1e3 : 0;
+        double mean = hist.total ? hist.sum / hist.total / 1e3 : 0;
+        double throughput = hist.total / elapsed;
+
+        if (csv) {
+            printf("%s,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", name,
+                   (unsigned long long)hist.total, (unsigned long long)errors, throughput, min, mean,
+                   values[0], values[1], values[2], values[3], hist.max / 1e3);
+        } else if (json) {
+            printf("%s\n    {\"kind\": \"%s\", \"count\": %llu, \"errors\": %llu, \"throughput\": %.1f, "
+                   "\"min_us\": %.1f, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+                   "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f,\n     \"histogram\": [",
+                   first ? "" : ",", name, (unsigned long long)hist.total, (unsigned long long)errors,
+                   throughput, min, mean, values[0], values[1], values[2], values[3], hist.max / 1e3);
+            // Non-empty buckets as [highest value in us, count]
+            bool first_bucket = true;
+            for (size_t i = 0; i < HIST_SIZE; i++) {
+                if (!hist.counts[i]) continue;
+                printf("%s[%.3f, %llu]", first_bucket ? "" : ", ", hist_value(i) / 1e3, (unsigned long long)hist.counts[i]);
+                first_bucket = false;
+            }
+            printf("]}");
+        } else {
+            printf("%-5s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+                   (unsigned long long)hist.total, (unsigned long long)errors, throughput, min,
+                   values[0], values[1], values[2], values[3], hist.max / 1e3);
+        }
+        first = false;
+    }
+    if (json) printf("\n  ]\n}\n");
+}
+
+//***************************************************************************
+// help
+
+void help(const char *program_name) {
+    printf(
+        "\nLoad generator for the calculator, image and chat servers.\n\n"
+        "Usage: %s [-h -d] [-c connections] [-t seconds] [-r rate] [-m mix]\n"
+        "       [--calc port] [--img port] [--chat port] [-f text|csv|json] ip_or_name\n\n"
+        "  -c  connections, split among the kinds by the mix (default %d)\n"
+        "  -t  duration in seconds (default %d)\n"
+        "  -r  open loop with given requests per second, closed loop without it\n"
+        "  -m  weights of the kinds, e.g. calc=8,img=1,chat=1 (default 1 for each port given)\n"
+        "  -f  output format (default text)\n"
+        "  --calc, --img, --chat  port of the server for the kind of requests\n"
+        "  -d  debug mode\n"
+        "  -h  this help\n\n", program_name, DEFAULT_CONNECTIONS, DEFAULT_DURATION
+    );
+    exit(0);
+}
+
+//***************************************************************************
+
+int main(int argc, char **argv) {
+    if (argc <= 2) help(argv[0]);
+
+    char *server_host = nullptr;
+    int connections = DEFAULT_CONNECTIONS;
+    int duration = DEFAULT_DURATION;
+    double rate = 0;
+    const char *format = "text";
+    const char *mix = nullptr;
+    int ports[LOAD_KINDS] = { 0, 0, 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d")) g_debug = LOG_DEBUG;
+        else if (!strcmp(argv[i], "-h")) help(argv[0]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc) connections = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) duration = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc) rate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-m") && i + 1 < argc) mix = argv[++i];
+        else if (!strcmp(argv[i], "-f") && i + 1 < argc) format = argv[++i];
+        else if (!strcmp(argv[i], "--calc") && i + 1 < argc) ports[LOAD_CALC] = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--img") && i + 1 < argc) ports[LOAD_IMG] = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--chat") && i + 1 < argc) ports[LOAD_CHAT] = atoi(argv[++i]);
+        else if (*argv[i] != '-' && !server_host) server_host = argv[i];
+        else help(argv[0]);
+    }
+
+    if (!server_host || connections <= 0 || duration <= 0 || rate < 0) help(argv[0]);
+    if (strcmp(format, "text") && strcmp(format, "csv") && strcmp(format, "json")) help(argv[0]);
+
+    double weights[LOAD_KINDS];
+    for (int kind = 0; kind < LOAD_KINDS; kind++) weights[kind] = ports[kind] ? 1 : 0;
+    for (const char *pos = mix; pos && *pos; ) {
+        char name[16];
+        double weight;
+        int used;
+        if (sscanf(pos, "%15[a-z]=%lf%n", name, &weight, &used) != 2) help(argv[0]);
+        int kind = 0;
+        while (kind < LOAD_KINDS && strcmp(name, kind_names[kind])) kind++;
+        if (kind == LOAD_KINDS || weight < 0) help(argv[0]);
+        weights[kind] = ports[kind] ? weight : 0;
+        pos += used;
+        if (*pos == ',') pos++;
+    }
+
+    double weight_sum = 0;
+    for (int kind = 0; kind < LOAD_KINDS; kind++) weight_sum += weights[kind];
+    if (weight_sum <= 0) {
+        log_msg(LOG_ERROR, "No port of calc, img or chat server given.");
+        help(argv[0]);
+    }
+
+    addrinfo address_info_request, *address_info_answer;
+    memset(&address_info_request, 0, sizeof(address_info_request));
+    address_info_request.ai_family = AF_INET;
+    address_info_request.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(server_host, nullptr, &address_info_request, &address_info_answer) != 0) {
+        log_msg(LOG_ERROR, "Unknown host name!");
+        exit(1);
+    }
+    for (int kind = 0; kind < LOAD_KINDS; kind++) {
+        g_address[kind] = *(sockaddr_in *)address_info_answer->ai_addr;
+        g_address[kind].sin_port = htons(ports[kind]);
+    }
+    freeaddrinfo(address_info_answer);
+
+    // Thousands of connections need as many descriptors
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (int kind = 0; kind < LOAD_KINDS; kind++) {
+        hist_init(g_stats[kind].latency);
+        g_stats[kind].errors = 0;
+        g_stats[kind].sent = 0;
+        if (weights[kind] <= 0) continue;
+        // Chat needs somebody else to receive the message
+        int count = (int)(connections * weights[kind] / weight_sum + 0.5);
+        if (count < (kind == LOAD_CHAT ? 2 : 1)) count = kind == LOAD_CHAT ? 2 : 1;
+        for (int i = 0; i < count; i++) {
+            load_conn conn;
+            conn.fd = -1;
+            conn.kind = (load_kind)kind;
+            conn.index = g_conns.size();
+            conn.connected = false;
+            conn.ready = false;
+            conn.writable = false;
+            g_conns.push_back(conn);
+            g_kind_conns[kind].push_back(conn.index);
+        }
+    }
+
+    // Persistent connections are set up before the clock starts, closed
+    // loop ones wait with their first request until then
+    g_open_loop = true;
+    for (load_conn &conn : g_conns) {
+        if (conn.kind == LOAD_IMG) continue;
+        if (conn_open(conn) != 0) {
+            g_failed++;
+            continue;
+        }
+        if (conn.kind == LOAD_CHAT) {
+            char nick[32];
+            int len = snprintf(nick, sizeof(nick), "#nick load%d", conn.index);
+            conn.out.assign(nick, len);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t connect_end = now_ns() + CONNECT_TIMEOUT_MS * 1000000ull;
+    while (now_ns() < connect_end) {
+        size_t pending = 0;
+        for (load_conn &conn : g_conns) pending += conn.kind != LOAD_IMG && conn.fd >= 0 && !conn.ready;
+        if (!pending) break;
+        int count = epoll_wait(g_epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < count; i++) conn_event(g_conns[events[i].data.u32], events[i].events);
+    }
+
+    g_open_loop = rate > 0;
+    uint64_t started = now_ns();
+    for (load_conn &conn : g_conns) {
+        if (g_open_loop) break;
+        if (conn.kind == LOAD_IMG) start_img(conn, started);
+        else if (conn.ready) send_next(conn, started);
+    }
+    log_msg(LOG_INFO, "%zu connections, %s loop, %d s.", g_conns.size(), g_open_loop ? "open" : "closed", duration);
+
+    // Open loop: every kind has its own interval
+    uint64_t interval[LOAD_KINDS], next_send[LOAD_KINDS];
+    for (int kind = 0; kind < LOAD_KINDS; kind++) {
+        interval[kind] = weights[kind] > 0 && g_open_loop ? (uint64_t)(1e9 / (rate * weights[kind] / weight_sum)) : 0;
+        next_send[kind] = started;
+    }
+
+    uint64_t end = started + (uint64_t)duration * 1000000000ull;
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end) break;
+
+        uint64_t wake = end;
+        for (int kind = 0; kind < LOAD_KINDS; kind++) {
+            if (!interval[kind]) continue;
+            for (; next_send[kind] <= now; next_send[kind] += interval[kind]) schedule((load_kind)kind, next_send[kind]);
+            if (next_send[kind] < wake) wake = next_send[kind];
+        }
+
+        int timeout = (wake - now + 999999) / 1000000;
+        int count = epoll_wait(g_epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < count; i++) conn_event(g_conns[events[i].data.u32], events[i].events);
+    }
+    g_recording = false;
+    double elapsed = (now_ns() - started) / 1e9;
+
+    uint64_t unfinished = 0;
+    for (load_conn &conn : g_conns) unfinished += conn.outstanding.size() + conn.waiting.size();
+    if (unfinished) log_msg(LOG_INFO, "%llu requests unfinished at the end.", (unsigned long long)unfinished);
+    if (g_failed) log_msg(LOG_ERROR, "%llu connections failed or lost.", (unsigned long long)g_failed);
+
+    print_results(format, elapsed);
+    return 0;
+}
@@ -7,117 +7,225 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <string>
+#include <vector>
 
 #define STR_CLOSE "close"
+#define STR_STATS "stats"
 #define LOG_ERROR 0
 #define LOG_INFO  1
 #define LOG_DEBUG 2
+#define MAX_WORKERS 256
+#define RESPAWN_DELAY 1     // seconds, worker dying faster is respawned later
+
+// Engine logs through log_msg() with the levels above
+#include "epoll_engine.h"
+#include "calc.h"
+#include "calc_cache.h"
+#include "calc_batch.h"
+#include "async_log.h"
 
 int g_debug = LOG_INFO;
 
+// Record is formatted and written by the writer thread of async_log.h
 void log_msg(int log_level, const char *format, ...) {
-    const char *prefix[] = { "ERR: ", "INF: ", "DEB: " };
     if (log_level > g_debug) return;
 
-    char buffer[1024];
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_record(log_level, format, args);
     va_end(args);
-
-    fprintf(log_level == LOG_ERROR ? stderr : stdout, "%s%s\n", prefix[log_level], buffer);
 }
 
-int calculator(const char *expression, char *response) {
-    int num1, num2, result;
-    char op;
-
-    if (sscanf(expression, "%d %c %d", &num1, &op, &num2) != 3) {
-        snprintf(response, 256, "Invalid expression format. Use format: <number> <operator> <number>\n");
-        return -1;
+// Builds response for one line (without '\n'), length -1 is too long line.
+// Returns -1 when connection should close.
+int answer_line(int client_socket, char *line, int length, char *response) {
+    if (length < 0) {
+        snprintf(response, REPLY_SIZE, "Error: Expression is longer than %d characters.\n", LINE_MAX_LEN);
+        return 0;
     }
+    log_msg(LOG_INFO, "Received from client %d: %s", client_socket, line);
 
-    switch (op) {
-        case '+': result = num1 + num2; break;
-        case '-': result = num1 - num2; break;
-        case '*': result = num1 * num2; break;
-        case '/':
-            if (num2 == 0) {
-                snprintf(response, 256, "Error: Division by zero.\n");
-                return -1;
-            }
-            result = num1 / num2;
-            break;
-        default:
-            snprintf(response, 256, "Invalid operator. Use +, -, *, or /.\n");
-            return -1;
+    if (strncmp(line, STR_CLOSE, strlen(STR_CLOSE)) == 0) return -1;
+    if (strcmp(line, STR_STATS) == 0) {
+        cache_stats(response, REPLY_SIZE);
+        return 0;
     }
 
-    snprintf(response, 256, "%d %c %d = %d\n", num1, op, num2, result);
+    // Evaluating expression
+    if (cached_calculator(line, response) != 0) {
+        snprintf(response, REPLY_SIZE, "Invalid expression format or operator.\n");
+    }
     return 0;
 }
 
-void handle_client(int client_socket) {
-    char buffer[256], response[256];
-    while (1) {
-        int length = read(client_socket, buffer, sizeof(buffer) - 1);
-        if (length <= 0) break;
+// Connection is in text mode unless its first byte is CALC_BATCH_MAGIC
+struct client_state {
+    bool started;
+    line_buffer pending;        // unfinished text line
+    batch_session *binary;      // NULL in text mode
+    std::string out;            // unsent replies, non-blocking socket only
+    bool closing;               // closed once out is sent
+};
 
-        buffer[length] = '\0';
-        log_msg(LOG_INFO, "Received from client %d: %s", client_socket, buffer);
+void client_init(client_state &state) {
+    state.started = false;
+    line_init(state.pending);
+    state.binary = NULL;
+    state.out.clear();
+    state.closing = false;
+}
 
-        if (strncmp(buffer, STR_CLOSE, strlen(STR_CLOSE)) == 0) break;
+void client_free(client_state &state) {
+    delete state.binary;
+    state.binary = NULL;
+    state.out.clear();
+}
 
-        // Check buffer is ending '\n'
-        if (buffer[length - 1] != '\n') {
-            snprintf(response, sizeof(response), "Error: Expression must end with newline '\\n'\n");
-        } else {
-            // Evaluating expression
-            if (calculator(buffer, response) != 0) {
-                snprintf(response, sizeof(response), "Invalid expression format or operator.\n");
-            }
+// Sends buffers, the rest which a non-blocking socket doesn't take waits
+// in state.out. Blocking socket takes everything.
+int client_sendv(int client_socket, client_state &state, struct iovec *iov, int count) {
+    // Order of replies must stay, so nothing goes before the queue
+    while (count > 0 && state.out.empty()) {
+        ssize_t n = writev(client_socket, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
         }
-
-        // Sending response to client
-        write(client_socket, response, strlen(response));
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    for (int i = 0; i < count; i++) state.out.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    if (state.out.size() > ENGINE_MAX_PENDING) {
+        log_msg(LOG_ERROR, "Client %d doesn't read its replies.", client_socket);
+        return -1;
     }
+    return 0;
+}
 
-    close(client_socket);
-    exit(0);
+// Socket became writable again
+int client_flush(int client_socket, client_state &state) {
+    size_t done = 0;
+    while (done < state.out.size()) {
+        ssize_t n = write(client_socket, state.out.data() + done, state.out.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        done += n;
+    }
+    state.out.erase(0, done);
+    return 0;
 }
 
-void help(const char *program_name) {
-    printf("Usage: %s [-d] <port>\n", program_name);
-    printf("Options:\n");
-    printf("  -d  Enable debug mode\n");
-    printf("  -h  Show help\n");
-    exit(0);
+int client_send_batch(int client_socket, client_state &state, reply_batch &batch) {
+    int count = batch.count;
+    batch.count = 0;
+    return client_sendv(client_socket, state, batch.iov, count);
 }
 
-int main(int argc, char **argv) {
-    if (argc < 2) help(argv[0]);
+// Answers lines of one read, the replies go back in one writev()
+struct client_lines {
+    int client_socket;
+    client_state *state;
+    reply_batch *batch;
 
-    int server_port = 0;
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-d") == 0) g_debug = LOG_DEBUG;
-        else if (strcmp(argv[i], "-h") == 0) help(argv[0]);
-        else server_port = atoi(argv[i]);
+    int operator()(char *line, int length) {
+        if (reply_full(*batch) && client_send_batch(client_socket, *state, *batch) != 0) return -1;
+        if (answer_line(client_socket, line, length, reply_slot(*batch)) != 0) return -1;
+        reply_commit(*batch);
+        return 0;
     }
+};
 
-    if (server_port <= 0) {
-        log_msg(LOG_ERROR, "Invalid or missing port number.");
-        help(argv[0]);
+// Evaluates complete binary requests and sends their replies
+int process_batches(int client_socket, client_state &state, const char *data, int length) {
+    batch_session &session = *state.binary;
+    if (batch_feed(session, data, length) != 0) {
+        log_msg(LOG_ERROR, "Client %d sent too large batch.", client_socket);
+        return -1;
     }
+    if (session.reply.empty()) return 0;
+
+    struct iovec iov = { &session.reply[0], session.reply.size() };
+    int result = client_sendv(client_socket, state, &iov, 1);
+    session.reply.clear();
+    return result;
+}
+
+// Reads and answers pipelined lines, returns -1 when connection should close
+int process_client(int client_socket, client_state &state) {
+    char buffer[READ_CHUNK];
+    int length = read(client_socket, buffer, sizeof(buffer));
+    if (length < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (length <= 0) return -1;
+
+    char *data = buffer;
+    if (!state.started) {
+        state.started = true;
+        if ((unsigned char)buffer[0] == CALC_BATCH_MAGIC) {
+            log_msg(LOG_INFO, "Client %d uses binary batches.", client_socket);
+            state.binary = new batch_session;
+            data++;
+            length--;
+        }
+    }
+    if (state.binary) return process_batches(client_socket, state, data, length);
+
+    reply_batch batch;
+    batch.count = 0;
+    client_lines handler = { client_socket, &state, &batch };
+    int result = frame_lines(state.pending, data, length, handler);
+
+    // Replies before "close" are still sent
+    if (client_send_batch(client_socket, state, batch) != 0) return -1;
+    return result;
+}
 
+void handle_client(int client_socket) {
+    client_state state;
+    client_init(state);
+    while (process_client(client_socket, state) == 0) {}
+    client_free(state);
+
+    close(client_socket);
+    exit(0);
+}
+
+//***************************************************************************
+// listening socket
+
+int create_listener(int server_port, bool reuse_port) {
     int listening_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (listening_socket == -1) {
         log_msg(LOG_ERROR, "Socket creation failed.");
-        exit(1);
+        return -1;
     }
 
     int reuse_option = 1;
     setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &reuse_option, sizeof(reuse_option));
 
+    // Every worker has its own listener, kernel spreads connections among them
+    if (reuse_port && setsockopt(listening_socket, SOL_SOCKET, SO_REUSEPORT, &reuse_option, sizeof(reuse_option)) < 0) {
+        log_msg(LOG_ERROR, "SO_REUSEPORT failed.");
+        close(listening_socket);
+        return -1;
+    }
+
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(server_port);
@@ -126,29 +234,42 @@ int main(int argc, char **argv) {
     if (bind(listening_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
         log_msg(LOG_ERROR, "Bind failed.");
         close(listening_socket);
-        exit(1);
+        return -1;
     }
 
-    if (listen(listening_socket, 10) < 0) {
+    if (listen(listening_socket, SOMAXCONN) < 0) {
         log_msg(LOG_ERROR, "Listen failed.");
         close(listening_socket);
-        exit(1);
+        return -1;
     }
+    return listening_socket;
+}
 
-    log_msg(LOG_INFO, "Server listening on port %d", server_port);
+int accept_client(int listening_socket) {
+    struct sockaddr_in client_address;
+    socklen_t client_len = sizeof(client_address);
+    int client_socket = accept(listening_socket, (struct sockaddr *)&client_address, &client_len);
 
-    while (1) {
-        struct sockaddr_in client_address;
-        socklen_t client_len = sizeof(client_address);
-        int client_socket = accept(listening_socket, (struct sockaddr *)&client_address, &client_len);
+    if (client_socket == -1) {
+        log_msg(LOG_ERROR, "Accept failed.");
+        return -1;
+    }
 
-        if (client_socket == -1) {
-            log_msg(LOG_ERROR, "Accept failed.");
-            continue;
-        }
+    log_msg(LOG_INFO, "Connected: %s:%d",
+            inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+    return client_socket;
+}
+
+//***************************************************************************
+// fork per connection
 
-        log_msg(LOG_INFO, "Connected: %s:%d",
-                inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+void serve_fork(int listening_socket) {
+    // Children are not waited for
+    signal(SIGCHLD, SIG_IGN);
+
+    while (1) {
+        int client_socket = accept_client(listening_socket);
+        if (client_socket == -1) continue;
 
         pid_t pid = fork();
         if (pid < 0) {
@@ -161,6 +282,237 @@ int main(int argc, char **argv) {
             close(client_socket); // Parent process closes client socket
         }
     }
+}
+
+//***************************************************************************
+// prefork: long-lived workers, each serves many connections with poll()
+// on non-blocking sockets, replies a client doesn't take wait for POLLOUT
+
+void worker_close(std::vector<pollfd> &fds, std::vector<client_state> &clients, size_t i) {
+    close(fds[i].fd);
+    client_free(clients[i]);
+    fds[i] = fds.back();
+    fds.pop_back();
+    clients[i] = clients.back();
+    clients.pop_back();
+}
+
+void worker_loop(int server_port, int worker_id) {
+    int listening_socket = create_listener(server_port, true);
+    if (listening_socket == -1) exit(1);
+    log_msg(LOG_DEBUG, "Worker %d (pid %d) listening.", worker_id, getpid());
+
+    // clients[i] is state of fds[i]
+    std::vector<pollfd> fds(1);
+    std::vector<client_state> clients(1);
+    fds[0].fd = listening_socket;
+    fds[0].events = POLLIN;
+
+    while (1) {
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            log_msg(LOG_ERROR, "Poll failed.");
+            exit(1);
+        }
+
+        for (size_t i = fds.size() - 1; i > 0; i--) {
+            short revents = fds[i].revents;
+            client_state &state = clients[i];
+            if (!revents) continue;
+
+            if ((revents & (POLLOUT | POLLERR | POLLHUP)) && !state.out.empty() && client_flush(fds[i].fd, state) != 0) {
+                worker_close(fds, clients, i);
+                continue;
+            }
+            // Data before hang up is still answered, replies before close are still sent
+            if (!state.closing && (revents & (POLLIN | POLLERR | POLLHUP)) &&
+                process_client(fds[i].fd, state) != 0) {
+                state.closing = true;
+                if (!state.out.empty() && client_flush(fds[i].fd, state) != 0) state.out.clear();
+            }
+            if (state.closing && state.out.empty()) {
+                worker_close(fds, clients, i);
+                continue;
+            }
+            fds[i].events = state.closing ? POLLOUT : state.out.empty() ? POLLIN : POLLIN | POLLOUT;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int client_socket = accept_client(listening_socket);
+            if (client_socket != -1) {
+                fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+                pollfd client = { client_socket, POLLIN, 0 };
+                fds.push_back(client);
+                clients.push_back(client_state());
+                client_init(clients.back());
+            }
+        }
+    }
+}
+
+pid_t spawn_worker(int server_port, int worker_id) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        worker_loop(server_port, worker_id);
+    }
+    if (pid < 0) log_msg(LOG_ERROR, "Fork of worker %d failed.", worker_id);
+    return pid;
+}
+
+volatile sig_atomic_t g_stop = 0;
+
+void stop_handler(int) {
+    g_stop = 1;
+}
+
+// Supervisor starts workers and respawns those which exit
+void serve_prefork(int server_port, int worker_count) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    std::vector<pid_t> workers(worker_count);
+    std::vector<time_t> started(worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        workers[i] = spawn_worker(server_port, i);
+        started[i] = time(NULL);
+    }
+
+    while (!g_stop) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            // All forks failed, try again later
+            sleep(RESPAWN_DELAY);
+        }
+
+        for (int i = 0; i < worker_count && !g_stop; i++) {
+            if (workers[i] > 0 && workers[i] != pid) continue;
+
+            if (workers[i] > 0) {
+                if (WIFSIGNALED(status)) log_msg(LOG_ERROR, "Worker %d killed by signal %d.", i, WTERMSIG(status));
+                else log_msg(LOG_ERROR, "Worker %d exited with status %d.", i, WEXITSTATUS(status));
+            }
+
+            // Crash loop must not eat the CPU
+            if (time(NULL) - started[i] < RESPAWN_DELAY) sleep(RESPAWN_DELAY);
+            workers[i] = spawn_worker(server_port, i);
+            started[i] = time(NULL);
+        }
+    }
+
+    log_msg(LOG_INFO, "Stopping workers.");
+    for (int i = 0; i < worker_count; i++) {
+        if (workers[i] > 0) kill(workers[i], SIGTERM);
+    }
+    while (wait(NULL) > 0) {}
+}
+
+//***************************************************************************
+// epoll engine: event loop per core, connections in a slab
+
+int engine_message(engine_loop &loop, int conn_id, char *line, int len) {
+    if (answer_line(loop.slab[conn_id].fd, line, len, reply_slot(loop.batch)) != 0) return -1;
+    reply_commit(loop.batch);
+    return 0;
+}
+
+void help(const char *program_name) {
+    printf("Usage: %s [-d] [-p workers | -e loops] [--cache size [--prefill low:high]] <port>\n", program_name);
+    printf("Options:\n");
+    printf("  -d  Enable debug mode\n");
+    printf("  -p  Prefork mode with given number of workers (default fork per connection)\n");
+    printf("  -e  epoll engine with given number of event loops, 0 = one per core\n");
+    printf("  --cache size        result cache of given size (K/M/G), \"stats\" shows its counters\n");
+    printf("  --prefill low:high  cache all \"a op b\" with a, b in the range at start\n");
+    printf("  -h  Show help\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) help(argv[0]);
+
+    int server_port = 0;
+    int worker_count = 0;
+    int loop_count = -1;
+    size_t cache_size = 0;
+    int prefill_low = 0, prefill_high = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) g_debug = LOG_DEBUG;
+        else if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if (worker_count <= 0 || worker_count > MAX_WORKERS) {
+                log_msg(LOG_ERROR, "Invalid number of workers.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            loop_count = atoi(argv[++i]);
+            if (loop_count < 0) {
+                log_msg(LOG_ERROR, "Invalid number of event loops.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_size = cache_parse_size(argv[++i]);
+            if (cache_size == 0) {
+                log_msg(LOG_ERROR, "Invalid cache size.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--prefill") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d:%d", &prefill_low, &prefill_high) != 2 || prefill_low > prefill_high) {
+                log_msg(LOG_ERROR, "Invalid prefill range.");
+                help(argv[0]);
+            }
+        }
+        else server_port = atoi(argv[i]);
+    }
+
+    if (server_port <= 0) {
+        log_msg(LOG_ERROR, "Invalid or missing port number.");
+        help(argv[0]);
+    }
+
+    // Shared mapping has to exist before workers and children are forked
+    if (cache_size > 0) {
+        if (cache_init(cache_size) != 0) {
+            log_msg(LOG_ERROR, "Cache allocation failed.");
+            exit(1);
+        }
+        if (prefill_low <= prefill_high) {
+            size_t count = cache_prefill(prefill_low, prefill_high);
+            log_msg(LOG_INFO, "Cache prefilled with %zu expressions.", count);
+        }
+    }
+
+    // Client gone in the middle of a reply is a write error, not a signal,
+    // also in forked children and prefork workers
+    signal(SIGPIPE, SIG_IGN);
+
+    if (loop_count >= 0) {
+        engine_callbacks callbacks = { engine_message, NULL, NULL, NULL, true };
+        log_msg(LOG_INFO, "Server listening on port %d with epoll engine", server_port);
+        return engine_run(server_port, loop_count, callbacks) == 0 ? 0 : 1;
+    }
+
+    if (worker_count > 0) {
+        log_msg(LOG_INFO, "Server listening on port %d with %d workers", server_port, worker_count);
+        serve_prefork(server_port, worker_count);
+        return 0;
+    }
+
+    int listening_socket = create_listener(server_port, false);
+    if (listening_socket == -1) exit(1);
+
+    log_msg(LOG_INFO, "Server listening on port %d", server_port);
+    serve_fork(listening_socket);
 
     close(listening_socket);
     return 0;
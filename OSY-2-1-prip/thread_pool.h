@@ -0,0 +1,192 @@
+// Fixed pool of client threads for the threaded servers.
+//
+// Threads are created once, with a small stack, and serve one client after
+// another. Every thread has its own queue of accepted sockets and its own
+// wakeup. A thread takes the oldest socket of its own queue and, only when
+// that one is empty, steals the newest one of another queue. A thread with
+// nothing to take or steal registers as idle and sleeps on its own queue.
+//
+// An accepted socket goes to an idle thread when there is one, which is
+// then the only thread woken. With all threads busy sockets are dealt
+// round robin, and the first thread to finish a client takes its own or
+// steals another one. So a socket dealt to a thread still busy with a long
+// connection is picked up by whichever thread is free first.
+//
+// Sockets waiting in all queues are limited to capacity. Over that
+// pool_submit() blocks, so the accepting thread stops accepting and the
+// rest waits in the listen backlog.
+//
+// A client holds its thread until the handler returns, so the number of
+// threads is also the number of clients served at the same time.
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#define POOL_THREADS 64
+#define POOL_STACK_SIZE (256 << 10)
+#define POOL_CAPACITY 256
+
+struct pool_queue {
+    std::mutex mutex;
+    std::condition_variable work;           // wakes the owner thread only
+    std::deque<int> sockets;
+    bool wake;                              // owner should look for work
+};
+
+struct thread_pool {
+    void (*handler)(int client_socket);
+    std::vector<pool_queue *> queues;       // one per thread
+    size_t started;                         // threads 0 .. started-1 run
+    std::mutex mutex;                       // guards the fields below
+    std::condition_variable room;           // queued below capacity
+    std::vector<size_t> idle;               // sleeping threads, nothing queued
+    size_t queued;                          // not yet taken by a thread
+    size_t capacity;
+    size_t next;                            // round robin
+};
+
+struct pool_thread_arg {
+    thread_pool *pool;
+    size_t index;
+};
+
+// Size with K/M suffix, 0 when invalid
+inline size_t pool_parse_size(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    if (*end == 'K' || *end == 'k') size <<= 10;
+    else if (*end == 'M' || *end == 'm') size <<= 20;
+    else if (*end) return 0;
+    return size;
+}
+
+// Own queue from the front, others from the back, -1 when all are empty
+inline int pool_take(thread_pool &pool, size_t index) {
+    size_t count = pool.queues.size();
+    for (size_t i = 0; i < count; i++) {
+        pool_queue &queue = *pool.queues[(index + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.sockets.empty()) continue;
+
+        int client_socket;
+        if (i == 0) {
+            client_socket = queue.sockets.front();
+            queue.sockets.pop_front();
+        } else {
+            client_socket = queue.sockets.back();
+            queue.sockets.pop_back();
+        }
+        return client_socket;
+    }
+    return -1;
+}
+
+inline void *pool_thread(void *arg) {
+    pool_thread_arg args = *(pool_thread_arg *)arg;
+    delete (pool_thread_arg *)arg;
+    thread_pool &pool = *args.pool;
+    pool_queue &own = *pool.queues[args.index];
+
+    while (1) {
+        int client_socket = pool_take(pool, args.index);
+        if (client_socket != -1) {
+            {
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                pool.queued--;
+            }
+            pool.room.notify_one();
+            pool.handler(client_socket);
+            continue;
+        }
+
+        // Wakeup left from a socket dealt while this thread was busy
+        {
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.wake = false;
+        }
+        // Socket queued meanwhile, or one just taken by another thread
+        // which didn't count it yet, is looked for again
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            if (pool.queued > 0) continue;
+            pool.idle.push_back(args.index);
+        }
+        std::unique_lock<std::mutex> lock(own.mutex);
+        own.work.wait(lock, [&] { return own.wake; });
+        own.wake = false;
+    }
+    return NULL;
+}
+
+// Starts the threads, stack_size 0 keeps the default one. Returns -1 when
+// not a single thread could be created.
+inline int pool_start(thread_pool &pool, size_t threads, size_t stack_size, size_t capacity,
+                      void (*handler)(int client_socket)) {
+    pool.handler = handler;
+    pool.started = 0;
+    pool.queued = 0;
+    pool.capacity = capacity;
+    pool.next = 0;
+    // All queues exist before the first thread looks at them
+    for (size_t i = 0; i < threads; i++) {
+        pool.queues.push_back(new pool_queue);
+        pool.queues.back()->wake = false;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (stack_size > 0) {
+        if (stack_size < (size_t)PTHREAD_STACK_MIN) stack_size = PTHREAD_STACK_MIN;
+        pthread_attr_setstacksize(&attr, stack_size);
+    }
+
+    // Queues of threads which failed to start stay empty
+    for (size_t i = 0; i < threads; i++) {
+        pthread_t thread;
+        pool_thread_arg *arg = new pool_thread_arg{ &pool, pool.started };
+        if (pthread_create(&thread, &attr, pool_thread, arg) != 0) {
+            delete arg;
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.started++;
+    }
+    pthread_attr_destroy(&attr);
+    return pool.started > 0 ? 0 : -1;
+}
+
+// Hands accepted socket over to the pool, waits while the pool is full
+inline void pool_submit(thread_pool &pool, int client_socket) {
+    pool_queue *queue;
+    {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.room.wait(lock, [&] { return pool.queued < pool.capacity; });
+        pool.queued++;
+
+        size_t index;
+        if (!pool.idle.empty()) {
+            index = pool.idle.back();
+            pool.idle.pop_back();
+        } else {
+            index = pool.next++ % pool.started;
+        }
+        queue = pool.queues[index];
+
+        std::lock_guard<std::mutex> queue_lock(queue->mutex);
+        queue->sockets.push_back(client_socket);
+        queue->wake = true;
+    }
+    queue->work.notify_one();
+}
+
+#endif
@@ -0,0 +1,283 @@
+// Per-client outbound queues of the broadcasting server.
+//
+// Broadcast never waits for a socket. The message is built once and put
+// into the queue of every client (shared, not copied). A queue which was
+// empty is sent at once with MSG_DONTWAIT, only what the socket doesn't
+// take stays queued. The sender thread waits for EPOLLOUT of sockets with
+// something queued and drains them. A queue holds at most depth messages,
+// policy says what happens to a message for a full queue:
+//
+//   drop        the client misses the message
+//   disconnect  the client is shut down, its reader closes it
+//   block       the broadcasting thread waits for room in the queue
+//
+// Client list is copied on change, so broadcast holds the list lock only
+// for taking a reference to the current copy.
+
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define QUEUE_DEPTH 1024            // default messages per client
+#define QUEUE_IOV 64                // messages per sendmsg()
+#define QUEUE_EVENTS 64
+
+enum overflow_policy { OVERFLOW_DROP, OVERFLOW_DISCONNECT, OVERFLOW_BLOCK };
+
+struct queued_message {
+    std::shared_ptr<const std::string> data;
+    size_t offset;                  // already sent
+};
+
+struct send_queue {
+    int fd;
+    std::mutex mutex;
+    std::condition_variable room;
+    std::deque<queued_message> messages;
+    bool armed;                     // waits for EPOLLOUT
+    bool closed;
+};
+
+typedef std::vector<std::shared_ptr<send_queue> > queue_list;
+
+struct send_queues {
+    std::mutex mutex;               // guards clients and by_fd
+    std::shared_ptr<const queue_list> clients;
+    std::unordered_map<int, std::shared_ptr<send_queue> > by_fd;
+    int epoll_fd;
+    size_t depth;
+    overflow_policy policy;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> disconnected;
+};
+
+inline send_queues &g_queues() {
+    static send_queues queues;
+    return queues;
+}
+
+inline int queue_parse_policy(const char *name, overflow_policy &policy) {
+    if (strcmp(name, "drop") == 0) policy = OVERFLOW_DROP;
+    else if (strcmp(name, "disconnect") == 0) policy = OVERFLOW_DISCONNECT;
+    else if (strcmp(name, "block") == 0) policy = OVERFLOW_BLOCK;
+    else return -1;
+    return 0;
+}
+
+//***************************************************************************
+// one queue, the caller holds queue.mutex
+
+// Sends until the socket is full, -1 on socket error
+inline int queue_drain(send_queue &queue) {
+    while (!queue.messages.empty()) {
+        struct iovec iov[QUEUE_IOV];
+        int count = 0;
+        for (auto it = queue.messages.begin(); it != queue.messages.end() && count < QUEUE_IOV; ++it, count++) {
+            iov[count].iov_base = (void *)(it->data->data() + it->offset);
+            iov[count].iov_len = it->data->size() - it->offset;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(queue.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        while (sent > 0) {
+            queued_message &front = queue.messages.front();
+            size_t left = front.data->size() - front.offset;
+            if ((size_t)sent < left) {
+                front.offset += sent;
+                break;
+            }
+            sent -= left;
+            queue.messages.pop_front();
+        }
+    }
+    return 0;
+}
+
+// Nothing more is sent to the client, blocked broadcasts give up
+inline void queue_close(send_queue &queue) {
+    queue.closed = true;
+    queue.messages.clear();
+    queue.room.notify_all();
+}
+
+// Sender thread gets EPOLLOUT once the socket has room again
+inline void queue_arm(send_queue &queue) {
+    if (queue.armed || queue.messages.empty()) return;
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.fd = queue.fd;
+    if (epoll_ctl(g_queues().epoll_fd, EPOLL_CTL_MOD, queue.fd, &event) == 0) queue.armed = true;
+}
+
+inline void queue_push(send_queue &queue, const std::shared_ptr<const std::string> &message) {
+    send_queues &queues = g_queues();
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    if (queue.closed) return;
+
+    if (queue.messages.size() >= queues.depth) {
+        switch (queues.policy) {
+            case OVERFLOW_DROP:
+                queues.dropped++;
+                return;
+            case OVERFLOW_DISCONNECT:
+                queues.disconnected++;
+                queue_close(queue);
+                shutdown(queue.fd, SHUT_RDWR);
+                return;
+            case OVERFLOW_BLOCK:
+                queue.room.wait(lock, [&] { return queue.closed || queue.messages.size() < queues.depth; });
+                if (queue.closed) return;
+                break;
+        }
+    }
+
+    bool idle = queue.messages.empty();
+    queue.messages.push_back(queued_message{ message, 0 });
+    if (idle && queue_drain(queue) != 0) {
+        queue_close(queue);
+        return;
+    }
+    queue_arm(queue);
+}
+
+//***************************************************************************
+// clients
+
+inline void *queue_sender(void *) {
+    send_queues &queues = g_queues();
+    struct epoll_event events[QUEUE_EVENTS];
+    while (1) {
+        int count = epoll_wait(queues.epoll_fd, events, QUEUE_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            std::shared_ptr<send_queue> queue;
+            {
+                std::lock_guard<std::mutex> lock(queues.mutex);
+                auto it = queues.by_fd.find(events[i].data.fd);
+                if (it == queues.by_fd.end()) continue;
+                queue = it->second;
+            }
+
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->armed = false;
+            if (queue->closed) continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) || queue_drain(*queue) != 0) {
+                queue_close(*queue);
+                continue;
+            }
+            queue->room.notify_all();
+            queue_arm(*queue);
+        }
+    }
+    return NULL;
+}
+
+// Starts the sender thread, returns -1 on failure
+inline int queues_init(size_t depth, overflow_policy policy) {
+    send_queues &queues = g_queues();
+    queues.clients = std::make_shared<const queue_list>();
+    queues.depth = depth;
+    queues.policy = policy;
+    queues.dropped = 0;
+    queues.disconnected = 0;
+    queues.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (queues.epoll_fd < 0) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, queue_sender, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+inline void queue_add(int fd) {
+    send_queues &queues = g_queues();
+    std::shared_ptr<send_queue> queue = std::make_shared<send_queue>();
+    queue->fd = fd;
+    queue->armed = false;
+    queue->closed = false;
+
+    // Replies of one read leave in several sends, Nagle would hold them
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // One shot with no events: registered, but silent until armed
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    event.data.fd = fd;
+    epoll_ctl(queues.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    std::lock_guard<std::mutex> lock(queues.mutex);
+    std::shared_ptr<queue_list> clients = std::make_shared<queue_list>(*queues.clients);
+    clients->push_back(queue);
+    queues.clients = clients;
+    queues.by_fd[fd] = queue;
+}
+
+// Called before the socket is closed
+inline void queue_remove(int fd) {
+    send_queues &queues = g_queues();
+    std::shared_ptr<send_queue> queue;
+    {
+        std::lock_guard<std::mutex> lock(queues.mutex);
+        auto it = queues.by_fd.find(fd);
+        if (it == queues.by_fd.end()) return;
+        queue = it->second;
+        queues.by_fd.erase(it);
+
+        std::shared_ptr<queue_list> clients = std::make_shared<queue_list>();
+        for (const std::shared_ptr<send_queue> &client : *queues.clients) {
+            if (client != queue) clients->push_back(client);
+        }
+        queues.clients = clients;
+        epoll_ctl(queues.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue_close(*queue);
+}
+
+// Puts the message into the queue of every client
+inline void queue_broadcast(const struct iovec *iov, int count) {
+    size_t size = 0;
+    for (int i = 0; i < count; i++) size += iov[i].iov_len;
+    if (size == 0) return;
+
+    std::shared_ptr<std::string> message = std::make_shared<std::string>();
+    message->reserve(size);
+    for (int i = 0; i < count; i++) message->append((const char *)iov[i].iov_base, iov[i].iov_len);
+
+    std::shared_ptr<const queue_list> clients;
+    {
+        std::lock_guard<std::mutex> lock(g_queues().mutex);
+        clients = g_queues().clients;
+    }
+    std::shared_ptr<const std::string> shared = message;
+    for (const std::shared_ptr<send_queue> &client : *clients) queue_push(*client, shared);
+}
+
+#endif
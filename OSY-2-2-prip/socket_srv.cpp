@@ -7,109 +7,146 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <vector>
-#include <algorithm>
 #include <mutex>
-
+#include <signal.h>
 
 #define STR_CLOSE "close"
+#define STR_STATS "stats"
 #define LOG_ERROR 0
 #define LOG_INFO  1
 #define LOG_DEBUG 2
 
-int g_debug = LOG_INFO;
+// Event loop engine is shared with the process based server,
+// it logs through log_msg() with the levels above
+#include "../OSY-2-1-prip/epoll_engine.h"
+#include "../OSY-2-1-prip/calc.h"
+#include "../OSY-2-1-prip/calc_cache.h"
+#include "../OSY-2-1-prip/thread_pool.h"
+#include "../OSY-2-1-prip/async_log.h"
+#include "send_queue.h"
 
-// Shared structures
-std::vector<int> client_sockets;
-std::mutex client_mutex;
+int g_debug = LOG_INFO;
 
-void broadcast_message(const char *message) {
-    std::lock_guard<std::mutex> lock(client_mutex);
-    for (int sock : client_sockets) {
-        write(sock, message, strlen(message));
-    }
+// Batch of replies goes to the send queue of everybody
+void broadcast_replies(struct iovec *iov, int count) {
+    queue_broadcast(iov, count);
 }
 
+// Record is formatted and written by the writer thread of async_log.h
 void log_msg(int log_level, const char *format, ...) {
-    const char *prefix[] = { "ERR: ", "INF: ", "DEB: " };
     if (log_level > g_debug) return;
 
-    char buffer[1024];
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_record(log_level, format, args);
     va_end(args);
-
-    fprintf(log_level == LOG_ERROR ? stderr : stdout, "%s%s\n", prefix[log_level], buffer);
 }
 
-int calculator(const char *expression, char *response) {
-    int num1, num2, result;
-    char op;
+// Builds response for one line (without '\n'), length -1 is too long line.
+// Returns -1 when client wants to close.
+int answer_line(int client_socket, char *line, int length, char *response) {
+    if (length < 0) {
+        snprintf(response, REPLY_SIZE, "Error: Expression is longer than %d characters.\n", LINE_MAX_LEN);
+        return 0;
+    }
+    log_msg(LOG_INFO, "Received from client %d: %s", client_socket, line);
+
+    if (strncmp(line, STR_CLOSE, strlen(STR_CLOSE)) == 0) return -1;
+    if (strcmp(line, STR_STATS) == 0) {
+        cache_stats(response, REPLY_SIZE);
+        size_t len = strlen(response);
+        snprintf(response + len, REPLY_SIZE - len, "queues dropped %llu disconnected %llu\n",
+                 (unsigned long long)g_queues().dropped.load(), (unsigned long long)g_queues().disconnected.load());
+        return 0;
+    }
 
-    if (sscanf(expression, "%d %c %d", &num1, &op, &num2) != 3) {
-        snprintf(response, 256, "Invalid expression format. Use format: <number> <operator> <number>\n");
-        return -1;
+    if (cached_calculator(line, response) != 0) {
+        snprintf(response, REPLY_SIZE, "Invalid expression format or operator.\n");
     }
+    return 0;
+}
 
-    switch (op) {
-        case '+': result = num1 + num2; break;
-        case '-': result = num1 - num2; break;
-        case '*': result = num1 * num2; break;
-        case '/':
-            if (num2 == 0) {
-                snprintf(response, 256, "Error: Division by zero.\n");
-                return -1;
-            }
-            result = num1 / num2;
-            break;
-        default:
-            snprintf(response, 256, "Invalid operator. Use +, -, *, or /.\n");
-            return -1;
+// Answers lines of one read, the replies are broadcast in one batch
+struct client_lines {
+    int client_socket;
+    reply_batch *batch;
+
+    int operator()(char *line, int length) {
+        if (reply_full(*batch)) {
+            broadcast_replies(batch->iov, batch->count);
+            batch->count = 0;
+        }
+        if (answer_line(client_socket, line, length, reply_slot(*batch)) != 0) return -1;
+        reply_commit(*batch);
+        return 0;
     }
+};
 
-    snprintf(response, 256, "%d %c %d = %d\n", num1, op, num2, result);
-    return 0;
+void remove_client(int client_socket) {
+    queue_remove(client_socket);
+}
+
+void add_client(int client_socket) {
+    queue_add(client_socket);
 }
 
 // Funkce pro obsluhu klienta ve vláknu
-void *client_handler(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
+void client_handler(int client_socket) {
+    // Klient čekající ve frontě poolu ještě nedostává broadcasty
+    add_client(client_socket);
+
+    char buffer[READ_CHUNK];
+    line_buffer pending;
+    line_init(pending);
+    reply_batch batch;
+    batch.count = 0;
+    client_lines handler = { client_socket, &batch };
 
-    char buffer[256], response[256];
     while (1) {
-        int length = read(client_socket, buffer, sizeof(buffer) - 1);
+        int length = read(client_socket, buffer, sizeof(buffer));
         if (length <= 0) break;
-
-        buffer[length] = '\0';
-        log_msg(LOG_INFO, "Received from client %d: %s", client_socket, buffer);
-
-        if (strncmp(buffer, STR_CLOSE, strlen(STR_CLOSE)) == 0) break;
-
-        if (buffer[length - 1] != '\n') {
-            snprintf(response, sizeof(response), "Error: Expression must end with newline '\\n'\n");
-        } else if (calculator(buffer, response) != 0) {
-            snprintf(response, sizeof(response), "Invalid expression format or operator.\n");
-        }
+        int result = frame_lines(pending, buffer, length, handler);
 
         // Broadcast výsledku všem klientům
-        broadcast_message(response);
+        broadcast_replies(batch.iov, batch.count);
+        batch.count = 0;
+        if (result != 0) break;
     }
 
     // Odebrání klienta ze seznamu
-    {
-        std::lock_guard<std::mutex> lock(client_mutex);
-        client_sockets.erase(std::remove(client_sockets.begin(), client_sockets.end(), client_socket), client_sockets.end());
-    }
+    remove_client(client_socket);
 
     close(client_socket);
-    return NULL;
+}
+
+// epoll engine: the results go to all clients of all loops as well, through
+// the same send queues
+int engine_message(engine_loop &loop, int conn_id, char *line, int len) {
+    if (answer_line(loop.slab[conn_id].fd, line, len, reply_slot(loop.batch)) != 0) return -1;
+    reply_commit(loop.batch);
+    return 0;
+}
+
+int engine_broadcast(engine_loop &loop, int conn_id, struct iovec *iov, int count) {
+    broadcast_replies(iov, count);
+    return 0;
 }
 
 void help(const char *program_name) {
-    printf("Usage: %s [-d] <port>\n", program_name);
+    printf("Usage: %s [-d] [-t threads] [--stack size] [--accept-queue count] [-e loops]\n"
+           "       [--cache size [--prefill low:high]]\n"
+           "       [--queue depth] [--overflow drop|disconnect|block] <port>\n", program_name);
     printf("Options:\n");
     printf("  -d  Enable debug mode\n");
+    printf("  -e  epoll engine with given number of event loops, 0 = one per core\n");
+    printf("      (default pool of client threads)\n");
+    printf("  -t  client threads, clients served at once (default %d)\n", POOL_THREADS);
+    printf("  --stack size        stack of client thread, K/M (default %dK)\n", POOL_STACK_SIZE >> 10);
+    printf("  --accept-queue n    accepted clients waiting for a thread (default %d)\n", POOL_CAPACITY);
+    printf("  --cache size        result cache of given size (K/M/G), \"stats\" shows its counters\n");
+    printf("  --prefill low:high  cache all \"a op b\" with a, b in the range at start\n");
+    printf("  --queue depth       messages queued per client (default %d)\n", QUEUE_DEPTH);
+    printf("  --overflow policy   full queue: drop (default), disconnect or block\n");
     printf("  -h  Show help\n");
     exit(0);
 }
@@ -118,9 +155,71 @@ int main(int argc, char **argv) {
     if (argc < 2) help(argv[0]);
 
     int server_port = 0;
+    int loop_count = -1;
+    size_t cache_size = 0;
+    int prefill_low = 0, prefill_high = -1;
+    int queue_depth = QUEUE_DEPTH;
+    overflow_policy policy = OVERFLOW_DROP;
+    int pool_threads = POOL_THREADS;
+    size_t stack_size = POOL_STACK_SIZE;
+    int accept_queue = POOL_CAPACITY;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0) g_debug = LOG_DEBUG;
         else if (strcmp(argv[i], "-h") == 0) help(argv[0]);
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            loop_count = atoi(argv[++i]);
+            if (loop_count < 0) {
+                log_msg(LOG_ERROR, "Invalid number of event loops.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_size = cache_parse_size(argv[++i]);
+            if (cache_size == 0) {
+                log_msg(LOG_ERROR, "Invalid cache size.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--prefill") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d:%d", &prefill_low, &prefill_high) != 2 || prefill_low > prefill_high) {
+                log_msg(LOG_ERROR, "Invalid prefill range.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc) {
+            queue_depth = atoi(argv[++i]);
+            if (queue_depth <= 0) {
+                log_msg(LOG_ERROR, "Invalid queue depth.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--overflow") == 0 && i + 1 < argc) {
+            if (queue_parse_policy(argv[++i], policy) != 0) {
+                log_msg(LOG_ERROR, "Invalid overflow policy.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            pool_threads = atoi(argv[++i]);
+            if (pool_threads <= 0) {
+                log_msg(LOG_ERROR, "Invalid number of threads.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc) {
+            stack_size = pool_parse_size(argv[++i]);
+            if (stack_size == 0) {
+                log_msg(LOG_ERROR, "Invalid stack size.");
+                help(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--accept-queue") == 0 && i + 1 < argc) {
+            accept_queue = atoi(argv[++i]);
+            if (accept_queue <= 0) {
+                log_msg(LOG_ERROR, "Invalid accept queue size.");
+                help(argv[0]);
+            }
+        }
         else server_port = atoi(argv[i]);
     }
 
@@ -129,6 +228,30 @@ int main(int argc, char **argv) {
         help(argv[0]);
     }
 
+    // Shared mapping has to exist before workers and children are forked
+    if (cache_size > 0) {
+        if (cache_init(cache_size) != 0) {
+            log_msg(LOG_ERROR, "Cache allocation failed.");
+            exit(1);
+        }
+        if (prefill_low <= prefill_high) {
+            size_t count = cache_prefill(prefill_low, prefill_high);
+            log_msg(LOG_INFO, "Cache prefilled with %zu expressions.", count);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (queues_init(queue_depth, policy) != 0) {
+        log_msg(LOG_ERROR, "Sender thread creation failed.");
+        exit(1);
+    }
+
+    if (loop_count >= 0) {
+        engine_callbacks callbacks = { engine_message, engine_broadcast, add_client, remove_client, false };
+        log_msg(LOG_INFO, "Server listening on port %d with epoll engine", server_port);
+        return engine_run(server_port, loop_count, callbacks) == 0 ? 0 : 1;
+    }
+
     int listening_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (listening_socket == -1) {
         log_msg(LOG_ERROR, "Socket creation failed.");
@@ -149,13 +272,19 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (listen(listening_socket, 10) < 0) {
+    if (listen(listening_socket, SOMAXCONN) < 0) {
         log_msg(LOG_ERROR, "Listen failed.");
         close(listening_socket);
         exit(1);
     }
 
-    log_msg(LOG_INFO, "Server listening on port %d", server_port);
+    static thread_pool pool;
+    if (pool_start(pool, pool_threads, stack_size, accept_queue, client_handler) != 0) {
+        log_msg(LOG_ERROR, "Could not create client threads.");
+        exit(1);
+    }
+
+    log_msg(LOG_INFO, "Server listening on port %d with %d client threads", server_port, pool_threads);
 
     while (1) {
         struct sockaddr_in client_address;
@@ -170,25 +299,8 @@ int main(int argc, char **argv) {
         log_msg(LOG_INFO, "Connected: %s:%d",
                 inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
 
-        // Přidání klienta do seznamu
-        {
-            std::lock_guard<std::mutex> lock(client_mutex);
-            client_sockets.push_back(client_socket);
-        }
-
-        // Vytvoření vlákna pro obsluhu klienta
-        pthread_t client_thread;
-        int *new_sock = (int *)malloc(sizeof(int));
-        *new_sock = client_socket;
-
-        if (pthread_create(&client_thread, NULL, client_handler, (void *)new_sock) < 0) {
-            log_msg(LOG_ERROR, "Could not create thread for client.");
-            close(client_socket);
-            continue;
-        }
-
-        // Odpojení hlavního vlákna od tohoto klientského vlákna
-        pthread_detach(client_thread);
+        // Klient čeká ve frontě na volné vlákno, do seznamu ho přidá až ono
+        pool_submit(pool, client_socket);
     }
 
     close(listening_socket);
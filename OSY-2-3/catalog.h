@@ -0,0 +1,377 @@
+// Content catalog of the image server.
+//
+// Catalog maps names to files: size, modification time, content hash
+// (FNV-1a) and the asset of the file, a handle given by the server. It is
+// built from a list of sources, e.g. a scan of the content root, and never
+// changed afterwards. Names are found by a perfect hash (hash and
+// displace, a fifth of the slots stays empty): the name hash selects a
+// bucket, the bucket's displacement selects the slot, so a lookup is one
+// hash, two array reads and one compare.
+//
+// Rebuild runs in the catalog thread and publishes the new catalog with an
+// atomic pointer, clients take no lock. Lookup holds the catalog only for
+// the lookup itself, the replaced catalog is freed CATALOG_GRACE_S later.
+// Content of unchanged files (path, size and mtime) is not hashed again.
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#define CATALOG_EMPTY 0xffffffffu
+#define CATALOG_GRACE_S 10
+#define CATALOG_MAX_DISPLACEMENT (1 << 20)
+#define CATALOG_READ_SIZE (64 << 10)
+
+struct catalog_source {
+    std::string name;
+    std::string path;
+};
+
+struct catalog_item {
+    uint32_t name_offset;   // in strings
+    uint32_t name_len;
+    uint32_t path_offset;
+    uint32_t path_len;
+    void *asset;
+    off_t size;
+    int64_t mtime;          // ns
+    uint64_t hash;          // of the content
+};
+
+struct catalog {
+    std::vector<catalog_item> items;
+    std::vector<uint32_t> displacement;     // per bucket
+    std::vector<uint32_t> slots;            // item index or CATALOG_EMPTY
+    std::string strings;                    // names and paths
+};
+
+// What a lookup copies out of the catalog
+struct catalog_hit {
+    void *asset;
+    off_t size;
+    uint64_t hash;
+};
+
+struct catalog_state {
+    std::atomic<const catalog *> current;
+    std::mutex mutex;                       // guards the rest
+    std::condition_variable wake;
+    bool requested;
+    std::vector<std::pair<const catalog *, time_t> > retired;
+};
+
+inline catalog_state &g_catalog() {
+    static catalog_state *state = new catalog_state;   // thread runs until exit
+    return *state;
+}
+
+//***************************************************************************
+// hashing
+
+inline uint64_t catalog_fnv(const void *data, size_t len, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+inline uint64_t catalog_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+inline uint32_t catalog_slot(uint64_t hash, uint32_t displacement, size_t slots) {
+    return catalog_mix(hash + displacement * 0x9e3779b97f4a7c15ull) % slots;
+}
+
+// FNV-1a of the file content, 0 when it can't be read
+inline uint64_t catalog_hash_file(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    std::vector<char> buffer(CATALOG_READ_SIZE);
+    uint64_t hash = catalog_fnv(NULL, 0);
+    ssize_t len;
+    while ((len = read(fd, buffer.data(), buffer.size())) > 0) hash = catalog_fnv(buffer.data(), len, hash);
+    close(fd);
+    return len < 0 ? 0 : hash;
+}
+
+//***************************************************************************
+// building
+
+// Regular files under root, named by their path relative to root. A file
+// is also named without its extension when no other file has that name.
+// Hidden files and directories are skipped.
+inline void catalog_scan(const std::string &root, std::vector<catalog_source> &sources) {
+    std::vector<std::string> dirs(1, "");
+    size_t first = sources.size();
+    while (!dirs.empty()) {
+        std::string relative = dirs.back();
+        dirs.pop_back();
+        std::string dir_path = root + "/" + relative;
+        DIR *dir = opendir(dir_path.c_str());
+        if (!dir) {
+            fprintf(stderr, "Failed to scan %s: %s\n", dir_path.c_str(), strerror(errno));
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            std::string name = relative + entry->d_name;
+            std::string path = root + "/" + name;
+
+            bool is_dir = entry->d_type == DT_DIR;
+            bool is_file = entry->d_type == DT_REG;
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                struct stat info;
+                if (stat(path.c_str(), &info) != 0) continue;
+                is_dir = S_ISDIR(info.st_mode) && entry->d_type == DT_UNKNOWN;   // no symlinked dirs
+                is_file = S_ISREG(info.st_mode);
+            }
+            if (is_dir) dirs.push_back(name + "/");
+            else if (is_file) sources.push_back(catalog_source{ name, path });
+        }
+        closedir(dir);
+    }
+
+    std::unordered_map<std::string, int> stems;
+    std::unordered_set<std::string> names;
+    std::vector<std::string> stem_of(sources.size() - first);
+    for (size_t i = first; i < sources.size(); i++) {
+        const std::string &name = sources[i].name;
+        names.insert(name);
+        size_t dot = name.rfind('.');
+        size_t slash = name.rfind('/');
+        if (dot == std::string::npos || dot == 0 || (slash != std::string::npos && dot <= slash + 1)) continue;
+        stem_of[i - first] = name.substr(0, dot);
+        stems[stem_of[i - first]]++;
+    }
+    size_t count = sources.size();
+    for (size_t i = first; i < count; i++) {
+        const std::string &stem = stem_of[i - first];
+        if (!stem.empty() && stems[stem] == 1 && !names.count(stem))
+            sources.push_back(catalog_source{ stem, sources[i].path });
+    }
+}
+
+// Places the items into slots, false when some bucket can't be placed
+inline bool catalog_place(catalog &built, const std::vector<uint64_t> &hashes, size_t slot_count) {
+    size_t count = hashes.size();
+    size_t bucket_count = count / 2 + 1;
+    std::vector<std::vector<uint32_t> > buckets(bucket_count);
+    for (size_t i = 0; i < count; i++) buckets[(hashes[i] >> 32) % bucket_count].push_back(i);
+
+    std::vector<uint32_t> order(bucket_count);
+    for (size_t i = 0; i < bucket_count; i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    built.displacement.assign(bucket_count, 0);
+    built.slots.assign(slot_count, CATALOG_EMPTY);
+    std::vector<uint32_t> taken;
+    for (uint32_t bucket : order) {
+        if (buckets[bucket].empty()) break;
+        uint32_t displacement = 0;
+        for (; displacement < CATALOG_MAX_DISPLACEMENT; displacement++) {
+            taken.clear();
+            bool free = true;
+            for (uint32_t item : buckets[bucket]) {
+                uint32_t slot = catalog_slot(hashes[item], displacement, slot_count);
+                if (built.slots[slot] != CATALOG_EMPTY ||
+                    std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                    free = false;
+                    break;
+                }
+                taken.push_back(slot);
+            }
+            if (free) break;
+        }
+        if (displacement == CATALOG_MAX_DISPLACEMENT) return false;
+
+        built.displacement[bucket] = displacement;
+        for (size_t i = 0; i < buckets[bucket].size(); i++) built.slots[taken[i]] = buckets[bucket][i];
+    }
+    return true;
+}
+
+// Builds catalog of the sources, asset() gives the handle of a file.
+// Files which can't be stat'ed and names repeated are left out.
+inline catalog *catalog_build(const std::vector<catalog_source> &sources, const catalog *previous,
+                              void *(*asset)(const std::string &path)) {
+    // Hashes of unchanged files are taken over
+    std::unordered_map<std::string, const catalog_item *> known;
+    if (previous) {
+        for (const catalog_item &item : previous->items)
+            known[previous->strings.substr(item.path_offset, item.path_len)] = &item;
+    }
+
+    catalog *built = new catalog;
+    std::vector<uint64_t> hashes;
+    std::unordered_set<uint64_t> seen;
+    for (const catalog_source &source : sources) {
+        uint64_t name_hash = catalog_fnv(source.name.data(), source.name.size());
+        if (!seen.insert(name_hash).second) {
+            fprintf(stderr, "Catalog: %s left out, hash of its name is taken\n", source.name.c_str());
+            continue;
+        }
+        struct stat info;
+        if (stat(source.path.c_str(), &info) != 0) {
+            fprintf(stderr, "Catalog: %s left out: %s\n", source.path.c_str(), strerror(errno));
+            continue;
+        }
+
+        catalog_item item;
+        item.name_offset = built->strings.size();
+        item.name_len = source.name.size();
+        built->strings += source.name;
+        item.path_offset = built->strings.size();
+        item.path_len = source.path.size();
+        built->strings += source.path;
+        item.size = info.st_size;
+        item.mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+
+        auto old = known.find(source.path);
+        if (old != known.end() && old->second->size == item.size && old->second->mtime == item.mtime) {
+            item.hash = old->second->hash;
+        } else {
+            item.hash = catalog_hash_file(source.path);
+        }
+        item.asset = asset(source.path);
+        built->items.push_back(item);
+        hashes.push_back(name_hash);
+    }
+
+    // A quarter of the slots free makes the displacements short
+    size_t slot_count = hashes.size() + hashes.size() / 4 + 1;
+    while (!catalog_place(*built, hashes, slot_count)) slot_count *= 2;
+    return built;
+}
+
+//***************************************************************************
+// lookup and rebuild
+
+inline bool catalog_find(const char *name, size_t len, catalog_hit &hit) {
+    const catalog *current = g_catalog().current.load(std::memory_order_acquire);
+    if (!current || current->items.empty()) return false;
+
+    uint64_t hash = catalog_fnv(name, len);
+    uint32_t displacement = current->displacement[(hash >> 32) % current->displacement.size()];
+    uint32_t index = current->slots[catalog_slot(hash, displacement, current->slots.size())];
+    if (index == CATALOG_EMPTY) return false;
+
+    const catalog_item &item = current->items[index];
+    if (item.name_len != len || memcmp(current->strings.data() + item.name_offset, name, len) != 0) return false;
+    hit.asset = item.asset;
+    hit.size = item.size;
+    hit.hash = item.hash;
+    return true;
+}
+
+// Catalog thread only, the replaced catalog waits for its grace period
+inline void catalog_publish(catalog *built) {
+    catalog_state &state = g_catalog();
+    const catalog *old = state.current.exchange(built, std::memory_order_acq_rel);
+    if (old) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.retired.push_back(std::make_pair(old, time(NULL)));
+    }
+}
+
+inline void catalog_free_retired() {
+    catalog_state &state = g_catalog();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    time_t now = time(NULL);
+    for (size_t i = 0; i < state.retired.size(); i++) {
+        if (now - state.retired[i].second < CATALOG_GRACE_S) continue;
+        delete state.retired[i].first;
+        state.retired.erase(state.retired.begin() + i--);
+    }
+}
+
+// Asks the catalog thread for a rebuild, not from a signal handler
+inline void catalog_request_rebuild() {
+    catalog_state &state = g_catalog();
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.requested = true;
+    }
+    state.wake.notify_one();
+}
+
+struct catalog_thread_arg {
+    void (*rebuild)();
+    int interval;
+};
+
+inline void *catalog_thread(void *arg) {
+    catalog_thread_arg args = *(catalog_thread_arg *)arg;
+    delete (catalog_thread_arg *)arg;
+    catalog_state &state = g_catalog();
+    typedef std::chrono::steady_clock clock;
+    clock::time_point next = clock::now() + std::chrono::seconds(args.interval);
+
+    while (1) {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        // Wakes also to free the retired catalogs
+        bool timed = args.interval > 0 || !state.retired.empty();
+        clock::time_point until = args.interval > 0 ? next : clock::now() + std::chrono::seconds(CATALOG_GRACE_S);
+        if (!state.retired.empty() && until > clock::now() + std::chrono::seconds(CATALOG_GRACE_S))
+            until = clock::now() + std::chrono::seconds(CATALOG_GRACE_S);
+        if (timed) state.wake.wait_until(lock, until, [&] { return state.requested; });
+        else state.wake.wait(lock, [&] { return state.requested; });
+
+        bool rebuild = state.requested || (args.interval > 0 && clock::now() >= next);
+        state.requested = false;
+        lock.unlock();
+
+        if (rebuild) {
+            args.rebuild();
+            next = clock::now() + std::chrono::seconds(args.interval);
+        }
+        catalog_free_retired();
+    }
+    return NULL;
+}
+
+// Builds the first catalog in this thread, then rebuilds every interval
+// seconds (0 = only when asked). Returns -1 when the thread can't start.
+inline int catalog_start(void (*rebuild)(), int interval) {
+    catalog_state &state = g_catalog();
+    state.current = NULL;
+    state.requested = false;
+    rebuild();
+
+    pthread_t thread;
+    catalog_thread_arg *arg = new catalog_thread_arg{ rebuild, interval };
+    if (pthread_create(&thread, NULL, catalog_thread, arg) != 0) {
+        delete arg;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,335 @@
+// Image cache of the image server.
+//
+// Every image name has an entry with its file. A loaded file is an
+// image_version: open fd (sendfile path) or whole file in memory (copy
+// path). Versions are shared_ptr, a client sending one keeps it alive, so
+// an evicted or replaced version is freed only after its last send.
+//
+// Files are loaded outside the cache lock; clients of the same image wait
+// for its load, others don't. Loaded versions together take at most the
+// budget bytes, the least recently used ones are evicted first.
+//
+// Entries can be added at any time, the first entry of a directory starts
+// watching it. One thread watches the directories with inotify. A file
+// written or moved in place of the old one is loaded again and swapped
+// for the old version, a removed one is dropped. Files are expected to be
+// replaced by rename; a file rewritten in place changes also under
+// sendfile() of a client in the middle of it.
+
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define CACHE_BUDGET (64 << 20)
+#define CACHE_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+struct image_version {
+    int fd;             // sendfile path, -1 = data
+    char *data;         // copy path
+    off_t size;
+
+    ~image_version() {
+        if (fd >= 0) close(fd);
+        free(data);
+    }
+};
+
+typedef std::shared_ptr<const image_version> image_ref;
+
+struct cache_entry {
+    std::string path;
+    image_ref current;                      // NULL = not loaded
+    bool loading;
+    bool stale;                             // file changed during the load
+    std::list<std::string>::iterator lru;   // valid while current is set
+};
+
+struct image_cache {
+    std::mutex mutex;
+    std::condition_variable loaded;
+    std::unordered_map<std::string, cache_entry> entries;
+    std::unordered_map<std::string, std::vector<std::string> > by_path;
+    std::list<std::string> lru;             // loaded names, recent first
+    size_t budget;
+    size_t used;                            // by current versions
+    bool copy;
+    int notify_fd;
+    std::unordered_map<int, std::string> dirs;  // watch -> directory
+    std::unordered_map<std::string, int> watched;
+
+    unsigned long long hits, loads, failures, evictions, reloads;
+};
+
+inline image_cache &g_image_cache() {
+    static image_cache *cache = new image_cache;    // watcher runs until exit
+    return *cache;
+}
+
+//***************************************************************************
+// versions
+
+// Reads or opens the file, NULL when it can't
+inline image_ref cache_load(const std::string &path, bool copy) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        fprintf(stderr, "Failed to open image %s: %s\n", path.c_str(), strerror(errno));
+        if (fd >= 0) close(fd);
+        return image_ref();
+    }
+
+    std::shared_ptr<image_version> version = std::make_shared<image_version>();
+    version->fd = fd;
+    version->data = NULL;
+    version->size = info.st_size;
+    if (!copy) {
+        // Pages are in the page cache before the first client
+        posix_fadvise(fd, 0, info.st_size, POSIX_FADV_WILLNEED);
+        return version;
+    }
+
+    version->data = (char *)malloc(info.st_size ? info.st_size : 1);
+    off_t done = 0;
+    while (version->data && done < info.st_size) {
+        ssize_t len = read(fd, version->data + done, info.st_size - done);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        done += len;
+    }
+    if (!version->data || done < info.st_size) {
+        fprintf(stderr, "Failed to read image %s\n", path.c_str());
+        return image_ref();
+    }
+    close(fd);
+    version->fd = -1;
+    return version;
+}
+
+// Caller holds the cache lock. Evicts least recently used versions over
+// the budget, the new one too when it alone is over.
+inline void cache_install(image_cache &cache, const std::string &name, cache_entry &entry, image_ref version) {
+    if (entry.current) {
+        cache.used -= entry.current->size;
+        cache.lru.erase(entry.lru);
+        entry.current.reset();
+    }
+    if (!version) return;
+
+    entry.current = version;
+    cache.used += version->size;
+    cache.lru.push_front(name);
+    entry.lru = cache.lru.begin();
+
+    while (cache.used > cache.budget && !cache.lru.empty()) {
+        cache_entry &victim = cache.entries[cache.lru.back()];
+        cache.used -= victim.current->size;
+        victim.current.reset();
+        cache.lru.pop_back();
+        cache.evictions++;
+    }
+}
+
+// Loads until the file didn't change during the load, then installs the
+// version. Caller has set entry.loading and holds the lock in lock.
+inline image_ref cache_fill(image_cache &cache, const std::string &name, cache_entry &entry,
+                            std::unique_lock<std::mutex> &lock) {
+    image_ref version;
+    do {
+        entry.stale = false;
+        std::string path = entry.path;
+        lock.unlock();
+        version = cache_load(path, cache.copy);
+        lock.lock();
+        cache.loads++;
+    } while (entry.stale);
+
+    if (!version) cache.failures++;
+    cache_install(cache, name, entry, version);
+    entry.loading = false;
+    cache.loaded.notify_all();
+    return version;
+}
+
+//***************************************************************************
+// cache
+
+// Caller holds the cache lock. Paths are kept as given, "dir/" + name of
+// an event is the path of the changed file.
+inline void cache_watch(image_cache &cache, const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    if (cache.watched.count(dir)) return;
+
+    int wd = inotify_add_watch(cache.notify_fd, dir.empty() ? "." : dir.c_str(), CACHE_EVENTS);
+    if (wd < 0) {
+        fprintf(stderr, "Failed to watch %s: %s\n", dir.empty() ? "." : dir.c_str(), strerror(errno));
+        return;
+    }
+    cache.dirs[wd] = dir;
+    cache.watched[dir] = wd;
+}
+
+// New entry, or the entry gets another file
+inline void cache_add(const std::string &name, const std::string &path) {
+    image_cache &cache = g_image_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(name);
+    if (it != cache.entries.end() && it->second.path == path) return;
+
+    cache_entry &entry = cache.entries[name];
+    if (it == cache.entries.end()) {
+        entry.loading = false;
+        entry.stale = false;
+    } else {
+        std::vector<std::string> &names = cache.by_path[entry.path];
+        for (size_t i = 0; i < names.size(); i++) {
+            if (names[i] == name) names.erase(names.begin() + i--);
+        }
+        if (entry.loading) entry.stale = true;
+        else cache_install(cache, name, entry, image_ref());
+    }
+    entry.path = path;
+    cache.by_path[path].push_back(name);
+    cache_watch(cache, path);
+}
+
+// Current version, loaded when needed. NULL when the name is unknown or
+// its file can't be loaded.
+inline image_ref cache_get(const std::string &name) {
+    image_cache &cache = g_image_cache();
+    std::unique_lock<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(name);
+    if (it == cache.entries.end()) return image_ref();
+    cache_entry &entry = it->second;
+
+    cache.loaded.wait(lock, [&] { return !entry.loading; });
+    if (entry.current) {
+        cache.hits++;
+        cache.lru.splice(cache.lru.begin(), cache.lru, entry.lru);
+        return entry.current;
+    }
+    entry.loading = true;
+    return cache_fill(cache, name, entry, lock);
+}
+
+// Current version if it is loaded, never waits for a load
+inline image_ref cache_peek(const std::string &name) {
+    image_cache &cache = g_image_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.entries.find(name);
+    return it != cache.entries.end() ? it->second.current : image_ref();
+}
+
+// File of the entry changed on disk
+inline void cache_changed(const std::string &name, bool removed) {
+    image_cache &cache = g_image_cache();
+    std::unique_lock<std::mutex> lock(cache.mutex);
+    cache_entry &entry = cache.entries[name];
+    if (entry.loading) {
+        entry.stale = true;
+        return;
+    }
+    if (!entry.current) return;     // next client loads the new file
+
+    cache.reloads++;
+    if (removed) {
+        cache_install(cache, name, entry, image_ref());
+        return;
+    }
+    entry.loading = true;
+    cache_fill(cache, name, entry, lock);
+}
+
+inline void *cache_watcher(void *) {
+    image_cache &cache = g_image_cache();
+    char events[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(8)));
+    while (1) {
+        ssize_t len = read(cache.notify_fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            perror("read inotify");
+            return NULL;
+        }
+
+        for (char *p = events; p < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0) continue;
+
+            std::vector<std::string> names;
+            {
+                std::lock_guard<std::mutex> lock(cache.mutex);
+                auto dir = cache.dirs.find(event->wd);
+                if (dir == cache.dirs.end()) continue;
+                auto found = cache.by_path.find(dir->second + event->name);
+                if (found != cache.by_path.end()) names = found->second;
+            }
+            bool removed = event->mask & (IN_MOVED_FROM | IN_DELETE);
+            for (const std::string &name : names) cache_changed(name, removed);
+        }
+    }
+}
+
+// Starts the watcher, budget in bytes
+inline int cache_start(size_t budget, bool copy) {
+    image_cache &cache = g_image_cache();
+    cache.budget = budget;
+    cache.used = 0;
+    cache.copy = copy;
+    cache.hits = cache.loads = cache.failures = cache.evictions = cache.reloads = 0;
+
+    cache.notify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache.notify_fd < 0) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cache_watcher, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+// Loads all images with threads at once, as far as the budget allows
+inline void cache_prewarm(int threads) {
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(g_image_cache().mutex);
+        for (auto &pair : g_image_cache().entries) names.push_back(pair.first);
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([&names, i, threads] {
+            for (size_t j = i; j < names.size(); j += threads) cache_get(names[j]);
+        });
+    }
+    for (std::thread &worker : workers) worker.join();
+}
+
+// "cache used U of B bytes, hits H loads L failures F evictions E reloads R\n"
+inline std::string cache_stats() {
+    image_cache &cache = g_image_cache();
+    char line[256];
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    snprintf(line, sizeof(line), "cache used %zu of %zu bytes, hits %llu loads %llu failures %llu evictions %llu reloads %llu\n",
+             cache.used, cache.budget, cache.hits, cache.loads, cache.failures, cache.evictions, cache.reloads);
+    return line;
+}
+
+#endif
@@ -0,0 +1,328 @@
+// Paced sending of the image server.
+//
+// One thread sends the images of all paced clients, so a slow client holds
+// a pace_stream instead of a thread. A stream sends one chunk (rate /
+// PACE_HZ bytes) and waits in a hierarchical timer wheel until its rate
+// allows the next one. The wheel has PACE_TICK_US ticks and three levels
+// of 256, 64 and 64 slots (256 ms, 16 s, 17 min); a stream due later than
+// the last level is put at its end and cascades again. Sockets are
+// non-blocking, a stream whose socket takes nothing waits for EPOLLOUT
+// instead of the wheel.
+//
+// Every stream has its own rate, 0 = as fast as the socket takes it. The
+// global rate is a token bucket shared by all streams; a stream finding it
+// empty waits until it is refilled, so it doesn't catch up later.
+
+#ifndef PACER_H
+#define PACER_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define PACE_TICK_US 1000           // wheel resolution
+#define PACE_HZ 20                  // chunks per second of a stream
+#define PACE_MIN_CHUNK 1024
+#define PACE_MAX_CHUNK (64 << 10)
+#define PACE_EVENTS 256
+
+#define WHEEL_LEVELS 3
+#define WHEEL_BITS0 8               // level 0 has 256 slots of one tick
+#define WHEEL_BITS 6                // levels 1 and 2 have 64 slots
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS0 + 2 * WHEEL_BITS))
+
+struct pace_stream {
+    int socket;                     // closed by the pacer
+    int file;                       // sendfile() source, -1 = data
+    const char *data;
+    off_t offset;
+    off_t size;
+    uint64_t rate;                  // bytes per second, 0 = no limit
+    void (*done)(pace_stream &stream, bool complete);
+    void *arg;
+
+    // pacer only
+    uint64_t due;                   // us, next chunk
+    uint64_t expires;               // tick
+    bool registered;                // socket is in the epoll set
+    pace_stream *next;              // in a wheel slot
+};
+
+struct pacer {
+    std::mutex mutex;               // guards added
+    std::vector<pace_stream *> added;
+    int epoll_fd;
+    int wake_fd;                    // eventfd, something added
+
+    // pacer thread only
+    pace_stream *wheel[WHEEL_LEVELS][1 << WHEEL_BITS0];
+    uint64_t now;                   // last processed tick
+    size_t waiting;                 // streams in the wheel
+    uint64_t total_rate;            // bytes per second, 0 = no limit
+    double tokens;
+    uint64_t refilled;              // us
+
+    std::atomic<uint64_t> active;
+    std::atomic<uint64_t> peak;
+};
+
+inline pacer &g_pacer() {
+    static pacer *instance = new pacer;     // thread runs until exit
+    return *instance;
+}
+
+inline uint64_t pace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//***************************************************************************
+// timer wheel
+
+inline void wheel_insert(pacer &p, pace_stream *stream) {
+    if (stream->expires < p.now) stream->expires = p.now;
+    if (stream->expires - p.now >= WHEEL_SPAN) stream->expires = p.now + WHEEL_SPAN - 1;
+
+    uint64_t delta = stream->expires - p.now;
+    int level, slot;
+    if (delta < (1 << WHEEL_BITS0)) {
+        level = 0;
+        slot = stream->expires & ((1 << WHEEL_BITS0) - 1);
+    } else if (delta < (1 << (WHEEL_BITS0 + WHEEL_BITS))) {
+        level = 1;
+        slot = (stream->expires >> WHEEL_BITS0) & ((1 << WHEEL_BITS) - 1);
+    } else {
+        level = 2;
+        slot = (stream->expires >> (WHEEL_BITS0 + WHEEL_BITS)) & ((1 << WHEEL_BITS) - 1);
+    }
+    stream->next = p.wheel[level][slot];
+    p.wheel[level][slot] = stream;
+}
+
+// Streams of a higher level slot move closer, at most to level 0
+inline void wheel_cascade(pacer &p, int level, int slot) {
+    pace_stream *stream = p.wheel[level][slot];
+    p.wheel[level][slot] = NULL;
+    while (stream) {
+        pace_stream *next = stream->next;
+        wheel_insert(p, stream);
+        stream = next;
+    }
+}
+
+// Processes ticks up to tick, expired streams are appended to due
+inline void wheel_advance(pacer &p, uint64_t tick, std::vector<pace_stream *> &due) {
+    if (p.waiting == 0) {
+        if (tick > p.now) p.now = tick;
+        return;
+    }
+    while (p.now < tick) {
+        p.now++;
+        if ((p.now & ((1 << WHEEL_BITS0) - 1)) == 0) {
+            uint64_t upper = p.now >> WHEEL_BITS0;
+            if ((upper & ((1 << WHEEL_BITS) - 1)) == 0)
+                wheel_cascade(p, 2, (upper >> WHEEL_BITS) & ((1 << WHEEL_BITS) - 1));
+            wheel_cascade(p, 1, upper & ((1 << WHEEL_BITS) - 1));
+        }
+
+        int slot = p.now & ((1 << WHEEL_BITS0) - 1);
+        pace_stream *stream = p.wheel[0][slot];
+        p.wheel[0][slot] = NULL;
+        for (; stream; stream = stream->next) {
+            due.push_back(stream);
+            p.waiting--;
+        }
+    }
+}
+
+// Milliseconds until the next expiry or cascade, -1 when the wheel is empty
+inline int wheel_timeout(pacer &p, uint64_t now_us) {
+    if (p.waiting == 0) return -1;
+    uint64_t tick = p.now + 1;
+    for (; tick < p.now + (1 << WHEEL_BITS0); tick++) {
+        if ((tick & ((1 << WHEEL_BITS0) - 1)) == 0) break;
+        if (p.wheel[0][tick & ((1 << WHEEL_BITS0) - 1)]) break;
+    }
+    uint64_t at = tick * PACE_TICK_US;
+    return at > now_us ? (at - now_us + 999) / 1000 : 0;
+}
+
+//***************************************************************************
+// streams
+
+inline void pace_finish(pacer &p, pace_stream *stream, bool complete) {
+    stream->done(*stream, complete);
+    close(stream->socket);
+    delete stream;
+    p.active--;
+}
+
+inline void pace_schedule(pacer &p, pace_stream *stream) {
+    stream->expires = (stream->due + PACE_TICK_US - 1) / PACE_TICK_US;
+    if (stream->expires <= p.now) stream->expires = p.now + 1;
+    wheel_insert(p, stream);
+    p.waiting++;
+}
+
+// Waits for room in the socket, -1 when it can't
+inline int pace_arm(pacer &p, pace_stream *stream) {
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.ptr = stream;
+    int op = stream->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(p.epoll_fd, op, stream->socket, &event) != 0) return -1;
+    stream->registered = true;
+    return 0;
+}
+
+// Sends what the rates allow now, then the stream waits in the wheel or for
+// the socket, or it is finished
+inline void pace_run(pacer &p, pace_stream *stream, uint64_t now) {
+    while (stream->offset < stream->size) {
+        if (stream->due > now) {
+            pace_schedule(p, stream);
+            return;
+        }
+
+        if (p.total_rate) {
+            double burst = p.total_rate / PACE_HZ > PACE_MIN_CHUNK ? p.total_rate / PACE_HZ : PACE_MIN_CHUNK;
+            if (now > p.refilled) {
+                p.tokens += (double)(now - p.refilled) * p.total_rate / 1e6;
+                if (p.tokens > burst) p.tokens = burst;
+                p.refilled = now;
+            }
+            if (p.tokens <= 0) {
+                stream->due = now + (uint64_t)((1 - p.tokens) * 1e6 / p.total_rate);
+                continue;
+            }
+        }
+
+        size_t chunk = stream->rate ? stream->rate / PACE_HZ : PACE_MAX_CHUNK;
+        if (chunk < PACE_MIN_CHUNK) chunk = PACE_MIN_CHUNK;
+        if (chunk > PACE_MAX_CHUNK) chunk = PACE_MAX_CHUNK;
+        if ((off_t)chunk > stream->size - stream->offset) chunk = stream->size - stream->offset;
+
+        ssize_t sent;
+        if (stream->file >= 0) {
+            sent = sendfile(stream->socket, stream->file, &stream->offset, chunk);
+        } else {
+            sent = send(stream->socket, stream->data + stream->offset, chunk, MSG_NOSIGNAL);
+            if (sent > 0) stream->offset += sent;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (pace_arm(p, stream) != 0) break;
+            return;
+        }
+        if (sent <= 0) break;
+
+        if (p.total_rate) p.tokens -= sent;
+        if (stream->rate) stream->due += (uint64_t)sent * 1000000 / stream->rate;
+    }
+    pace_finish(p, stream, stream->offset >= stream->size);
+}
+
+inline void pace_begin(pacer &p, pace_stream *stream, uint64_t now) {
+    int flags = fcntl(stream->socket, F_GETFL);
+    fcntl(stream->socket, F_SETFL, flags | O_NONBLOCK);
+    stream->due = now;
+    stream->registered = false;
+
+    uint64_t active = ++p.active;
+    if (active > p.peak) p.peak = active;
+    pace_run(p, stream, now);
+}
+
+inline void *pacer_thread(void *) {
+    pacer &p = g_pacer();
+    struct epoll_event events[PACE_EVENTS];
+    std::vector<pace_stream *> due, added;
+
+    while (1) {
+        int count = epoll_wait(p.epoll_fd, events, PACE_EVENTS, wheel_timeout(p, pace_now()));
+        uint64_t now = pace_now();
+        for (int i = 0; i < count; i++) {
+            pace_stream *stream = (pace_stream *)events[i].data.ptr;
+            if (stream == NULL) {
+                uint64_t value;
+                while (read(p.wake_fd, &value, sizeof(value)) > 0) {}
+                {
+                    std::lock_guard<std::mutex> lock(p.mutex);
+                    added.swap(p.added);
+                }
+                for (pace_stream *stream : added) pace_begin(p, stream, now);
+                added.clear();
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                pace_finish(p, stream, false);
+                continue;
+            }
+            // Socket had no room, the time waiting for it is not made up
+            if (stream->due < now) stream->due = now;
+            pace_run(p, stream, now);
+        }
+
+        wheel_advance(p, now / PACE_TICK_US, due);
+        for (pace_stream *stream : due) pace_run(p, stream, now);
+        due.clear();
+    }
+    return NULL;
+}
+
+// Starts the pacer thread, total_rate 0 = no global limit. Returns -1 on
+// failure.
+inline int pacer_start(uint64_t total_rate) {
+    pacer &p = g_pacer();
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < (1 << WHEEL_BITS0); slot++) p.wheel[level][slot] = NULL;
+    }
+    p.now = pace_now() / PACE_TICK_US;
+    p.waiting = 0;
+    p.total_rate = total_rate;
+    p.tokens = 0;
+    p.refilled = pace_now();
+    p.active = 0;
+    p.peak = 0;
+
+    p.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    p.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p.epoll_fd < 0 || p.wake_fd < 0) return -1;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(p.epoll_fd, EPOLL_CTL_ADD, p.wake_fd, &event) != 0) return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pacer_thread, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+// Hands the stream over, from now on the socket belongs to the pacer.
+// done() is called from the pacer thread before the socket is closed.
+inline void pacer_add(pace_stream *stream) {
+    pacer &p = g_pacer();
+    {
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.added.push_back(stream);
+    }
+    uint64_t one = 1;
+    ssize_t written = write(p.wake_fd, &one, sizeof(one));
+    (void)written;
+}
+
+#endif
@@ -1,7 +1,7 @@
 #include <unordered_map>
 #include <string>
 #include <mutex>
-#include <semaphore.h>
+#include <deque>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -11,16 +11,65 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <errno.h>
+#include <atomic>
+#include "../OSY-2-1-prip/thread_pool.h"
+#include "pacer.h"
+#include "image_cache.h"
+#include "catalog.h"
 
 #define BUFFER_SIZE 1024
+#define SEND_CHUNK (64 << 10)       // sendfile() chunk
+#define PACE_US 10000000            // one image takes this long by default
 
+struct waiting_client {
+    int socket;
+    uint64_t since;     // us
+};
+
+// Clients of one image. Loaded image is never changed, so any number of
+// clients send it at once. Over the --readers limit clients wait in FIFO
+// order and the next one takes the place of a client which ended.
+struct image_gate {
+    std::mutex mutex;
+    std::deque<waiting_client> waiting;
+    int active;
+    unsigned long long clients;
+    unsigned long long waited;          // clients which had to wait
+    uint64_t wait_total;                // us
+    uint64_t wait_max;
+};
+
+// One per file, names of the file in the catalog lead here. Content of
+// the image is in the cache under the path.
 struct ImageData {
-    sem_t semaphore;
-    char *img_data;
-    int size;
+    std::string name;   // path
+    image_gate gate;
+};
+
+// Image sent by the pacer, the version stays loaded until the end
+struct paced_image {
+    ImageData *image;
+    image_ref version;
 };
 
-// Mapa pro obdobi
+bool g_copy = false;    // former malloc + write() path
+bool g_pace = true;
+uint64_t g_rate = 0;    // bytes per second of one client, 0 = image in PACE_US
+uint64_t g_total_rate = 0;
+int g_readers = 0;      // clients of one image at once, 0 = no limit
+std::string g_root;     // content root, empty = the seasons below
+volatile sig_atomic_t g_stop = 0;
+volatile sig_atomic_t g_rescan = 0;
+std::atomic<unsigned long long> g_bytes_sent(0);
+std::atomic<unsigned long long> g_images_sent(0);
+
+// Mapa pro obdobi, catalog without --root
 std::unordered_map<std::string, std::string> files = {
     {"jaro", "jaro.jpg"},
     {"leto", "leto.png"},
@@ -29,101 +78,374 @@ std::unordered_map<std::string, std::string> files = {
     {"error", "error.png"}
 };
 
-std::unordered_map<std::string, ImageData> images;
-std::mutex images_mutex;
+// By path. Images are never freed, the catalog and clients point to them;
+// a file removed from the catalog keeps its ImageData.
+std::unordered_map<std::string, ImageData *> images;
+std::mutex images_mutex;    // clients don't take it, catalog finds ImageData
 
-void load_image(const char* filename, ImageData &image_data) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Failed to open image");
-        exit(EXIT_FAILURE);
-    }
-    
-    fseek(file, 0, SEEK_END);
-    image_data.size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    image_data.img_data = (char*) malloc(image_data.size);
-    if (!image_data.img_data) {
-        perror("Memory error");
-        exit(EXIT_FAILURE);
+// Asset of a file for the catalog
+void *image_asset(const std::string &path) {
+    std::lock_guard<std::mutex> lock(images_mutex);
+    ImageData *&img_data = images[path];
+    if (!img_data) {
+        img_data = new ImageData;
+        img_data->name = path;
+        img_data->gate.active = 0;
+        img_data->gate.clients = 0;
+        img_data->gate.waited = 0;
+        img_data->gate.wait_total = 0;
+        img_data->gate.wait_max = 0;
+        cache_add(path, path);
     }
-    
-    fread(image_data.img_data, 1, image_data.size, file);
-    fclose(file);
+    return img_data;
 }
 
-void init_images() {
-    for (const auto &pair : files) {
-        ImageData &img_data = images[pair.first];
-        sem_init(&img_data.semaphore, 0, 1);
-        img_data.img_data = nullptr;
-        img_data.size = 0;
+// Catalog thread: scans the content root again
+void rebuild_catalog() {
+    std::vector<catalog_source> sources;
+    if (g_root.empty()) {
+        for (const auto &pair : files) sources.push_back(catalog_source{ pair.first, pair.second });
+    } else {
+        catalog_scan(g_root, sources);
     }
+    const catalog *previous = g_catalog().current.load();
+    catalog *built = catalog_build(sources, previous, image_asset);
+    catalog_publish(built);
+    printf("Catalog of %zu names\n", built->items.size());
+    fflush(stdout);
 }
 
-void send_image(int client_socket, ImageData &image) {
-    int sent = 0;
-    int delay = 10000000 / (image.size / BUFFER_SIZE);
-
+// Unpaced sends, the client thread sends the whole image
+void send_image(int client_socket, const image_version &image) {
+    off_t sent = 0;
     while (sent < image.size) {
         int chunk = (image.size - sent > BUFFER_SIZE) ? BUFFER_SIZE : (image.size - sent);
-        write(client_socket, image.img_data + sent, chunk);
-        sent += chunk;
-        usleep(delay);
+        ssize_t written = write(client_socket, image.data + sent, chunk);
+        if (written <= 0) break;
+        sent += written;
+        g_bytes_sent += written;
     }
 }
 
-void *client_handler(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
-    
+// Zero-copy: sendfile() in SEND_CHUNK pieces, corked so that only full
+// segments leave until the tail is uncorked
+void send_image_file(int client_socket, const image_version &image) {
+    int cork = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    off_t offset = 0;
+    while (offset < image.size) {
+        size_t chunk = image.size - offset > SEND_CHUNK ? SEND_CHUNK : image.size - offset;
+        ssize_t sent = sendfile(client_socket, image.fd, &offset, chunk);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        g_bytes_sent += sent;
+    }
+
+    cork = 0;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+//***************************************************************************
+// clients of an image
+
+// True when the client can start now, otherwise it waits in the queue
+bool gate_enter(ImageData &image, int client_socket) {
+    image_gate &gate = image.gate;
+    std::lock_guard<std::mutex> lock(gate.mutex);
+    gate.clients++;
+    if (g_readers == 0 || (gate.active < g_readers && gate.waiting.empty())) {
+        gate.active++;
+        return true;
+    }
+    gate.waiting.push_back(waiting_client{ client_socket, pace_now() });
+    return false;
+}
+
+// Client of the image ended. Returns socket of the next waiting client,
+// which takes its place, or -1.
+int gate_leave(ImageData &image) {
+    image_gate &gate = image.gate;
+    std::lock_guard<std::mutex> lock(gate.mutex);
+    if (gate.waiting.empty()) {
+        gate.active--;
+        return -1;
+    }
+    waiting_client next = gate.waiting.front();
+    gate.waiting.pop_front();
+
+    uint64_t wait = pace_now() - next.since;
+    gate.waited++;
+    gate.wait_total += wait;
+    if (wait > gate.wait_max) gate.wait_max = wait;
+    return next.socket;
+}
+
+// Line per image with clients:
+// "jaro.jpg clients C sending S waiting W waited N avg A ms max M ms"
+std::string image_stats() {
+    std::string stats;
+    std::lock_guard<std::mutex> images_lock(images_mutex);
+    for (auto &pair : images) {
+        image_gate &gate = pair.second->gate;
+        char line[PATH_MAX + 256];
+        std::lock_guard<std::mutex> lock(gate.mutex);
+        if (gate.clients == 0) continue;
+        snprintf(line, sizeof(line), "%s clients %llu sending %d waiting %zu waited %llu avg %.1f ms max %.1f ms\n",
+                 pair.first.c_str(), gate.clients, gate.active, gate.waiting.size(), gate.waited,
+                 gate.waited ? gate.wait_total / 1000.0 / gate.waited : 0.0, gate.wait_max / 1000.0);
+        stats += line;
+    }
+    return stats + cache_stats();
+}
+
+// Version for a client which waited, the current one when it is loaded.
+// Waiting client must not wait for a load in the thread passing it on.
+image_ref next_version(ImageData &image, const image_ref &previous) {
+    image_ref version = cache_peek(image.name);
+    return version ? version : previous;
+}
+
+void paced_send(int client_socket, ImageData &image, const image_ref &version);
+
+// Called by the pacer when the paced image is sent or the client is gone
+void paced_done(pace_stream &stream, bool complete) {
+    paced_image *paced = (paced_image *)stream.arg;
+    g_bytes_sent += stream.offset;
+    if (complete) g_images_sent++;
+
+    int next = gate_leave(*paced->image);
+    if (next >= 0) paced_send(next, *paced->image, next_version(*paced->image, paced->version));
+    delete paced;
+}
+
+// Pacer sends the image, the socket goes with it
+void paced_send(int client_socket, ImageData &image, const image_ref &version) {
+    pace_stream *stream = new pace_stream;
+    stream->socket = client_socket;
+    stream->file = version->fd;
+    stream->data = version->data;
+    stream->offset = 0;
+    stream->size = version->size;
+    stream->rate = 0;
+    if (g_pace) {
+        uint64_t rate = (uint64_t)version->size * 1000000 / PACE_US;
+        stream->rate = g_rate ? g_rate : rate > 0 ? rate : 1;
+    }
+    stream->done = paced_done;
+    stream->arg = new paced_image{ &image, version };
+    pacer_add(stream);
+}
+
+// Argument of the request after the command, without the line end
+std::string request_arg(const std::string &request, size_t start) {
+    size_t end = request.find_first_of("\r\n", start);
+    return request.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+void client_handler(int client_socket) {
     char buffer[BUFFER_SIZE];
     int len = read(client_socket, buffer, sizeof(buffer) - 1);
     if (len <= 0) {
         close(client_socket);
-        return NULL;
+        return;
     }
     
     buffer[len] = '\0';
     std::string request(buffer);
-    std::string season = request.substr(5, request.size() - 6);
-
-    ImageData *image_data;
-    std::string filename;
-    {
-        std::lock_guard<std::mutex> lock(images_mutex);
-        if (images.find(season) != images.end()) {
-            image_data = &images[season];
-            filename = files[season];  // map
+    if (request.compare(0, 6, "#stats") == 0) {
+        std::string stats = image_stats();
+        ssize_t written = write(client_socket, stats.data(), stats.size());
+        (void)written;
+        close(client_socket);
+        return;
+    }
+    if (request.compare(0, 6, "#info ") == 0) {
+        // "name size S hash H\n", the hash is FNV-1a of the content
+        std::string name = request_arg(request, 6);
+        catalog_hit hit;
+        char info[64];
+        if (catalog_find(name.data(), name.size(), hit)) {
+            snprintf(info, sizeof(info), " size %lld hash %016llx\n", (long long)hit.size, (unsigned long long)hit.hash);
         } else {
-            image_data = &images["error"];
-            filename = files["error"];
+            snprintf(info, sizeof(info), " unknown\n");
         }
+        std::string reply = name + info;
+        ssize_t written = write(client_socket, reply.data(), reply.size());
+        (void)written;
+        close(client_socket);
+        return;
+    }
+    if (request.compare(0, 5, "#img ") != 0) {
+        close(client_socket);
+        return;
+    }
+    std::string season = request_arg(request, 5);
 
-        if (image_data->img_data == nullptr) {
-            load_image(filename.c_str(), *image_data); 
-        }
+    // Unknown season or missing file gets the error image
+    catalog_hit hit;
+    image_ref version;
+    if (catalog_find(season.data(), season.size(), hit)) version = cache_get(((ImageData *)hit.asset)->name);
+    if (!version && catalog_find("error", 5, hit)) version = cache_get(((ImageData *)hit.asset)->name);
+    if (!version) {
+        close(client_socket);
+        return;
     }
+    ImageData *image_data = (ImageData *)hit.asset;
 
-    // Lock the image with the semaphore
-    sem_wait(&image_data->semaphore);
-    send_image(client_socket, *image_data);
-    sem_post(&image_data->semaphore);
+    if (!gate_enter(*image_data, client_socket)) return;
+    if (g_pace || g_total_rate) {
+        paced_send(client_socket, *image_data, version);
+        return;
+    }
 
-    close(client_socket);
-    return NULL;
+    // This thread sends also to the clients which waited for it
+    while (client_socket >= 0) {
+        if (g_copy) send_image(client_socket, *version);
+        else send_image_file(client_socket, *version);
+        g_images_sent++;
+        close(client_socket);
+        client_socket = gate_leave(*image_data);
+        if (client_socket >= 0) version = next_version(*image_data, version);
+    }
+}
+
+void stop_handler(int) {
+    g_stop = 1;
+}
+
+void rescan_handler(int) {
+    g_rescan = 1;
+}
+
+// CPU time of the whole process per GB sent
+void print_report() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    double gb = g_bytes_sent / 1e9;
+    printf("%s path: %llu images, %.1f MB, CPU user %.2f s sys %.2f s, %.2f CPU s per GB\n",
+           g_copy ? "copy" : "zero-copy", g_images_sent.load(), g_bytes_sent / 1e6, user, sys,
+           gb > 0 ? (user + sys) / gb : 0.0);
+    if (g_pace || g_total_rate)
+        printf("paced clients: %llu at most at once\n", (unsigned long long)g_pacer().peak.load());
+    printf("%s", image_stats().c_str());
+}
+
+void usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-t threads] [--stack size] [--accept-queue count] [--copy]\n"
+                    "          [--root dir] [--rescan seconds] [--cache size] [--prewarm threads] [--readers count] [--rate bytes] [--total-rate bytes] [--no-pace] <port>\n", program_name);
+    fprintf(stderr, "  -t              client threads, clients served at once (default %d)\n", POOL_THREADS);
+    fprintf(stderr, "  --stack size    stack of client thread, K/M (default %dK)\n", POOL_STACK_SIZE >> 10);
+    fprintf(stderr, "  --accept-queue  accepted clients waiting for a thread (default %d)\n", POOL_CAPACITY);
+    fprintf(stderr, "  --copy          read images into memory and write() them (default sendfile)\n");
+    fprintf(stderr, "  --root          serve all files under dir, named by relative path and without extension\n");
+    fprintf(stderr, "                  when unique, unknown names get \"error\" (default the four seasons)\n");
+    fprintf(stderr, "  --rescan        scan the root again every seconds, SIGHUP scans at once (default 0 = SIGHUP only)\n");
+    fprintf(stderr, "  --cache         bytes of loaded images, K/M (default %dM)\n", CACHE_BUDGET >> 20);
+    fprintf(stderr, "  --prewarm       load all images at start with threads at once (default on first client)\n");
+    fprintf(stderr, "  --readers       clients of one image at once, others wait in order (default no limit)\n");
+    fprintf(stderr, "  --rate          bytes per second to one client, K/M (default image in %d s)\n", PACE_US / 1000000);
+    fprintf(stderr, "  --total-rate    bytes per second to all clients together, K/M (default no limit)\n");
+    fprintf(stderr, "  --no-pace       no rate per client, without --total-rate client threads send the image\n");
+    fprintf(stderr, "  SIGINT/SIGTERM prints CPU time per GB sent, request #stats the waits per image,\n");
+    fprintf(stderr, "  request #info name the size and content hash\n");
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    int server_port = 0;
+    int pool_threads = POOL_THREADS;
+    size_t stack_size = POOL_STACK_SIZE;
+    int accept_queue = POOL_CAPACITY;
+    size_t cache_budget = CACHE_BUDGET;
+    int prewarm = 0;
+    int rescan = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) pool_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc) stack_size = pool_parse_size(argv[++i]);
+        else if (strcmp(argv[i], "--accept-queue") == 0 && i + 1 < argc) accept_queue = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--copy") == 0) g_copy = true;
+        else if (strcmp(argv[i], "--no-pace") == 0) g_pace = false;
+        else if (strcmp(argv[i], "--root") == 0 && i + 1 < argc) g_root = argv[++i];
+        else if (strcmp(argv[i], "--rescan") == 0 && i + 1 < argc) {
+            rescan = atoi(argv[++i]);
+            if (rescan <= 0) usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_budget = pool_parse_size(argv[++i]);
+            if (cache_budget == 0) usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "--prewarm") == 0 && i + 1 < argc) {
+            prewarm = atoi(argv[++i]);
+            if (prewarm <= 0) usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+            g_readers = atoi(argv[++i]);
+            if (g_readers <= 0) usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            g_rate = pool_parse_size(argv[++i]);
+            if (g_rate == 0) usage(argv[0]);
+        }
+        else if (strcmp(argv[i], "--total-rate") == 0 && i + 1 < argc) {
+            g_total_rate = pool_parse_size(argv[++i]);
+            if (g_total_rate == 0) usage(argv[0]);
+        }
+        else server_port = atoi(argv[i]);
+    }
+    if (server_port <= 0 || pool_threads <= 0 || stack_size == 0 || accept_queue <= 0) usage(argv[0]);
+
+    // Client leaving in the middle of an image must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // No SA_RESTART, accept() returns on the signal
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = rescan_handler;
+    sigaction(SIGHUP, &action, NULL);
+
+    // Client threads don't take the signals, accept() of this one has to
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (cache_start(cache_budget, g_copy) != 0) {
+        perror("Could not watch image files");
         exit(EXIT_FAILURE);
     }
+    if (catalog_start(rebuild_catalog, rescan) != 0) {
+        perror("Could not start catalog thread");
+        exit(EXIT_FAILURE);
+    }
+    if (prewarm > 0) cache_prewarm(prewarm);
 
-    init_images();
+    // Paced clients hold just a socket, allow as many as the hard limit
+    struct rlimit files_limit;
+    if (getrlimit(RLIMIT_NOFILE, &files_limit) == 0) {
+        files_limit.rlim_cur = files_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files_limit);
+    }
+    if ((g_pace || g_total_rate) && pacer_start(g_total_rate) != 0) {
+        perror("Could not start pacer");
+        exit(EXIT_FAILURE);
+    }
+
+    // Threads wait on it until the very exit, so it is never destroyed
+    thread_pool &pool = *new thread_pool;
+    if (pool_start(pool, pool_threads, stack_size, accept_queue, client_handler) != 0) {
+        perror("Could not create client threads");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
 
-    int server_port = atoi(argv[1]);
     int listening_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (listening_socket == -1) {
         perror("Socket creation failed");
@@ -144,7 +466,7 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(listening_socket, 10) < 0) {
+    if (listen(listening_socket, SOMAXCONN) < 0) {
         perror("Listen failed");
         close(listening_socket);
         exit(EXIT_FAILURE);
@@ -152,30 +474,24 @@ int main(int argc, char **argv) {
 
     printf("Server listening on port %d\n", server_port);
 
-    while (1) {
+    while (!g_stop) {
         struct sockaddr_in client_address;
         socklen_t client_len = sizeof(client_address);
         int client_socket = accept(listening_socket, (struct sockaddr *)&client_address, &client_len);
 
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
+        if (g_rescan) {
+            g_rescan = 0;
+            catalog_request_rebuild();
         }
-
-        int *new_sock = (int *)malloc(sizeof(int));
-        *new_sock = client_socket;
-
-        pthread_t client_thread;
-        if (pthread_create(&client_thread, NULL, client_handler, (void *)new_sock) < 0) {
-            perror("Could not create thread for client");
-            close(client_socket);
-            free(new_sock);
+        if (client_socket < 0) {
+            if (errno != EINTR) perror("Accept failed");
             continue;
         }
 
-        pthread_detach(client_thread);
+        pool_submit(pool, client_socket);
     }
 
+    print_report();
     close(listening_socket);
     return 0;
 }
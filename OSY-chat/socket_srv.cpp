@@ -15,6 +15,8 @@
 #include <poll.h>
 #include <ctime>
 #include <sstream>
+#include "../OSY-2-1-prip/thread_pool.h"
+#include "../OSY-2-1-prip/async_log.h"
 
 #define STR_CLOSE "close"
 #define LOG_ERROR 0
@@ -44,24 +46,18 @@ void broadcast_message(const std::string& sender, std::string message, bool incl
 
 
 
+// Record is formatted and written by the writer thread of async_log.h
 void log_msg(int log_level, const char *format, ...) {
-    const char *prefix[] = { "ERR: ", "INF: ", "DEB: " };
     if (log_level > g_debug) return;
 
-    char buffer[1024];
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    log_record(log_level, format, args);
     va_end(args);
-
-    fprintf(log_level == LOG_ERROR ? stderr : stdout, "%s%s\n", prefix[log_level], buffer);
 }
 
 // Funkce pro obsluhu klienta
-void *client_handler(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
-
+void client_handler(int client_socket) {
     char buffer[256];
     std::string client_nick;
     bool nick_set = false;
@@ -107,12 +103,14 @@ void *client_handler(void *arg) {
 
     write(pipe_fd[1], &client_socket, sizeof(client_socket));
     close(client_socket);
-    return NULL;
 }
 
 
 void help(const char *program_name) {
-    printf("Usage: %s [-d] <port>\n", program_name);
+    printf("Usage: %s [-d] [-t threads] [--stack size] [--accept-queue count] <port>\n", program_name);
+    printf("  -t              client threads, clients connected at once (default %d)\n", POOL_THREADS);
+    printf("  --stack size    stack of client thread, K/M (default %dK)\n", POOL_STACK_SIZE >> 10);
+    printf("  --accept-queue  accepted clients waiting for a thread (default %d)\n", POOL_CAPACITY);
     exit(0);
 }
 
@@ -120,10 +118,17 @@ int main(int argc, char **argv) {
     if (argc < 2) help(argv[0]);
 
     int server_port = 0;
+    int pool_threads = POOL_THREADS;
+    size_t stack_size = POOL_STACK_SIZE;
+    int accept_queue = POOL_CAPACITY;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0) g_debug = LOG_DEBUG;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) pool_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc) stack_size = pool_parse_size(argv[++i]);
+        else if (strcmp(argv[i], "--accept-queue") == 0 && i + 1 < argc) accept_queue = atoi(argv[++i]);
         else server_port = atoi(argv[i]);
     }
+    if (pool_threads <= 0 || stack_size == 0 || accept_queue <= 0) help(argv[0]);
 
     if (pipe(pipe_fd) < 0) {
         perror("Pipe creation failed");
@@ -150,13 +155,19 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (listen(listening_socket, 10) < 0) {
+    if (listen(listening_socket, SOMAXCONN) < 0) {
         log_msg(LOG_ERROR, "Listen failed.");
         close(listening_socket);
         exit(1);
     }
 
-    log_msg(LOG_INFO, "Server listening on port %d", server_port);
+    static thread_pool pool;
+    if (pool_start(pool, pool_threads, stack_size, accept_queue, client_handler) != 0) {
+        log_msg(LOG_ERROR, "Could not create client threads.");
+        exit(1);
+    }
+
+    log_msg(LOG_INFO, "Server listening on port %d with %d client threads", server_port, pool_threads);
 
     pollfd poll_fds[2];
     poll_fds[0].fd = listening_socket;
@@ -182,17 +193,7 @@ int main(int argc, char **argv) {
                 continue;
             }
 
-            pthread_t client_thread;
-            int *new_sock = (int *)malloc(sizeof(int));
-            *new_sock = client_socket;
-
-            if (pthread_create(&client_thread, NULL, client_handler, (void *)new_sock) < 0) {
-                log_msg(LOG_ERROR, "Could not create thread for client.");
-                close(client_socket);
-                continue;
-            }
-
-            pthread_detach(client_thread);
+            pool_submit(pool, client_socket);
         }
 
         if (poll_fds[1].revents & POLLIN) {